@@ -0,0 +1,19 @@
+/* 
+ *	Filename:	bench.h
+ *	Author:	 	Jess Ferguson
+ *	Date:		14/10/26
+ *	Licence:	GNU GPL V3
+ *
+ *	Throughput benchmark for the huffman test driver
+ *
+ *	Interface Functions:
+ *		- run_benchmark()	- Benchmark and validate every argument, a number being a size of synthetic corpora to generate and anything else a file. Writes a CSV line per buffer to results_filename unless it's NULL. Returns the number of failures.
+ *
+ */
+
+#ifndef BENCH_H
+#define BENCH_H
+
+int run_benchmark(const int argc, char ** argv, const char * results_filename);
+
+#endif
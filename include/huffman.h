@@ -6,16 +6,70 @@
  *
  *	Encode and decode a byte stream using Huffman coding
  *
+ *	Every function is reentrant and keeps no global state, so separate buffers can be encoded and decoded from multiple threads at once.
+ *	The only exception is the per thread counters of builds with HUFFMAN_STATS defined, which are never shared between threads either.
+ *	A huffman_decoder_t is never modified after huffman_decoder_create() and can be shared between threads.
+ *
  *	Return/exit codes:
  *		EXIT_SUCCESS	- No error
  *		MEM_ERROR		- Memory allocation error
- *		INPUT_ERROR		- Input buffer is empty or produces an encoding tree deeper than MAX_CODE_LENGTH
- *		LENGTH_ERROR	- Length of the decoding buffer is less than the length required to decode the input
+ *		INPUT_ERROR		- Input buffer is empty, has more unique bytes than there are codes of the maximum code length, or is truncated or corrupt
+ *		LENGTH_ERROR	- Length of the decoding buffer is less than the length required to decode the input, or a length doesn't fit in the return type
+ *		WRITE_ERROR		- A stream's write callback reported an error
+ *
+ *	Functions returning int sizes are limited to INT_MAX bytes. The huffman_compress() family takes and returns size_t lengths and
+ *	only ever returns an error code, inputs larger than 4 GB are stored with a 64-bit length in the header.
  *
  *	Interface Functions:
  *		- huffman_encode()						- Encodes a string using Huffman coding. Returns the size of the compressed data or an error code.
+ *		- huffman_encode_limited()				- Encodes a string using Huffman coding with codes no longer than max_code_length (1-16) bits.
+ *		- huffman_encode_with_options()			- Encodes a string using Huffman coding with the given options, or the defaults if options is NULL.
+ *		- huffman_encode_to_existing_buffer()	- Encodes a string using Huffman coding to a pre-allocated buffer of at least huffman_compress_bound() bytes.
  *		- huffman_decode()						- Decodes a Huffman encoded string. Returns the size of the decompressed data or an error code.
  *		- huffman_decode_to_existing_buffer()	- Decode a Huffman encoded string to a pre-allocated buffer.
+ *		- huffman_histogram()					- Count the occurrences of every byte value in a buffer. Returns the number of unique bytes.
+ *		- huffman_compress()					- Encodes a buffer of any size using Huffman coding. Returns an error code, the size of the compressed data is stored in output_length.
+ *		- huffman_compress_to_existing_buffer()	- Encodes a buffer of any size to a pre-allocated buffer, huffman_compress_bound() bytes is always enough.
+ *		- huffman_compress_bound()				- The largest size huffman_compress() can produce for an input of a given length.
+ *		- huffman_estimate_size()				- Calculate the exact size huffman_compress() would produce without encoding anything.
+ *		- huffman_estimate_size_from_histogram()	- Calculate the size huffman_compress() would produce from a byte histogram, at most one byte over per extra stream. A histogram has no contexts, so context_tables is ignored.
+ *		- huffman_decompress()					- Decodes a Huffman encoded buffer of any size. Returns an error code, the size of the decompressed data is stored in output_length.
+ *		- huffman_decompress_to_existing_buffer()	- Decode a Huffman encoded buffer of any size to a pre-allocated buffer.
+ *		- huffman_decompressed_length()			- Read the decompressed size of a Huffman encoded buffer from its header.
+ *		- huffman_decode_range()				- Decode length bytes starting at offset from a Huffman encoded buffer, quickly if it was encoded with a seek index.
+ *		- huffman_decoder_create()				- Build a reusable decoding context from the header of a Huffman encoded string.
+ *		- huffman_decoder_decode()				- Decode a Huffman encoded string to a pre-allocated buffer using a decoding context.
+ *		- huffman_decoder_decompress()			- Decode a Huffman encoded buffer of any size to a pre-allocated buffer using a decoding context.
+ *		- huffman_decoder_decode_range()		- Decode length bytes starting at offset from a Huffman encoded buffer using a decoding context.
+ *		- huffman_decoder_destroy()				- Free a decoding context.
+ *		- huffman_decoder_decompress_block()	- Decode a block from huffman_encoder_compress(), replacing *decoder (NULL at first) with one built from the block unless it repeats the last table.
+ *		- huffman_encoder_create()				- Create an encoding context for a series of blocks.
+ *		- huffman_encoder_compress()			- Encodes a block like huffman_compress_to_existing_buffer(), leaving out the table whenever the last one coded is cheaper.
+ *		- huffman_encoder_destroy()				- Free an encoding context.
+ *		- huffman_dictionary_train()			- Build a dictionary from sample data, all 256 bytes get codes of at most max_code_length (8-16, 0 for 16) bits.
+ *		- huffman_dictionary_save()				- Serialise a dictionary so it can be shared between encoder and decoder.
+ *		- huffman_dictionary_load()				- Rebuild a dictionary from the output of huffman_dictionary_save().
+ *		- huffman_dictionary_id()				- Identifier of a dictionary's code table, equal for dictionaries with the same codes.
+ *		- huffman_dictionary_encode()			- Encodes a message with a dictionary's codes and no header. The caller must keep the message length.
+ *		- huffman_dictionary_decode()			- Decodes a message encoded with the same dictionary to a pre-allocated buffer of decompressed_length bytes.
+ *		- huffman_dictionary_destroy()			- Free a dictionary.
+ *		- huffman_stream_init()					- Start compressing or decompressing a stream in blocks, output is passed to the write callback as each block completes. On error *stream is set to NULL and nothing needs freeing.
+ *		- huffman_stream_update()				- Feed the next part of a stream, of any length.
+ *		- huffman_stream_finish()				- Flush the last block and free the stream. Must be called after every successful huffman_stream_init(), even if a later update failed. Does nothing for NULL.
+ *		- huffman_encode_parallel()				- Encodes a buffer as independent blocks of block_size bytes (default 1 MB) on thread_count threads (default one per processor).
+ *		- huffman_decode_parallel()				- Decodes a buffer produced by huffman_encode_parallel() on thread_count threads (default one per processor).
+ *		- huffman_encode_batch()				- Encodes count messages into one arena, message i ends up between offsets[i] and offsets[i + 1] (count + 1 entries). The arena is followed by 8 bytes of padding that must be kept with it.
+ *		- huffman_decode_batch()				- Decodes an arena produced by huffman_encode_batch(), padding included, into one output arena, laid out by output_offsets the same way.
+ *		- huffman_lz_compress()					- Removes repeated strings with LZ77 then Huffman codes the literals, lengths and distances, much like DEFLATE.
+ *		- huffman_lz_decompress()				- Decodes a buffer produced by huffman_lz_compress(), the output is allocated with malloc().
+ *		- huffman_stats_read()					- Copy the counters of all the work done on the calling thread since it started or last reset them. HUFFMAN_STATS builds only.
+ *		- huffman_stats_reset()					- Zero the calling thread's counters. HUFFMAN_STATS builds only.
+ *
+ *	Statistics:
+ *		Build the library and its callers with HUFFMAN_STATS defined (make STATS=1) to count cycles spent in each phase of encoding and
+ *		decoding. Counters are kept per thread and only ever added to, so huffman_encode_parallel() and huffman_decode_parallel() count their
+ *		work on their own worker threads. Without HUFFMAN_STATS none of it is compiled in and there is no cost at all. Cycles come from the
+ *		time stamp counter on x86 and are zero elsewhere.
  *
  */
 
@@ -24,6 +78,7 @@
 
 /* Header files */
 
+#include <stddef.h>
 #include <stdint.h>
 
 /* Return values */
@@ -31,12 +86,144 @@
 #define MEM_ERROR		-1
 #define INPUT_ERROR		-2
 #define LENGTH_ERROR	-3
+#define WRITE_ERROR		-4
+
+/* Allocator for encoded output, so it can come from the caller's own buffer pools */
+
+typedef struct huffman_allocator_t {
+	void * (*alloc)(void * context, size_t size);
+	void (*free)(void * context, void * ptr);
+	void * context; /* Passed to both callbacks */
+} huffman_allocator_t;
+
+/* Encoder options, zero for any field selects its default */
+
+#define HUFFMAN_MAX_STREAMS 8
+#define HUFFMAN_LZ_MAX_WINDOW (1 << 24)
+
+typedef struct huffman_options_t {
+	uint8_t max_code_length; /* Longest code the encoder may use, 1-16 (default 16) */
+	uint8_t stream_count; /* Number of streams the payload is split into so they can be decoded in parallel, 1-HUFFMAN_MAX_STREAMS (default 1) */
+	uint32_t index_interval; /* Decompressed bytes between the seek points used by huffman_decode_range(), or 0 for no seek index (default) */
+	uint8_t context_tables; /* Most code tables to switch between by previous byte, 2-16, used when that beats a single table, or 0 for a single table (default). Single stream blocks with no seek index only */
+	uint32_t lz_window; /* Furthest back huffman_lz_compress() looks for a match, a power of two from 256 to HUFFMAN_LZ_MAX_WINDOW bytes (default 1 MB) */
+	uint16_t lz_chain_length; /* Most earlier strings huffman_lz_compress() compares against at each byte, more finds longer matches but takes longer (default 32) */
+	const huffman_allocator_t * allocator; /* Allocates the output of huffman_compress(), which must then be released with its free callback, or NULL for malloc() (default) */
+} huffman_options_t;
+
+/* Decoder flags */
+
+#define HUFFMAN_TWO_LEVEL_TABLE	0x1 /* Use a small primary table that fits in L1 with second level tables for long codes */
+#define HUFFMAN_VECTOR_DECODE	0x2 /* Decode multi-stream blocks with AVX2 gathers when the processor has AVX2, the scalar loop otherwise */
+
+/* Decoding context, built once from a header and reused for every string encoded with the same header */
+
+typedef struct huffman_decoder_t huffman_decoder_t;
+
+/* Encoding context for a series of blocks, a block may reuse the table of the last block with one instead of storing its own */
+
+typedef struct huffman_encoder_t huffman_encoder_t;
+
+/* Dictionary trained from sample data, built once and shared by every message encoded with it so messages need no header or table construction */
+
+typedef struct huffman_dictionary_t huffman_dictionary_t;
+
+/* Streaming, the input is split into blocks of block_size bytes (default 128 KB) that are compressed independently */
+
+#define HUFFMAN_STREAM_COMPRESS		0
+#define HUFFMAN_STREAM_DECOMPRESS	1
+
+typedef struct huffman_stream_t huffman_stream_t;
+typedef int (*huffman_write_t)(void * context, const uint8_t * data, const size_t length); /* Returns zero on success */
+
+/* Batches, many small messages encoded or decoded in a single call with one output allocation */
+
+#define HUFFMAN_BATCH_SHARED_TABLE	0x1 /* Build one code table for the whole batch and store it once in front of headerless messages */
+
+typedef struct huffman_span_t {
+	const uint8_t * data;
+	size_t length;
+} huffman_span_t;
 
 /* Interface Functions */
 
 int huffman_decode(const uint8_t * input, uint8_t ** output);
 int huffman_encode(const uint8_t * input, uint8_t ** output, const uint32_t decompressed_length);
+int huffman_encode_limited(const uint8_t * input, uint8_t ** output, const uint32_t decompressed_length, const uint8_t max_code_length);
+int huffman_encode_with_options(const uint8_t * input, uint8_t ** output, const uint32_t decompressed_length, const huffman_options_t * options);
 
+int huffman_encode_to_existing_buffer(const uint8_t * input, uint8_t * output, const uint32_t decompressed_length, const uint32_t output_length);
 int huffman_decode_to_existing_buffer(const uint8_t * input, uint8_t * output, const uint32_t output_length);
 
+int huffman_compress(const uint8_t * input, const size_t input_length, uint8_t ** output, size_t * output_length, const huffman_options_t * options);
+int huffman_compress_to_existing_buffer(const uint8_t * input, const size_t input_length, uint8_t * output, const size_t output_capacity, size_t * output_length, const huffman_options_t * options);
+size_t huffman_compress_bound(const size_t input_length);
+int huffman_estimate_size(const uint8_t * input, const size_t input_length, const huffman_options_t * options, size_t * estimated_length);
+int huffman_estimate_size_from_histogram(const size_t freq[256], const huffman_options_t * options, size_t * estimated_length);
+int huffman_decompress(const uint8_t * input, const size_t input_length, uint8_t ** output, size_t * output_length);
+int huffman_decompress_to_existing_buffer(const uint8_t * input, const size_t input_length, uint8_t * output, const size_t output_capacity, size_t * output_length);
+int huffman_decompressed_length(const uint8_t * input, const size_t input_length, size_t * decompressed_length);
+int huffman_decode_range(const uint8_t * input, const size_t input_length, const size_t offset, const size_t length, uint8_t * output);
+
+size_t huffman_histogram(const uint8_t * input, const size_t length, size_t freq[256]);
+
+int huffman_decoder_create(huffman_decoder_t ** decoder, const uint8_t * input, const size_t input_length, const int flags);
+int huffman_decoder_decode(const huffman_decoder_t * decoder, const uint8_t * input, uint8_t * output, const uint32_t output_length);
+int huffman_decoder_decompress(const huffman_decoder_t * decoder, const uint8_t * input, const size_t input_length, uint8_t * output, const size_t output_capacity, size_t * output_length);
+int huffman_decoder_decode_range(const huffman_decoder_t * decoder, const uint8_t * input, const size_t input_length, const size_t offset, const size_t length, uint8_t * output);
+void huffman_decoder_destroy(huffman_decoder_t * decoder);
+int huffman_decoder_decompress_block(huffman_decoder_t ** decoder, const int flags, const uint8_t * input, const size_t input_length, uint8_t * output, const size_t output_capacity, size_t * output_length);
+
+int huffman_encoder_create(huffman_encoder_t ** encoder);
+int huffman_encoder_compress(huffman_encoder_t * encoder, const uint8_t * input, const size_t input_length, uint8_t * output, const size_t output_capacity, size_t * output_length, const huffman_options_t * options);
+void huffman_encoder_destroy(huffman_encoder_t * encoder);
+
+int huffman_dictionary_train(huffman_dictionary_t ** dictionary, const uint8_t * samples, const size_t samples_length, const uint8_t max_code_length);
+int huffman_dictionary_save(const huffman_dictionary_t * dictionary, uint8_t ** output, size_t * output_length);
+int huffman_dictionary_load(huffman_dictionary_t ** dictionary, const uint8_t * input, const size_t input_length);
+uint32_t huffman_dictionary_id(const huffman_dictionary_t * dictionary);
+int huffman_dictionary_encode(const huffman_dictionary_t * dictionary, const uint8_t * input, const size_t input_length, uint8_t ** output, size_t * output_length);
+int huffman_dictionary_decode(const huffman_dictionary_t * dictionary, const uint8_t * input, const size_t input_length, uint8_t * output, const size_t decompressed_length);
+void huffman_dictionary_destroy(huffman_dictionary_t * dictionary);
+
+int huffman_stream_init(huffman_stream_t ** stream, const int mode, const size_t block_size, const huffman_options_t * options, huffman_write_t write, void * context);
+int huffman_stream_update(huffman_stream_t * stream, const uint8_t * input, size_t length);
+int huffman_stream_finish(huffman_stream_t * stream);
+
+int huffman_encode_parallel(const uint8_t * input, const size_t input_length, uint8_t ** output, size_t * output_length, const huffman_options_t * options, size_t block_size, const unsigned thread_count);
+int huffman_decode_parallel(const uint8_t * input, const size_t input_length, uint8_t ** output, size_t * output_length, const unsigned thread_count);
+
+int huffman_encode_batch(const huffman_span_t * inputs, const size_t count, uint8_t ** output, size_t offsets[], const huffman_options_t * options, const int flags);
+int huffman_decode_batch(const uint8_t * input, const size_t offsets[], const size_t count, uint8_t ** output, size_t output_offsets[]);
+
+int huffman_lz_compress(const uint8_t * input, const size_t input_length, uint8_t ** output, size_t * output_length, const huffman_options_t * options);
+int huffman_lz_decompress(const uint8_t * input, const size_t input_length, uint8_t ** output, size_t * output_length);
+
+#ifdef HUFFMAN_STATS
+
+/* Per thread counters, every field is a running total apart from max_code_length */
+
+typedef struct huffman_stats_t {
+	uint64_t histogram_cycles; /* Counting the bytes of each stream */
+	uint64_t tree_cycles; /* Building Huffman trees and their code lengths, including limiting them with package-merge */
+	uint64_t code_table_cycles; /* Assigning canonical codes, planning the header and working out the block's exact length */
+	uint64_t context_cycles; /* Clustering contexts and building their tables, only when context_tables is set */
+	uint64_t header_cycles; /* Writing headers and code lengths */
+	uint64_t payload_cycles; /* Writing encoded data and seek indexes, or copying out a stored block */
+	uint64_t blocks_encoded; /* Blocks written by the huffman_compress() family, dictionary and batch messages aren't blocks */
+	uint64_t encode_input_bytes; /* Bytes of input in those blocks */
+	uint64_t encode_output_bytes; /* Bytes those blocks came to, headers included */
+	uint64_t header_bits; /* Bits of code lengths and context maps written, not counting the fixed size part of each header */
+	uint8_t max_code_length; /* Longest code in any of those blocks */
+	uint64_t decoding_table_cycles; /* Building decoding tables */
+	uint64_t decode_cycles; /* Decoding loops, of every kind of decode */
+	uint64_t decode_input_bits; /* Encoded bits read by the decoding loops */
+	uint64_t decode_output_bytes; /* Bytes written by the decoding loops, stored blocks are copied rather than decoded and aren't counted */
+} huffman_stats_t;
+
+void huffman_stats_read(huffman_stats_t * stats);
+void huffman_stats_reset(void);
+
+#endif
+
 #endif
@@ -0,0 +1,22 @@
+/* 
+ *	Filename:	pipeline.h
+ *	Author:	 	Jess Ferguson
+ *	Date:		14/10/26
+ *	Licence:	GNU GPL V3
+ *
+ *	Pipelined file compression for the huffman test driver
+ *
+ *	Interface Functions:
+ *		- pipeline_file()	- Compress or decompress a file in blocks, with a reader thread, thread_count coding threads (every processor if zero) and the calling thread writing blocks out in order. Returns 0 with the lengths of both files, or -1 after printing why it failed.
+ *
+ */
+
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+int pipeline_file(const char * input_filename, const char * output_filename, const bool decompress, const unsigned thread_count, size_t * input_length, size_t * output_length);
+
+#endif
@@ -0,0 +1,988 @@
+/* 
+ *	Filename:	bench.c
+ *	Author:	 	Jess Ferguson
+ *	Date:		14/10/26
+ *	Licence:	GNU GPL V3
+ *
+ *	Measure encoding and decoding throughput on synthetic corpora and files, and check that each of them round trips through every mode
+ *
+ *	Internal Functions:
+ *		- now()					- Current time in seconds from a monotonic clock
+ *		- read_cycles()			- Current value of the processor's cycle counter, or zero without one
+ *		- mark()				- Take the time and cycle count together
+ *		- keep_fastest()		- Record the time between two marks if it beats the fastest so far
+ *		- keep_fastest_cycles()	- Record a phase counted by the library in cycles, converted to seconds at the rate measured between two marks. HUFFMAN_STATS builds only
+ *		- next_random()			- Step a xorshift generator, so every run benchmarks the same corpora
+ *		- generate_fibonacci()	- Fill a buffer with bytes at Fibonacci frequencies, shuffled
+ *		- fill_corpus()			- Fill a buffer with one of the synthetic corpora, carrying on from a generator's state
+ *		- generate_corpus()		- Fill a buffer with one of the synthetic corpora from a fixed seed
+ *		- parse_size()			- Read a size with an optional K, M or G suffix
+ *		- write_sink()			- Stream write callback that appends to a growing buffer
+ *		- feed_stream()			- Pass a buffer through a huffman_stream_t in updates of odd sizes
+ *		- block_round_trips()	- Round trip a buffer through huffman_compress(), the one-shot decoder, a huffman_decoder_t and the seek index
+ *		- lz_round_trips()		- Round trip a buffer through huffman_lz_compress()
+ *		- stream_round_trips()	- Round trip a buffer through the streaming API in both directions
+ *		- parallel_round_trips()	- Round trip a buffer through huffman_encode_parallel() on one thread and on several, which must agree byte for byte
+ *		- dictionary_round_trips()	- Round trip a buffer as messages through a dictionary trained on its first half
+ *		- batch_round_trips()	- Round trip a buffer as a batch of messages of batch_message_lengths, empty ones included
+ *		- repeat_table_round_trips()	- Round trip a buffer, then a shifted copy of it, then the buffer again as blocks through one encoder and one decoder
+ *		- create_temporary()	- Make an empty temporary file from a template, optionally filled with a buffer
+ *		- load_file()			- Read a whole file into a new buffer
+ *		- pipeline_round_trips()	- Round trip a buffer through pipeline_file() both ways, checking the compressed file with the streaming API in between
+ *		- round_trips()			- Compress and decompress a buffer with one configuration and compare the result
+ *		- validate_buffer()		- Round trip a buffer through every configuration, returns the number that fail
+ *		- write_result()		- Append one line for a buffer to the results file
+ *		- bench_buffer()		- Time every phase of encoding and decoding one buffer, validate it and report the results
+ *		- bench_file()			- Benchmark a whole file
+ *
+ *	Corpora:
+ *		- Text: Words of English letters at their usual frequencies, most codes are 3-6 bits
+ *		- Skewed: Geometrically distributed bytes, long codes for the rare ones
+ *		- Uniform: Random bytes, stored raw since Huffman coding can't make them smaller
+ *		- Single: One byte value repeated, the degenerate tree with a single symbol
+ *		- Fibonacci: Byte k appears as often as the kth Fibonacci number, the tree this builds is as deep as there are symbols so the code lengths have to be limited to MAX_CODE_LENGTH
+ *		- Mixed: The other corpora in turn, MIXED_CHUNK_LENGTH bytes at a time, so the statistics change part way through like they do in real files. One generator runs through every chunk, so no two chunks of the same corpus are copies
+ *		- Files named on the command line are benchmarked as they are, for standard corpora such as Silesia
+ *
+ *	Phases:
+ *		- Histogram, decoder table and decode loop are timed through the public function that runs each on its own
+ *			- Histogram: huffman_histogram()
+ *			- Decoder table: huffman_decoder_create()
+ *			- Decode loop: huffman_decoder_decompress()
+ *		- With HUFFMAN_STATS (make STATS=1) the encoding phases are read from the library's own counters around huffman_compress_to_existing_buffer()
+ *			- Tree build: tree_cycles, building the tree and limiting its code lengths
+ *			- Table build: code_table_cycles, assigning canonical codes and planning the header
+ *			- Bit writing: header_cycles and payload_cycles together
+ *		- Without it the tree and table can't be told apart, so they're timed together and bit writing is only derived
+ *			- Code lengths: huffman_estimate_size_from_histogram(), which builds the tree, limits it and plans the header
+ *			- Bit writing (derived): What's left of huffman_compress_to_existing_buffer() after the histogram and code lengths
+ *		- Every timing is the fastest of at least BENCH_MIN_RUNS runs, repeated until BENCH_MIN_SECONDS have passed
+ *
+ *	Validation:
+ *		- Every buffer is also round tripped through each of validation_configs
+ *			- Blocks: multi-stream, limited, seek indexed and context modelled, through both the one-shot decoder and huffman_decoder_t
+ *			- LZ77
+ *			- Streams, fed in updates of stream_update_lengths so blocks of VALIDATION_STREAM_BLOCK_SIZE are split across calls
+ *			- Parallel blocks of VALIDATION_PARALLEL_BLOCK_SIZE, encoded on 1 and VALIDATION_THREADS threads
+ *			- Messages of up to VALIDATION_MESSAGE_LENGTH bytes, encoded by a saved and reloaded dictionary and decoded by the original
+ *			- Batches, with a table per message and with one shared table
+ *			- Blocks of VALIDATION_REPEAT_BLOCK_SIZE through huffman_encoder_compress(), with the distribution shifted part way through so repeated tables have to be dropped and picked up again
+ *			- Temporary files through the pipeline on VALIDATION_THREADS threads
+ *		- A buffer only passes if every configuration gives back the exact input
+ *
+ *	Results file:
+ *		- Optional CSV with a header line and then one line per buffer, so runs from two builds can be compared by a script
+ *		- Columns: case, bytes, compressed bytes, ratio, round trip (pass or fail), then MB/s for each phase in the order of phase_names
+ *		- A buffer that fails still gets its line, with zero for every throughput
+ *
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <float.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_CYCLE_COUNTER
+#endif
+
+#include "bench.h"
+#include "huffman.h"
+#include "pipeline.h"
+
+#define BENCH_MIN_RUNS 3
+#define BENCH_MIN_SECONDS 0.5
+#define MIXED_CHUNK_LENGTH (16 * 1024)
+#define VALIDATION_INDEX_INTERVAL 4096
+#define VALIDATION_STREAM_BLOCK_SIZE 4099 /* Odd, so no update size lines up with it */
+#define VALIDATION_PARALLEL_BLOCK_SIZE 8191 /* Small, so even short buffers are split over every thread */
+#define VALIDATION_THREADS 4
+#define VALIDATION_MESSAGE_LENGTH 500
+#define VALIDATION_REPEAT_BLOCK_SIZE 2048
+
+#define CORPUS_TEXT 0
+#define CORPUS_SKEWED 1
+#define CORPUS_UNIFORM 2
+#define CORPUS_SINGLE 3
+#define CORPUS_FIBONACCI 4
+#define CORPUS_MIXED 5
+#define CORPUS_COUNT 6
+
+#define PATH_BLOCK 0 /* Ways validation can round trip a buffer */
+#define PATH_LZ 1
+#define PATH_STREAM 2
+#define PATH_PARALLEL 3
+#define PATH_DICTIONARY 4
+#define PATH_BATCH 5
+#define PATH_REPEAT_TABLE 6
+#define PATH_PIPELINE 7
+
+#define PHASE_ENCODE 0
+#define PHASE_DECODE 1
+#define PHASE_HISTOGRAM 2
+
+#ifdef HUFFMAN_STATS
+#define PHASE_TREE_BUILD 3
+#define PHASE_TABLE_BUILD 4
+#define PHASE_BIT_WRITING 5
+#define PHASE_DECODER_TABLE 6
+#define PHASE_DECODE_LOOP 7
+#define PHASE_COUNT 8
+#else
+#define PHASE_CODE_LENGTHS 3
+#define PHASE_BIT_WRITING 4 /* Derived from the other phases */
+#define PHASE_DECODER_TABLE 5
+#define PHASE_DECODE_LOOP 6
+#define PHASE_COUNT 7
+#endif
+
+/* Time and cycle count at one point, or between two */
+
+typedef struct bench_mark_t {
+	double seconds;
+	uint64_t cycles;
+} bench_mark_t;
+
+/* One way of compressing and decompressing a buffer that validation checks */
+
+typedef struct bench_config_t {
+	const char * name;
+	huffman_options_t options;
+	int flags; /* Flags for huffman_decoder_create(), or for huffman_encode_batch() on the batch path */
+	int path; /* Which API the buffer goes through */
+} bench_config_t;
+
+/* Everything a stream has written so far */
+
+typedef struct bench_sink_t {
+	uint8_t * data;
+	size_t length;
+	size_t capacity;
+} bench_sink_t;
+
+static const char * corpus_names[CORPUS_COUNT] = { "text", "skewed", "uniform", "single", "fibonacci", "mixed" };
+#ifdef HUFFMAN_STATS
+static const char * phase_names[PHASE_COUNT] = { "Encode", "Decode", "Histogram", "Tree build", "Table build", "Bit writing", "Decoder table", "Decode loop" };
+static const char * phase_columns[PHASE_COUNT] = { "encode_mbps", "decode_mbps", "histogram_mbps", "tree_build_mbps", "table_build_mbps", "bit_writing_mbps", "decoder_table_mbps", "decode_loop_mbps" };
+#else
+static const char * phase_names[PHASE_COUNT] = { "Encode", "Decode", "Histogram", "Code lengths", "Bit writing (derived)", "Decoder table", "Decode loop" };
+static const char * phase_columns[PHASE_COUNT] = { "encode_mbps", "decode_mbps", "histogram_mbps", "code_lengths_mbps", "bit_writing_derived_mbps", "decoder_table_mbps", "decode_loop_mbps" };
+#endif
+
+static const bench_config_t validation_configs[] = {
+	{ .name = "default" },
+	{ .name = "4 streams", .options = { .stream_count = 4 } },
+	{ .name = "8 streams with the vector decoder", .options = { .stream_count = 8 }, .flags = HUFFMAN_VECTOR_DECODE },
+	{ .name = "11 bit codes with a two level table", .options = { .max_code_length = 11 }, .flags = HUFFMAN_TWO_LEVEL_TABLE },
+	{ .name = "seek index", .options = { .index_interval = VALIDATION_INDEX_INTERVAL } },
+	{ .name = "context tables", .options = { .context_tables = 4 } },
+	{ .name = "LZ77", .path = PATH_LZ },
+	{ .name = "a stream in odd sized updates", .path = PATH_STREAM },
+	{ .name = "parallel blocks on 1 and 4 threads", .path = PATH_PARALLEL },
+	{ .name = "a 12 bit dictionary", .options = { .max_code_length = 12 }, .path = PATH_DICTIONARY },
+	{ .name = "a batch", .path = PATH_BATCH },
+	{ .name = "a batch with a shared table", .flags = HUFFMAN_BATCH_SHARED_TABLE, .path = PATH_BATCH },
+	{ .name = "repeated tables across a distribution shift", .path = PATH_REPEAT_TABLE },
+	{ .name = "the file pipeline", .path = PATH_PIPELINE }
+};
+static const size_t stream_update_lengths[] = { 1, 7, 4093, 65537, 3 };
+static const size_t batch_message_lengths[] = { 0, 1, 37, 0, 0, 300, 4099, 2 };
+static const char * default_sizes[] = { "64K", "1M", "16M" };
+
+static const char english_letters[] = "abcdefghijklmnopqrstuvwxyz";
+static const uint8_t english_frequencies[] = { 82, 15, 28, 43, 127, 22, 20, 61, 70, 2, 8, 40, 24, 67, 75, 19, 1, 60, 63, 91, 28, 10, 24, 2, 20, 1 }; /* Per thousand letters */
+
+/* Internal functions */
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static inline uint64_t read_cycles(void)
+{
+#ifdef HAVE_CYCLE_COUNTER
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+static inline bench_mark_t mark(void)
+{
+	return (bench_mark_t){ .seconds = now(), .cycles = read_cycles() };
+}
+
+static void keep_fastest(bench_mark_t * fastest, const bench_mark_t start, const bench_mark_t end)
+{
+	if(end.seconds - start.seconds < fastest->seconds) {
+		fastest->seconds = end.seconds - start.seconds;
+		fastest->cycles = end.cycles - start.cycles;
+	}
+}
+
+#ifdef HUFFMAN_STATS
+
+static void keep_fastest_cycles(bench_mark_t * fastest, const uint64_t cycles, const bench_mark_t start, const bench_mark_t end)
+{
+	double seconds = end.cycles > start.cycles ? cycles * (end.seconds - start.seconds) / (end.cycles - start.cycles) : 0; /* No cycle counter leaves every counted phase at zero */
+
+	if(seconds < fastest->seconds) {
+		fastest->seconds = seconds;
+		fastest->cycles = cycles;
+	}
+}
+
+#endif
+
+static inline uint64_t next_random(uint64_t * state)
+{
+	*state ^= *state << 13;
+	*state ^= *state >> 7;
+	*state ^= *state << 17;
+
+	return *state;
+}
+
+static void generate_fibonacci(uint8_t * buffer, const size_t length, uint64_t * state)
+{
+	size_t run = 1, next_run = 1;
+	uint8_t symbol = 0;
+
+	for(size_t i = 0; i < length; symbol++) { /* The last symbol gets whatever is left */
+		size_t count = run < length - i ? run : length - i;
+		size_t sum = run + next_run;
+
+		memset(&buffer[i], symbol, count);
+		i += count;
+		run = next_run;
+		next_run = sum;
+	}
+
+	for(size_t i = length; i-- > 1;) { /* Shuffle so the runs don't give the RLE or LZ77 paths an easy ride */
+		size_t j = next_random(state) % (i + 1);
+		uint8_t swap = buffer[i];
+
+		buffer[i] = buffer[j];
+		buffer[j] = swap;
+	}
+}
+
+static void fill_corpus(const int corpus, uint8_t * buffer, const size_t length, uint64_t * state)
+{
+	size_t word_length = 0;
+
+	if(corpus == CORPUS_FIBONACCI) {
+		generate_fibonacci(buffer, length, state);
+		return;
+	}
+
+	if(corpus == CORPUS_MIXED) {
+		for(size_t offset = 0, chunk = 0; offset < length; offset += MIXED_CHUNK_LENGTH, chunk++)
+			fill_corpus(chunk % CORPUS_MIXED, &buffer[offset], length - offset < MIXED_CHUNK_LENGTH ? length - offset : MIXED_CHUNK_LENGTH, state);
+
+		return;
+	}
+
+	for(size_t i = 0; i < length; i++) {
+		uint64_t random = next_random(state);
+
+		switch(corpus) {
+			case CORPUS_TEXT:
+				if(!word_length) { /* End every word with a space, and some sentences with a full stop and a new line */
+					buffer[i] = random % 64 ? ' ' : random % 3 ? '.' : '\n';
+					word_length = 1 + (random >> 8) % 9;
+				} else {
+					unsigned pick = (random >> 8) % 1000, letter = 0;
+
+					while(letter < sizeof(english_frequencies) - 1 && pick >= english_frequencies[letter])
+						pick -= english_frequencies[letter++];
+
+					buffer[i] = english_letters[letter];
+					word_length--;
+				}
+				break;
+
+			case CORPUS_SKEWED: {
+				uint8_t symbol = 0;
+
+				while(symbol < 255 && (random & 3) != 0) { /* Each byte value is three quarters as likely as the one before */
+					symbol++;
+					random >>= 2;
+
+					if(!random)
+						random = next_random(state);
+				}
+
+				buffer[i] = symbol;
+				break;
+			}
+
+			case CORPUS_SINGLE:
+				buffer[i] = 'a';
+				break;
+
+			default:
+				buffer[i] = random >> 32;
+		}
+	}
+}
+
+static void generate_corpus(const int corpus, uint8_t * buffer, const size_t length)
+{
+	uint64_t state = 0x9E3779B97F4A7C15ULL; /* Seeded once per buffer, so every run benchmarks the same bytes */
+
+	fill_corpus(corpus, buffer, length, &state);
+}
+
+static int parse_size(const char * argument, size_t * size)
+{
+	char * end;
+	unsigned long long value;
+	unsigned shift = 0;
+
+	errno = 0;
+	value = strtoull(argument, &end, 10);
+
+	if(end == argument || *argument == '-' || errno == ERANGE)
+		return -1;
+
+	switch(*end) {
+		case 'G': case 'g': shift += 10; /* Fall through */
+		case 'M': case 'm': shift += 10; /* Fall through */
+		case 'K': case 'k': shift += 10;
+			end++;
+	}
+
+	if(*end || !value || value > SIZE_MAX >> shift) /* Checked before shifting, so a huge count of gigabytes can't wrap round to a small size */
+		return -1;
+
+	*size = value << shift;
+
+	return 0;
+}
+
+static int write_sink(void * context, const uint8_t * data, const size_t length)
+{
+	bench_sink_t * sink = context;
+
+	if(length > sink->capacity - sink->length) {
+		size_t capacity = sink->capacity ? sink->capacity : 4096;
+		uint8_t * grown;
+
+		while(length > capacity - sink->length)
+			capacity *= 2;
+
+		if(!(grown = realloc(sink->data, capacity)))
+			return -1;
+
+		sink->data = grown;
+		sink->capacity = capacity;
+	}
+
+	memcpy(&sink->data[sink->length], data, length);
+	sink->length += length;
+
+	return 0;
+}
+
+static bool feed_stream(const int mode, const huffman_options_t * options, const uint8_t * input, const size_t length, bench_sink_t * sink)
+{
+	huffman_stream_t * stream;
+	int error = EXIT_SUCCESS;
+
+	if(huffman_stream_init(&stream, mode, VALIDATION_STREAM_BLOCK_SIZE, options, write_sink, sink) != EXIT_SUCCESS)
+		return false;
+
+	for(size_t offset = 0, update = 0; !error && offset < length; update++) {
+		size_t update_length = stream_update_lengths[update % (sizeof(stream_update_lengths) / sizeof(stream_update_lengths[0]))];
+
+		if(update_length > length - offset)
+			update_length = length - offset;
+
+		error = huffman_stream_update(stream, &input[offset], update_length);
+		offset += update_length;
+	}
+
+	return huffman_stream_finish(stream) == EXIT_SUCCESS && !error; /* Finished even after a failed update, so the stream is always freed */
+}
+
+static bool block_round_trips(const bench_config_t * config, const uint8_t * input, const size_t length)
+{
+	uint8_t * compressed = NULL, * decompressed = NULL;
+	size_t compressed_length, decompressed_length;
+	huffman_decoder_t * decoder;
+	bool passed;
+
+	if(huffman_compress(input, length, &compressed, &compressed_length, &config->options) != EXIT_SUCCESS)
+		return false;
+
+	passed = huffman_decompress(compressed, compressed_length, &decompressed, &decompressed_length) == EXIT_SUCCESS && decompressed_length == length && !memcmp(input, decompressed, length);
+
+	/* The same block again through a decoder, which is where the decoder flags take effect */
+
+	if(passed && (passed = huffman_decoder_create(&decoder, compressed, compressed_length, config->flags) == EXIT_SUCCESS)) {
+		memset(decompressed, 0, length);
+		passed = huffman_decoder_decompress(decoder, compressed, compressed_length, decompressed, length, &decompressed_length) == EXIT_SUCCESS && decompressed_length == length && !memcmp(input, decompressed, length);
+		huffman_decoder_destroy(decoder);
+	}
+
+	/* With a seek index, a range from the middle has to match without decoding what comes before it */
+
+	if(passed && config->options.index_interval && length > 2) {
+		size_t offset = length / 3, range_length = length / 3;
+
+		passed = huffman_decode_range(compressed, compressed_length, offset, range_length, decompressed) == EXIT_SUCCESS && !memcmp(&input[offset], decompressed, range_length);
+	}
+
+	free(compressed);
+	free(decompressed);
+
+	return passed;
+}
+
+static bool lz_round_trips(const bench_config_t * config, const uint8_t * input, const size_t length)
+{
+	uint8_t * compressed = NULL, * decompressed = NULL;
+	size_t compressed_length, decompressed_length;
+	bool passed;
+
+	if(huffman_lz_compress(input, length, &compressed, &compressed_length, &config->options) != EXIT_SUCCESS)
+		return false;
+
+	passed = huffman_lz_decompress(compressed, compressed_length, &decompressed, &decompressed_length) == EXIT_SUCCESS && decompressed_length == length && !memcmp(input, decompressed, length);
+
+	free(compressed);
+	free(decompressed);
+
+	return passed;
+}
+
+static bool stream_round_trips(const bench_config_t * config, const uint8_t * input, const size_t length)
+{
+	bench_sink_t compressed = { 0 }, decompressed = { 0 };
+	bool passed = feed_stream(HUFFMAN_STREAM_COMPRESS, &config->options, input, length, &compressed) && feed_stream(HUFFMAN_STREAM_DECOMPRESS, NULL, compressed.data, compressed.length, &decompressed);
+
+	passed = passed && decompressed.length == length && !memcmp(input, decompressed.data, length);
+
+	free(compressed.data);
+	free(decompressed.data);
+
+	return passed;
+}
+
+static bool parallel_round_trips(const bench_config_t * config, const uint8_t * input, const size_t length)
+{
+	uint8_t * serial = NULL, * threaded = NULL, * decompressed = NULL;
+	size_t serial_length, threaded_length, decompressed_length;
+	bool passed;
+
+	if(huffman_encode_parallel(input, length, &serial, &serial_length, &config->options, VALIDATION_PARALLEL_BLOCK_SIZE, 1) != EXIT_SUCCESS)
+		return false;
+
+	passed = huffman_encode_parallel(input, length, &threaded, &threaded_length, &config->options, VALIDATION_PARALLEL_BLOCK_SIZE, VALIDATION_THREADS) == EXIT_SUCCESS;
+	passed = passed && threaded_length == serial_length && !memcmp(serial, threaded, serial_length);
+	passed = passed && huffman_decode_parallel(threaded, threaded_length, &decompressed, &decompressed_length, VALIDATION_THREADS) == EXIT_SUCCESS;
+	passed = passed && decompressed_length == length && !memcmp(input, decompressed, length);
+
+	free(serial);
+	free(threaded);
+	free(decompressed);
+
+	return passed;
+}
+
+static bool dictionary_round_trips(const bench_config_t * config, const uint8_t * input, const size_t length)
+{
+	huffman_dictionary_t * trained, * loaded;
+	uint8_t * saved, * encoded, decoded[VALIDATION_MESSAGE_LENGTH];
+	size_t saved_length, encoded_length;
+	bool passed;
+
+	if(huffman_dictionary_train(&trained, input, length / 2 + 1, config->options.max_code_length) != EXIT_SUCCESS)
+		return false;
+
+	/* Encode with a copy that went through save and load, so both ends have to agree on the serialised table */
+
+	if((passed = huffman_dictionary_save(trained, &saved, &saved_length) == EXIT_SUCCESS)) {
+		passed = huffman_dictionary_load(&loaded, saved, saved_length) == EXIT_SUCCESS && huffman_dictionary_id(loaded) == huffman_dictionary_id(trained);
+		free(saved);
+	}
+
+	if(passed) {
+		for(size_t offset = 0; passed && offset < length; offset += VALIDATION_MESSAGE_LENGTH) {
+			size_t message_length = length - offset < VALIDATION_MESSAGE_LENGTH ? length - offset : VALIDATION_MESSAGE_LENGTH;
+
+			if(!(passed = huffman_dictionary_encode(loaded, &input[offset], message_length, &encoded, &encoded_length) == EXIT_SUCCESS))
+				break;
+
+			passed = huffman_dictionary_decode(trained, encoded, encoded_length, decoded, message_length) == EXIT_SUCCESS && !memcmp(&input[offset], decoded, message_length);
+			free(encoded);
+		}
+
+		huffman_dictionary_destroy(loaded);
+	}
+
+	huffman_dictionary_destroy(trained);
+
+	return passed;
+}
+
+static bool batch_round_trips(const bench_config_t * config, const uint8_t * input, const size_t length)
+{
+	size_t lengths_count = sizeof(batch_message_lengths) / sizeof(batch_message_lengths[0]);
+	size_t count = 0, * offsets = NULL, * output_offsets = NULL;
+	uint8_t * encoded = NULL, * decoded = NULL;
+	huffman_span_t * messages;
+	bool passed;
+
+	/* Cut the buffer into messages, the empty ones still take a slot */
+
+	for(size_t offset = 0; offset < length; count++)
+		offset += batch_message_lengths[count % lengths_count];
+
+	if(!(messages = calloc(count, sizeof(huffman_span_t))) || !(offsets = calloc(count + 1, sizeof(size_t))) || !(output_offsets = calloc(count + 1, sizeof(size_t)))) {
+		free(messages);
+		free(offsets);
+
+		return false;
+	}
+
+	for(size_t i = 0, offset = 0; i < count; i++) {
+		messages[i].data = &input[offset];
+		messages[i].length = length - offset < batch_message_lengths[i % lengths_count] ? length - offset : batch_message_lengths[i % lengths_count];
+		offset += messages[i].length;
+	}
+
+	passed = huffman_encode_batch(messages, count, &encoded, offsets, &config->options, config->flags) == EXIT_SUCCESS;
+	passed = passed && huffman_decode_batch(encoded, offsets, count, &decoded, output_offsets) == EXIT_SUCCESS;
+
+	for(size_t i = 0; passed && i < count; i++) /* The messages cover the buffer in order, so they decode to it in order */
+		passed = output_offsets[i + 1] - output_offsets[i] == messages[i].length;
+
+	passed = passed && output_offsets[count] == length && !memcmp(input, decoded, length);
+
+	free(messages);
+	free(offsets);
+	free(output_offsets);
+	free(encoded);
+	free(decoded);
+
+	return passed;
+}
+
+static bool repeat_table_round_trips(const bench_config_t * config, const uint8_t * input, const size_t length)
+{
+	uint8_t * shifted, * compressed = NULL, decompressed[VALIDATION_REPEAT_BLOCK_SIZE];
+	size_t capacity = huffman_compress_bound(VALIDATION_REPEAT_BLOCK_SIZE), compressed_length, decompressed_length;
+	huffman_encoder_t * encoder = NULL;
+	huffman_decoder_t * decoder = NULL;
+	bool passed = true;
+
+	if(!(shifted = malloc(length)) || !(compressed = malloc(capacity)) || huffman_encoder_create(&encoder) != EXIT_SUCCESS) {
+		free(shifted);
+		free(compressed);
+
+		return false;
+	}
+
+	/* Flipping the top bit moves every byte to a symbol the last table may have no code for */
+
+	for(size_t i = 0; i < length; i++)
+		shifted[i] = input[i] ^ 0x80;
+
+	/* Each block is decoded as soon as it is encoded, the decoder only ever sees the blocks in order */
+
+	for(int pass = 0; passed && pass < 3; pass++) {
+		const uint8_t * source = pass == 1 ? shifted : input;
+
+		for(size_t offset = 0; passed && offset < length; offset += VALIDATION_REPEAT_BLOCK_SIZE) {
+			size_t block_length = length - offset < VALIDATION_REPEAT_BLOCK_SIZE ? length - offset : VALIDATION_REPEAT_BLOCK_SIZE;
+
+			passed = huffman_encoder_compress(encoder, &source[offset], block_length, compressed, capacity, &compressed_length, &config->options) == EXIT_SUCCESS;
+			passed = passed && huffman_decoder_decompress_block(&decoder, config->flags, compressed, compressed_length, decompressed, sizeof(decompressed), &decompressed_length) == EXIT_SUCCESS;
+			passed = passed && decompressed_length == block_length && !memcmp(&source[offset], decompressed, block_length);
+		}
+	}
+
+	huffman_encoder_destroy(encoder);
+	huffman_decoder_destroy(decoder);
+	free(shifted);
+	free(compressed);
+
+	return passed;
+}
+
+static bool create_temporary(char * filename, const uint8_t * data, const size_t length)
+{
+	int fd = mkstemp(filename);
+	FILE * fp;
+
+	if(fd == -1)
+		return false;
+
+	if(!(fp = fdopen(fd, "wb"))) {
+		close(fd);
+		unlink(filename);
+		return false;
+	}
+
+	if((length && fwrite(data, 1, length, fp) != length) | (fclose(fp) == EOF)) { /* Closed either way */
+		unlink(filename);
+		return false;
+	}
+
+	return true;
+}
+
+static bool load_file(const char * filename, uint8_t ** data, size_t * length)
+{
+	FILE * fp;
+	long file_length;
+
+	if(!(fp = fopen(filename, "rb")))
+		return false;
+
+	if(fseek(fp, 0, SEEK_END) == -1 || (file_length = ftell(fp)) <= 0 || fseek(fp, 0, SEEK_SET) == -1 || !(*data = malloc(file_length))) {
+		fclose(fp);
+		return false;
+	}
+
+	if(fread(*data, 1, file_length, fp) != (size_t)file_length) {
+		free(*data);
+		fclose(fp);
+		return false;
+	}
+
+	fclose(fp);
+	*length = file_length;
+
+	return true;
+}
+
+static bool pipeline_round_trips(const bench_config_t * config, const uint8_t * input, const size_t length)
+{
+	char plain[] = "/tmp/huffman-bench-XXXXXX", packed[] = "/tmp/huffman-bench-XXXXXX", unpacked[] = "/tmp/huffman-bench-XXXXXX";
+	uint8_t * compressed = NULL, * decompressed = NULL;
+	size_t plain_length, compressed_length, decompressed_length;
+	bench_sink_t streamed = { 0 };
+	bool passed;
+
+	(void)config;
+
+	if(!create_temporary(plain, input, length))
+		return false;
+
+	if(!create_temporary(packed, NULL, 0)) {
+		unlink(plain);
+		return false;
+	}
+
+	if(!create_temporary(unpacked, NULL, 0)) {
+		unlink(plain);
+		unlink(packed);
+		return false;
+	}
+
+	/* The pipeline writes the same format as huffman_stream_t, so the streaming decoder has to read it too */
+
+	passed = !pipeline_file(plain, packed, false, VALIDATION_THREADS, &plain_length, &compressed_length) && load_file(packed, &compressed, &compressed_length);
+	passed = passed && feed_stream(HUFFMAN_STREAM_DECOMPRESS, NULL, compressed, compressed_length, &streamed) && streamed.length == length && !memcmp(input, streamed.data, length);
+	passed = passed && !pipeline_file(packed, unpacked, true, VALIDATION_THREADS, &compressed_length, &plain_length) && load_file(unpacked, &decompressed, &decompressed_length);
+	passed = passed && decompressed_length == length && !memcmp(input, decompressed, length);
+
+	unlink(plain);
+	unlink(packed);
+	unlink(unpacked);
+	free(compressed);
+	free(decompressed);
+	free(streamed.data);
+
+	return passed;
+}
+
+static bool round_trips(const bench_config_t * config, const uint8_t * input, const size_t length)
+{
+	switch(config->path) {
+		case PATH_LZ:
+			return lz_round_trips(config, input, length);
+
+		case PATH_STREAM:
+			return stream_round_trips(config, input, length);
+
+		case PATH_PARALLEL:
+			return parallel_round_trips(config, input, length);
+
+		case PATH_DICTIONARY:
+			return dictionary_round_trips(config, input, length);
+
+		case PATH_BATCH:
+			return batch_round_trips(config, input, length);
+
+		case PATH_REPEAT_TABLE:
+			return repeat_table_round_trips(config, input, length);
+
+		case PATH_PIPELINE:
+			return pipeline_round_trips(config, input, length);
+
+		default:
+			return block_round_trips(config, input, length);
+	}
+}
+
+static size_t validate_buffer(const char * name, const uint8_t * input, const size_t length)
+{
+	size_t failures = 0;
+
+	for(size_t i = 0; i < sizeof(validation_configs) / sizeof(validation_configs[0]); i++) {
+		if(!round_trips(&validation_configs[i], input, length)) {
+			fprintf(stderr, "[-] Error: %s did not round trip with %s!\n", name, validation_configs[i].name);
+			failures++;
+		}
+	}
+
+	return failures;
+}
+
+static void write_result(FILE * results, const char * name, const size_t length, const size_t compressed_length, const bool round_trip, const bench_mark_t fastest[PHASE_COUNT])
+{
+	if(!results)
+		return;
+
+	fprintf(results, "\"%s\",%zu,%zu,%.4f,%s", name, length, compressed_length, (double)compressed_length / length, round_trip ? "pass" : "fail");
+
+	for(size_t phase = 0; phase < PHASE_COUNT; phase++)
+		fprintf(results, ",%.1f", round_trip && fastest[phase].seconds > 0 ? length / fastest[phase].seconds / 1e6 : 0);
+
+	fputc('\n', results);
+}
+
+static int bench_buffer(const char * name, const uint8_t * input, const size_t length, FILE * results)
+{
+	bench_mark_t fastest[PHASE_COUNT];
+	bench_mark_t marks[7];
+	size_t freq[256];
+	size_t bound = huffman_compress_bound(length);
+	size_t compressed_length = 0, decompressed_length;
+	uint8_t * compressed = malloc(bound);
+	uint8_t * decompressed = malloc(length);
+	huffman_decoder_t * decoder;
+	int error = EXIT_SUCCESS;
+	double start = now();
+#ifdef HUFFMAN_STATS
+	huffman_stats_t stats;
+#else
+	size_t estimated_length;
+#endif
+
+	for(size_t phase = 0; phase < PHASE_COUNT; phase++)
+		fastest[phase] = (bench_mark_t){ .seconds = DBL_MAX, .cycles = 0 };
+
+	if(!compressed || !decompressed) {
+		fprintf(stderr, "[-] Error: Could not allocate memory to benchmark %s!\n", name);
+		write_result(results, name, length, 0, false, fastest);
+		free(compressed);
+		free(decompressed);
+		return -1;
+	}
+
+	for(size_t runs = 0; !error && (runs < BENCH_MIN_RUNS || now() - start < BENCH_MIN_SECONDS); runs++) {
+#ifdef HUFFMAN_STATS
+		huffman_stats_reset();
+#endif
+
+		marks[0] = mark();
+		error = huffman_compress_to_existing_buffer(input, length, compressed, bound, &compressed_length, NULL);
+		marks[1] = mark();
+
+#ifdef HUFFMAN_STATS
+		huffman_stats_read(&stats);
+#endif
+
+		if(!error)
+			error = huffman_decompress_to_existing_buffer(compressed, compressed_length, decompressed, length, &decompressed_length);
+
+		marks[2] = mark();
+		huffman_histogram(input, length, freq);
+		marks[3] = mark();
+
+#ifndef HUFFMAN_STATS
+		if(!error)
+			error = huffman_estimate_size_from_histogram(freq, NULL, &estimated_length);
+#endif
+
+		marks[4] = mark();
+
+		if(!error)
+			error = huffman_decoder_create(&decoder, compressed, compressed_length, 0);
+
+		marks[5] = mark();
+
+		if(!error) {
+			error = huffman_decoder_decompress(decoder, compressed, compressed_length, decompressed, length, &decompressed_length);
+			huffman_decoder_destroy(decoder);
+		}
+
+		marks[6] = mark();
+
+		keep_fastest(&fastest[PHASE_ENCODE], marks[0], marks[1]);
+		keep_fastest(&fastest[PHASE_DECODE], marks[1], marks[2]);
+		keep_fastest(&fastest[PHASE_HISTOGRAM], marks[2], marks[3]);
+#ifdef HUFFMAN_STATS
+		keep_fastest_cycles(&fastest[PHASE_TREE_BUILD], stats.tree_cycles, marks[0], marks[1]);
+		keep_fastest_cycles(&fastest[PHASE_TABLE_BUILD], stats.code_table_cycles, marks[0], marks[1]);
+		keep_fastest_cycles(&fastest[PHASE_BIT_WRITING], stats.header_cycles + stats.payload_cycles, marks[0], marks[1]);
+#else
+		keep_fastest(&fastest[PHASE_CODE_LENGTHS], marks[3], marks[4]);
+#endif
+		keep_fastest(&fastest[PHASE_DECODER_TABLE], marks[4], marks[5]);
+		keep_fastest(&fastest[PHASE_DECODE_LOOP], marks[5], marks[6]);
+	}
+
+	if(!error && (decompressed_length != length || memcmp(input, decompressed, length)))
+		error = INPUT_ERROR;
+
+	free(compressed);
+	free(decompressed);
+
+	if(error) {
+		fprintf(stderr, "[-] Error: Benchmark of %s failed (%d)!\n", name, error);
+		write_result(results, name, length, compressed_length, false, fastest);
+		return -1;
+	}
+
+	if(validate_buffer(name, input, length)) {
+		write_result(results, name, length, compressed_length, false, fastest);
+		return -1;
+	}
+
+#ifndef HUFFMAN_STATS
+	/* Whatever compression spends outside the histogram and code lengths */
+
+	fastest[PHASE_BIT_WRITING].seconds = fastest[PHASE_ENCODE].seconds - fastest[PHASE_HISTOGRAM].seconds - fastest[PHASE_CODE_LENGTHS].seconds;
+	fastest[PHASE_BIT_WRITING].cycles = fastest[PHASE_ENCODE].cycles - fastest[PHASE_HISTOGRAM].cycles - fastest[PHASE_CODE_LENGTHS].cycles;
+
+	if(fastest[PHASE_BIT_WRITING].seconds < 0 || fastest[PHASE_BIT_WRITING].cycles > fastest[PHASE_ENCODE].cycles)
+		fastest[PHASE_BIT_WRITING] = (bench_mark_t){ .seconds = 0, .cycles = 0 };
+#endif
+
+	printf("[+] %s: %zu -> %zu bytes, ratio %.3f\n", name, length, compressed_length, (double)compressed_length / length);
+
+	for(size_t phase = 0; phase < PHASE_COUNT; phase++) {
+		printf("\t%-21s %12.1f us %10.1f MB/s", phase_names[phase], fastest[phase].seconds * 1e6, fastest[phase].seconds > 0 ? length / fastest[phase].seconds / 1e6 : 0);
+
+#ifdef HAVE_CYCLE_COUNTER
+		printf(" %8.2f cycles/byte", (double)fastest[phase].cycles / length);
+#endif
+
+		putchar('\n');
+	}
+
+	write_result(results, name, length, compressed_length, true, fastest);
+
+	return 0;
+}
+
+static int bench_file(const char * filename, FILE * results)
+{
+	FILE * fp;
+	uint8_t * input;
+	long length;
+	int error;
+
+	if(!(fp = fopen(filename, "rb"))) {
+		fprintf(stderr, "Error: Could not open file \"%s\"!\n", filename);
+		perror("fopen()");
+		return -1;
+	}
+
+	if(fseek(fp, 0, SEEK_END) == -1 || (length = ftell(fp)) <= 0 || fseek(fp, 0, SEEK_SET) == -1) {
+		fprintf(stderr, "Error: Could not read the length of \"%s\", or it is empty!\n", filename);
+		fclose(fp);
+		return -1;
+	}
+
+	if(!(input = malloc(length)) || fread(input, 1, length, fp) != (size_t)length) { /* Read the whole file up front so the benchmark never waits on the disk */
+		fprintf(stderr, "Error: Could not read \"%s\"!\n", filename);
+		free(input);
+		fclose(fp);
+		return -1;
+	}
+
+	fclose(fp);
+
+	error = bench_buffer(filename, input, length, results);
+
+	free(input);
+
+	return error;
+}
+
+/* Interface functions */
+
+int run_benchmark(const int argc, char ** argv, const char * results_filename)
+{
+	FILE * results = NULL;
+	int failures = 0;
+	int count = argc ? argc : (int)(sizeof(default_sizes) / sizeof(default_sizes[0]));
+
+	if(results_filename) {
+		if(!(results = fopen(results_filename, "w"))) {
+			fprintf(stderr, "Error: Could not open file \"%s\"!\n", results_filename);
+			perror("fopen()");
+			return -1;
+		}
+
+		fprintf(results, "case,bytes,compressed_bytes,ratio,round_trip");
+
+		for(size_t phase = 0; phase < PHASE_COUNT; phase++)
+			fprintf(results, ",%s", phase_columns[phase]);
+
+		fputc('\n', results);
+	}
+
+	for(int i = 0; i < count; i++) {
+		const char * argument = argc ? argv[i] : default_sizes[i];
+		size_t size;
+
+		if(parse_size(argument, &size)) {
+			failures += bench_file(argument, results) != 0;
+			continue;
+		}
+
+		uint8_t * input;
+		char name[64];
+
+		if(!(input = malloc(size))) {
+			fprintf(stderr, "[-] Error: Could not allocate %zu bytes to benchmark!\n", size);
+			failures++;
+			continue;
+		}
+
+		for(int corpus = 0; corpus < CORPUS_COUNT; corpus++) {
+			snprintf(name, sizeof(name), "%s %s", corpus_names[corpus], argument);
+			generate_corpus(corpus, input, size);
+			failures += bench_buffer(name, input, size, results) != 0;
+		}
+
+		free(input);
+	}
+
+	if(results && fclose(results)) {
+		fprintf(stderr, "Error: Could not write \"%s\"!\n", results_filename);
+		failures++;
+	}
+
+	return failures;
+}
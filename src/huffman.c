@@ -9,16 +9,83 @@
  *	Internal Functions:
  *
  *		Encoding:
- *			- create_huffman_tree()		- Generate a Huffman tree from a frequency analysis
+ *			- leaf_compare()			- Order byte nodes by frequency
+ *			- create_huffman_tree()		- Generate a Huffman tree from a frequency analysis in a fixed node arena
  *			- create_encoding_table()	- Generate a "code array" from the huffman tree, used for fast encoding
- *			- node_compare()			- Calculate the difference in frequency between two nodes
- *			- create_byte_node()		- Generate a byte node
- *			- create_internal_node()	- Generate an internal node
- *			- destroy_huffman_tree()	- Traverses a Huffman tree and frees all memory associated with it
+ *			- validate_huffman_tree()	- Check that no byte node in a Huffman tree is deeper than a given limit
  *			- write_k_bits()			- Write an arbitrary number of bits to a buffer
+ *			- store_bit_buffer()		- Write eight bytes to a buffer
+ *			- bit_writer_init()			- Start writing bits to a buffer at any given bit offset
+ *			- bit_writer_write()		- Add up to 32 bits to a bit writer, storing the accumulator once it holds a full word
+ *			- bit_writer_flush()		- Write any bits left in a bit writer to its buffer
+ *			- encode_symbols()			- Write the encoded representation of a string to a buffer
+ *			- encode_context_symbols()	- Write the encoded representation of a string, coding each byte with the table its previous byte picks
+ *			- create_canonical_codes()	- Replace the codes in an encoding table with canonical codes of the same length
+ *			- create_code_lengths()		- Generate code lengths no longer than a given limit from a frequency analysis
+ *			- limit_code_lengths()		- Generate optimal code lengths no longer than a given limit using package-merge
+ *			- plan_code_lengths()		- Choose the smallest representation of the code lengths for the header
+ *			- write_code_lengths()		- Write the code lengths to the header
+ *			- code_table_id()			- Hash the code lengths of a code table, used to identify dictionaries
+ *			- write_dictionary()		- Write a code table in the dictionary format
+ *			- write_seek_index()		- Record the bit position of every seek point in the seek index
+ *			- stream_histograms()		- Count the bytes in each segment of the input that gets its own stream
+ *			- coded_block_length()		- Calculate the byte length of a Huffman coded block and each of its streams for a given code table
+ *			- can_repeat_table()		- Check that the previous block's table has a code for every byte in this one
+ *			- plan_block()				- Choose how to store a block and calculate its exact byte length from its histograms
+ *			- table_bit_length()		- Calculate the bits a code table costs, its code lengths and codes, for a histogram
+ *			- merged_bit_length()		- Calculate the bits a table built from two tables' combined histograms costs
+ *			- cluster_contexts()		- Group the previous byte contexts so the contexts in each group share a code table
+ *			- plan_context_block()		- Switch a plan to an order-1 context modelled block if that comes out smaller
+ *			- free_plan()				- Release the tables of a context modelled block plan
+ *			- store_block()				- Store the input as it is, or as a single repeated byte, when Huffman coding can't help
+ *			- write_context_block()		- Write a planned context modelled block
+ *			- write_block()				- Write a planned block to a buffer of exactly its planned length
+ *			- compress_block()			- Plan and write a block to a pre-allocated buffer, optionally reusing the previous block's table
+ *			- record_block_stats()		- Add a planned block's lengths, header size and longest code to the thread's counters, HUFFMAN_STATS builds only
  *
  *		Decoding:
- *			- peek_buffer()	- Read a two bytes from a buffer at any given bit offset
+ *			- peek_buffer()				- Read 16 bits from a buffer at any given bit offset, for the header fields
+ *			- refill_bit_buffer()		- Read eight bytes from a buffer at any given bit offset
+ *			- refill_bit_buffer_checked()	- Read up to eight bytes from a buffer at any given bit offset, as zeros past the end of the input
+ *			- unchecked_rounds()		- Count the rounds of lookups that can refill without reaching the end of the input
+ *			- read_k_bits()				- Read an arbitrary number of bits, at most 16, from a buffer
+ *			- read_canonical_symbol()	- Decode a single canonical code one bit at a time
+ *			- read_code_lengths()		- Read code lengths stored by write_code_lengths() and assign their canonical codes
+ *			- read_code_table()			- Extract the encoding representation of every byte from the header
+ *			- find_table_bits()			- Size a decoding table to the longest code it has to decode
+ *			- find_subtable_bits()		- Calculate the index size of every second level table
+ *			- count_decoding_entries()	- Calculate the number of entries a decoding table needs
+ *			- create_decoding_table()	- Generate a one or two level multi-symbol decoding table
+ *			- lookup_symbols()			- Find the decoding table entry for the next bits in the buffer
+ *			- decode_symbols_with()		- Decode the encoded data using a decoding table, specialised by inlining for a given table size
+ *			- decode_symbols()			- Decode the encoded data using a decoding table, with a copy of the loop for each single level table size
+ *			- lookup_symbols_avx2()		- Gather the decoding table entries for the next bits in four bit buffers at once
+ *			- decode_streams_avx2()		- Decode up to eight streams at once, one per vector lane, with AVX2 gathers
+ *			- decode_stream_rounds_with()	- Decode several streams in lockstep for as long as none can run out of room, specialised by inlining
+ *			- decode_stream_rounds()	- Run the lockstep rounds with the copy of the loop for the table's size
+ *			- decode_streams()			- Decode several streams of encoded data in lockstep using a decoding table
+ *			- decode_payload()			- Decode the encoded data in however many streams the header says it's split into
+ *			- decode_range()			- Decode part of the encoded data starting from the closest seek point or stream start
+ *			- decode_stored()			- Copy out part of a block stored without Huffman coding
+ *			- read_context_tables()		- Read the context map and every code table of a context modelled block
+ *			- decode_context_symbols()	- Decode the encoded data switching decoding tables on each previous byte
+ *			- decode_context_block()	- Build the decoding tables of a context modelled block and decode its first bytes
+ *			- decode_context_range()	- Decode part of a context modelled block, decoding everything before it to scratch
+ *			- build_dictionary()		- Derive the ID and decoding table of a dictionary from its code table
+ *			- read_batch_length()		- Check the header of a batch message stored without its padding and read its decompressed length
+ *			- decode_batch_message()	- Decode a batch message with a decoder reused across the batch, rebuilding its table only when the code lengths change
+ *
+ *		Header:
+ *			- jump_table_entry_length()		- Size of each stream size in the jump table
+ *			- store_length()				- Write a 32 or 64-bit length to a buffer
+ *			- load_length()					- Read a 32 or 64-bit length from a buffer
+ *			- header_base_size()			- Size of the header before the code lengths
+ *			- read_decompressed_length()	- Read the full decompressed length from the header
+ *			- header_end()					- Bit offset of the end of the header
+ *			- write_header_base()			- Write the decompressed length, header size and flags
+ *			- block_mode()					- How the payload of a block is stored
+ *			- seek_index_length()			- Size of a seek index for a given interval and decompressed length
+ *			- locate_streams()				- Find where the seek index and every stream start, checking each lies inside the input
  *
  *	Data structures:
  *
@@ -29,55 +96,231 @@
  *
  *		Decoding table:
  *			- Similar to the encoding table, it's provides a fast way to decode data using the information retrieved from the header and is an easy way to store a representation of the tree
- *			- Two bytes at a time are read from the input and only the lower bits will represent the current encoded character
- *			- This means that no matter what the upper bits are, the table is set up so that any two bytes that has in its lowest bits a valid encoding representation will always give the correct encoding character 
- *			- Position in the table (i.e. decoding_table[0-65536]) represents the byte to be encoded or an encoded byte
+ *			- The input is refilled eight bytes at a time into a 64-bit bit buffer, and each lookup takes its lowest k bits, where the next code starts
+ *			- Every index whose lowest bits hold a code gives that code whatever its upper bits are, so a lookup needs no code length up front
+ *			- A table indexed by k bits has 2^k entries (i.e. decoding_table[0-(2^k - 1)]), k is at most LOOKUP_BITS, and each entry gives the symbols it decodes and the bits they take
+ *			- If the bits left over after the first code are enough to hold a second complete code, the entry stores both symbols so one lookup emits two bytes
+ *			- Two level tables index the primary table with only 11 bits, codes longer than that are found by following a link to a second level table indexed by the remaining bits
+ *			- Single level tables are indexed by as many bits as the longest code, at least 12 so short codes still pair up, a block of short codes decodes from a table that fits in L1
+ *			- The decoding loops are specialised for each of those sizes, a refill holds 57 bits so a table of k bits gets 57 / k lookups per refill
+ *			- The primary table is filled one code length at a time, copying the filled part on top of itself before each new length, so every entry is written with wide stores and there is no need to clear the table first
+ *			- Each entry is exactly 32 bits so the vector decoder can gather entries straight out of the table
+ *
+ *		Vector decoding:
+ *			- Opt in with HUFFMAN_VECTOR_DECODE, picked at run time only when the processor has AVX2, and left out of builds with -DHUFFMAN_NO_SIMD
+ *			- Each stream of a multi-stream block gets a 64-bit lane, refilled and looked up with gathers, then its symbols are written out a lane at a time
+ *			- A block holds at most eight streams and every lane waits on its own lookups, so gather latency sets the pace. Where gathers are slow the scalar lockstep rounds are faster, which is why it isn't the default
+ *
+ *		Context model:
+ *			- Order-1, the previous byte is the context of the next one, so runs of text like "th" or "qu" get shorter codes than any single table can give them
+ *			- A table per context would cost more in code lengths than it saves, contexts with similar histograms are clustered to share at most 16 tables
+ *			- Every table is decoded with a two level table, the second symbol of a pair is only merged in when the first one picks the same table again
  *
  *		Huffman tree:
  *			- Binary tree that operates much like any other Huffman tree
  *			- Contains two types of nodes, internal nodes and byte nodes
  *			- Every node contains either the frequency of the byte it represents if it is a byte node or the combined frequencies of its child nodes if it is an internal node
+ *			- All nodes live in a caller provided arena, 256 byte nodes followed by at most 255 internal nodes, so building a tree never allocates
+ *			- Only the depth of each byte node is kept, the codes themselves are reassigned canonically
+ *
+ *		Dictionary:
+ *			- Code table trained once from sample data and shared by every message encoded with it, so messages carry no header and decoding builds no table
+ *			- Every byte is given a code, even those missing from the samples
+ *			- Identified by a hash of its code lengths, so the same table trained twice has the same ID
+ *
+ *		Canonical codes:
+ *			- Codes are assigned in order of (length, byte) so the code lengths alone are enough to rebuild every code
+ *			- Codes are stored bit reversed since the buffer is read from the lowest bit up
+ *
+ *		Statistics:
+ *			- Kept in a thread local huffman_stats_t, so counting never needs a lock and threads never share a cache line for it
+ *			- Phases are timed where they're already separate steps: plan_block() for trees and tables, write_block() for headers and payloads, and the decoding loops themselves so every kind of decode is counted
+ *			- Without HUFFMAN_STATS the STATS_* probes expand to nothing
  *
  *	Encoded data format:
  *
  *		- Header
- *			- Compressed string length (1x uint32_t)
- *			- Decompressed string length (1x uint32_t)
- *			- Header size (1x uint16_t)
- *			- Huffman tree stored as an encoding table (16 + (number of bits representing the encoded byte) bits per byte. Consists of the unencoded byte, the bit length of encoded representation, and the encoded representation)
+ *			- Decompressed string length, lower 32 bits (1x uint32_t)
+ *			- Header size in bits, not including these seven bytes or the length extension (1x uint16_t)
+ *			- Flags (1x uint8_t)
+ *				- Bits 0-2: Number of streams minus one
+ *				- Bit 3: Long lengths, the decompressed length and stream sizes are 64 bits
+ *				- Bit 4: Seek index, the payload is preceded by a seek index
+ *				- Bits 5-6: Block mode, 0 for Huffman coded, 1 for raw bytes, 2 for a single repeated byte, 3 for context modelled
+ *				- Bit 7: Repeat table, there are no code lengths and the header size is zero since the codes are those of the last block that had its own
+ *			- Decompressed string length, upper 32 bits, only with long lengths (1x uint32_t)
+ *			- Code lengths, preceded by a single bit selecting how they are stored
+ *				- Sparse (0): Number of encoded bytes minus one (8 bits), then the byte (8 bits) and its code length minus one (4 bits) for each encoded byte
+ *				- Run-length (1): Code lengths of all 256 bytes in order, Huffman coded much like DEFLATE using a 20 symbol code length alphabet
+ *					- 0-16: A single code length, 0 being an unused byte
+ *					- 17: 3-10 unused bytes (3 extra bits)
+ *					- 18: 11-138 unused bytes (7 extra bits)
+ *					- 19: 3-6 copies of the previous code length (2 extra bits)
+ *					- The code length code is stored first as the number of lengths (5 bits, minus one) followed by 3 bits per length in code_length_order
+ *					- Any bytes after the end of the header are unused
+ *		- Context modelled blocks store several sets of code lengths instead of one, and are always a single stream with no seek index
+ *			- Number of code tables minus one (4 bits)
+ *			- Context map format (1 bit), the table each previous byte picks either as an index for every byte (0) or in runs of bytes (1)
+ *				- Flat: Table index of each of the 256 previous bytes in order (just enough bits for the number of tables)
+ *				- Runs: Table index, then the number of bytes in the run minus one (8 bits), until all 256 are covered
+ *			- For each table its code lengths size in bits (12 bits), then its code lengths stored exactly as above
+ *			- The encoded data follows the last table, the first byte is coded with the table of a previous byte of zero
+ *		- Raw and repeated byte blocks have a header size of zero, no code lengths and no padding
+ *			- Raw: The input as it is, chosen whenever Huffman coding wouldn't make it smaller
+ *			- Repeated byte: The only byte in the input (1x uint8_t)
  *		- Encoded data
+ *			- Single stream: Starts right after the last bit of the header, or on the first whole byte after the seek index if there is one
+ *			- Multiple streams: The input is split into equal segments, the last one possibly shorter, and each is encoded into its own stream
+ *				- Byte size of every stream but the last (1x uint32_t each, or uint64_t with long lengths), starting at the first whole byte after the header
+ *				- Streams, one after the other, each starting on a whole byte
+ *			- Seek index, after the stream sizes or at the first whole byte after the header
+ *				- Number of decompressed bytes between seek points (1x uint32_t)
+ *				- Bit position of the code of every decompressed byte at a multiple of the interval, except the first (1x uint64_t each)
+ *					- Counted from the first bit of the block, header included, the same way the stream starts are found, not from the start of the encoded data
+ *					- With multiple streams it points into the stream that holds that byte
+ *
+ *	Dictionary format:
+ *
+ *		- Magic number, "HUFd" (1x uint32_t)
+ *		- Dictionary ID (1x uint32_t)
+ *		- Code lengths size in bits (1x uint16_t)
+ *		- Code lengths, stored exactly as in the header of encoded data
  *
- *	The future:
- *		- Find ways to reduce header size
- * 			- Possibly using the huffman algorithm twice to encode the header?
- *			- Will look into canonical Huffman Coding to reduce codebook size
- *		- Combine with duplicate string removal and make full LZW compression
+ *	Messages encoded with a dictionary are the encoded data alone, starting from the first bit. The caller keeps the decompressed length.
+ *
+ *	Batch format:
+ *
+ *		- Without a shared table every message is encoded data as produced by huffman_compress() less its eight bytes of padding, or nothing at all for an empty message
+ *		- With a shared table the batch starts with the table, stored exactly as a dictionary, so offsets[0] is never zero
+ *			- Each message is its decompressed length (1x uint32_t) followed by its encoded data, starting from the first bit
+ *		- The arena, including the shared table, is offsets[count] bytes long and followed by PEEK_PADDING zero bytes that belong to no message
+ *			- Messages are decoded bounded by their own length, the padding is only there so the header of the last one can be read without checks
  *
  */
 
 #include <ctype.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stdlib.h> /* Internally includes stddef.h for size_t */
 #include <string.h>
 #include <assert.h>
 
+#if defined(HUFFMAN_STATS) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#define HAVE_CYCLE_COUNTER
+#endif
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && !defined(HUFFMAN_NO_SIMD) /* Build with -DHUFFMAN_NO_SIMD to leave the vector decoder out */
+#include <immintrin.h>
+#define HAVE_AVX2_DECODER
+#endif
+
 #include "huffman.h"
 
+#if defined(__GNUC__)
+#define FORCE_INLINE inline __attribute__((always_inline)) /* Inlined into every caller even when large, so constant arguments specialise the body */
+#else
+#define FORCE_INLINE inline
+#endif
+
 #define INTERNAL_NODE 0 /* Identifiers for determining what type of node a node in a Huffman Tree is */ 
 #define BYTE_NODE 1
 
-#define HEADER_BASE_SIZE 6 /* Size of the header with no encoding representations stored */
+#define HEADER_BASE_SIZE 7 /* Size of the header with no encoding representations stored */
+#define HEADER_FLAGS_OFFSET 6
+
+#define STREAM_COUNT_MASK 0x07 /* The lowest three bits of the flags hold the number of streams minus one */
+#define LONG_LENGTH_FLAG 0x08 /* Set when the decompressed length needs more than 32 bits */
+#define LONG_LENGTH_EXTENSION 4 /* Size of the upper half of the decompressed length stored after the flags */
+#define SEEK_INDEX_FLAG 0x10 /* Set when a seek index is stored before the payload */
+#define BLOCK_MODE_SHIFT 5
+#define BLOCK_MODE_MASK 0x60
+#define REPEAT_TABLE_FLAG 0x80 /* Set when the code lengths are left out because the block uses the same table as the one before it */
+
+#define HUFFMAN_BLOCK 0 /* Identifiers for how the payload is stored */
+#define RAW_BLOCK 1
+#define RLE_BLOCK 2
+#define CONTEXT_BLOCK 3
+
+#define SEEK_INDEX_INTERVAL_LENGTH 4
+#define SEEK_INDEX_ENTRY_LENGTH 8
 
 #define MAX_CODE_LENGTH 16 /* The longest any encoded representation is allowed to be */
+#define LOOKUP_BITS MAX_CODE_LENGTH /* Number of bits used to index the decoding table */
 
-#define MAX_INPUT_SET_SIZE 1 << 8 /* The input can contain at most 256 (1 << 8) unique bytes */ 
-#define ENCODING_TABLE_LENGTH 1 << 8
-#define DECODING_TABLE_LENGTH 1 << 16
+#define MAX_INPUT_SET_SIZE (1 << 8) /* The input can contain at most 256 (1 << 8) unique bytes */ 
+#define ENCODING_TABLE_LENGTH (1 << 8)
+#define DECODING_TABLE_LENGTH (1 << LOOKUP_BITS)
 
 #define VALID_TREE 0
 #define INVALID_TREE 1
 
-#define PEEK_PADDING 2 /* We add two bytes at the end of the encoded data to prevent peek_buffer() from reading past the end of the buffer when we decode it */  
+#define PEEK_PADDING 8 /* We add eight bytes at the end of the encoded data so decoders given no input length can't read past the end of the buffer, and so the header can be read without checks */  
+
+#define LOOKUPS_PER_REFILL 3 /* refill_bit_buffer() always returns at least 57 valid bits, enough for three lookups of LOOKUP_BITS each */
+#define SYMBOLS_PER_ENTRY 2 /* The most symbols a single decoding table entry can emit */
+#define ROUND_INPUT_BYTES (LOOKUPS_PER_REFILL * LOOKUP_BITS / 8) /* The most input one round of lookups can move past */
+#define REFILL_VALID_BITS 57 /* refill_bit_buffer() leaves at most seven of its 64 bits empty */
+#define MIN_TABLE_BITS 12 /* Single level tables get at least this many index bits, so short codes still pair up */
+#define VECTOR_LANES 8 /* Streams decoded at once by decode_streams_avx2(), as two vectors of four 64-bit bit buffers */
+
+#define SPARSE_HEADER 0 /* Identifiers for how the code lengths are stored in the header */
+#define RUN_LENGTH_HEADER 1
+
+#define CODE_LENGTH_ALPHABET_SIZE 20 /* Code lengths 0-16 plus the three repeat symbols */
+#define MAX_CODE_LENGTH_CODE_LENGTH 7 /* Code length code lengths are stored in 3 bits */
+#define REPEAT_ZERO_SHORT 17
+#define REPEAT_ZERO_LONG 18
+#define REPEAT_PREVIOUS 19
+
+#define HISTOGRAM_BANKS 4 /* Number of interleaved count tables used by huffman_histogram() */
+#define HISTOGRAM_BANK_MIN_LENGTH 1024 /* Clearing and summing the banks costs more than it saves below this */
+#define HISTOGRAM_CHUNK_LENGTH ((size_t)UINT32_MAX & ~(size_t)15) /* No 32-bit bank can overflow within this many bytes */
+
+#define NODE_ARENA_SIZE (2 * MAX_INPUT_SET_SIZE - 1) /* A tree with n byte nodes has n - 1 internal nodes */
+
+#define DICTIONARY_MAGIC 0x64465548 /* "HUFd" when stored as a little endian uint32_t */
+#define DICTIONARY_HEADER_SIZE 10
+#define DICTIONARY_MAX_SIZE (DICTIONARY_HEADER_SIZE + ((ENCODING_TABLE_LENGTH * 12 + 16) >> 3)) /* Large enough for the biggest code lengths write_code_lengths() can produce */
+
+#define BATCH_LENGTH_SIZE 4 /* Decompressed length stored in front of every message encoded with a shared table */
+
+#define TWO_LEVEL_LOOKUP_BITS 11 /* Primary table index size for two level decoding tables, 2048 entries fit in L1 */
+#define SUBTABLE_PREFIX_COUNT (1 << TWO_LEVEL_LOOKUP_BITS) /* Number of primary entries that can link to a second level table */
+
+#define MAX_CONTEXT_TABLES 16 /* Most code tables a context modelled block can switch between */
+#define CONTEXT_COUNT_BITS 4 /* Number of code tables minus one */
+#define CONTEXT_TABLE_LENGTH_BITS 12 /* Bit length of each table's code lengths, never more than 1 + 8 + 256 * 12 */
+#define CONTEXT_RUN_BITS 8 /* Number of contexts minus one in each run of the context map */
+#define CONTEXT_MAP_FLAT 0 /* Identifiers for how the context map is stored */
+#define CONTEXT_MAP_RUNS 1
+#define CONTEXT_TABLE_BITS TWO_LEVEL_LOOKUP_BITS /* Every table of a context modelled block is decoded with a two level table to keep them all in cache */
+#define CONTEXT_CLUSTER_PASSES 4 /* Rounds of reassigning contexts to their cheapest table before tables are merged */
+#define CONTEXT_MISSING_CODE_COST (MAX_CODE_LENGTH + 1) /* Bits charged for a byte a table has no code for while contexts are being assigned */
+
+/* Statistics, every probe compiles to nothing without HUFFMAN_STATS */
+
+#ifdef HUFFMAN_STATS
+
+static _Thread_local huffman_stats_t thread_stats;
+
+static inline uint64_t read_cycles(void)
+{
+#ifdef HAVE_CYCLE_COUNTER
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+#define STATS_MARK(mark) uint64_t mark = read_cycles()
+#define STATS_ELAPSED(field, mark) (thread_stats.field += read_cycles() - (mark))
+#define STATS_COUNT(field, value) (thread_stats.field += (value))
+#else
+#define STATS_MARK(mark)
+#define STATS_ELAPSED(field, mark)
+#define STATS_COUNT(field, value)
+#endif
 
 /* Huffman Tree node */
 
@@ -99,130 +342,251 @@ typedef struct huffman_coding_table_t {
 	uint8_t length;
 } huffman_coding_table_t;
 
-/* Internal encoding functions */
-
-static huffman_node_t * create_byte_node(const uint8_t c, const size_t freq)
-{
-	huffman_node_t * node;
-
-	if(!(node = malloc(sizeof(huffman_node_t))))
-		return NULL;
+/* Lookup table entry used for decoding, emits every symbol whose code fits completely in the lookup window */
 
-	node->freq = freq;
-	node->child[0] = NULL;
-	node->child[1] = NULL;
-	node->c = c;
+typedef struct huffman_decoding_entry_t {
+	union {
+		uint8_t symbol[SYMBOLS_PER_ENTRY];
+		uint16_t subtable; /* Offset of the second level table if `count` is zero */
+	};
+	uint8_t length; /* Combined bit length of every code in the entry, or the index size of the second level table */
+	uint8_t count; /* Number of symbols in the entry */
+} huffman_decoding_entry_t;
+
+static_assert(sizeof(huffman_decoding_entry_t) == sizeof(uint32_t), "decode_streams_avx2() gathers decoding table entries as 32-bit words");
+
+/* Reusable decoding context */
+
+struct huffman_decoder_t {
+	uint8_t table_bits; /* Index size of the primary table */
+	uint8_t code_bits; /* Longest code, more than table_bits only if there are second level tables */
+	bool vector_decode; /* Multi-stream blocks go through decode_streams_avx2() when the processor has AVX2 */
+	huffman_decoding_entry_t decoding_table[]; /* Primary table followed by any second level tables */
+};
+
+/* Encoding context that remembers the table of the last block it coded */
+
+struct huffman_encoder_t {
+	bool has_table;
+	huffman_coding_table_t encoding_table[ENCODING_TABLE_LENGTH];
+};
+
+/* Trained code table shared by many messages */
+
+struct huffman_dictionary_t {
+	uint32_t id;
+	huffman_coding_table_t encoding_table[ENCODING_TABLE_LENGTH];
+	uint8_t table_bits; /* Always a single level table */
+	huffman_decoding_entry_t decoding_table[DECODING_TABLE_LENGTH];
+};
+
+/* Payload bit writer, bits are collected in a 64-bit accumulator and stored a whole word at a time */
+
+typedef struct bit_writer_t {
+	uint8_t * buffer;
+	size_t byte_pos; /* Where the accumulator will be stored */
+	uint64_t accumulator;
+	uint8_t bit_count; /* Number of bits in the accumulator */
+} bit_writer_t;
+
+/* Run-length coded header */
+
+typedef struct code_length_token_t {
+	uint8_t symbol;
+	uint8_t extra; /* Value of the extra bits for repeat symbols */
+} code_length_token_t;
+
+typedef struct code_length_header_t {
+	uint8_t format; /* SPARSE_HEADER or RUN_LENGTH_HEADER, whichever is smaller */
+	size_t bit_length;
+	size_t token_count;
+	size_t code_length_count; /* Number of code length code lengths stored, in code_length_order */
+	code_length_token_t tokens[ENCODING_TABLE_LENGTH];
+	huffman_coding_table_t code_length_codes[CODE_LENGTH_ALPHABET_SIZE];
+} code_length_header_t;
+
+/* Everything needed to write a block, decided from its histograms before any output is allocated */
+
+typedef struct context_plan_t context_plan_t;
+
+typedef struct block_plan_t {
+	uint8_t mode; /* HUFFMAN_BLOCK, RAW_BLOCK, RLE_BLOCK or CONTEXT_BLOCK */
+	uint8_t flags;
+	size_t base_size;
+	size_t index_length;
+	size_t total_length;
+	size_t stream_bit_length[HUFFMAN_MAX_STREAMS];
+	huffman_coding_table_t encoding_table[ENCODING_TABLE_LENGTH];
+	code_length_header_t header;
+	context_plan_t * context; /* Tables of a context modelled block, allocated by plan_context_block() and released by free_plan() */
+} block_plan_t;
+
+/* Order-1 context model, the previous byte picks which of a few code tables codes the next one */
+
+struct context_plan_t {
+	size_t freq[MAX_INPUT_SET_SIZE][MAX_INPUT_SET_SIZE]; /* Count of every byte after every previous byte, the first byte follows a zero */
+	size_t context_total[MAX_INPUT_SET_SIZE];
+	size_t table_freq[MAX_CONTEXT_TABLES][MAX_INPUT_SET_SIZE]; /* Combined counts of every context sharing a table */
+	uint8_t table_count;
+	uint8_t map_format; /* CONTEXT_MAP_FLAT or CONTEXT_MAP_RUNS, whichever is smaller */
+	uint8_t context_map[MAX_INPUT_SET_SIZE]; /* Table used after each byte */
+	size_t header_bit_length;
+	huffman_coding_table_t encoding_tables[MAX_CONTEXT_TABLES][ENCODING_TABLE_LENGTH];
+	code_length_header_t headers[MAX_CONTEXT_TABLES];
+};
+
+static const uint8_t code_length_order[CODE_LENGTH_ALPHABET_SIZE] = { 0, 17, 18, 19, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15, 16 };
+static const uint8_t code_length_extra_bits[CODE_LENGTH_ALPHABET_SIZE] = { [REPEAT_ZERO_SHORT] = 3, [REPEAT_ZERO_LONG] = 7, [REPEAT_PREVIOUS] = 2 };
+static const uint8_t code_length_repeat_base[CODE_LENGTH_ALPHABET_SIZE] = { [REPEAT_ZERO_SHORT] = 3, [REPEAT_ZERO_LONG] = 11, [REPEAT_PREVIOUS] = 3 };
 
-	return node;
-}
+/* Internal encoding functions */
 
-static huffman_node_t * create_internal_node(huffman_node_t * first_child, huffman_node_t * second_child)
+static int leaf_compare(const void * first_leaf, const void * second_leaf)
 {
-	huffman_node_t * node;
+	const huffman_node_t * first = first_leaf;
+	const huffman_node_t * second = second_leaf;
 
-	if(!(node = malloc(sizeof(huffman_node_t))))
-		return NULL;
+	if(first->freq != second->freq)
+		return first->freq < second->freq ? -1 : 1;
 
-	node->freq = first_child->freq + second_child->freq;
-	node->child[0] = first_child;
-	node->child[1] = second_child;
-
-	return node;
+	return first->c - second->c;
 }
 
-static int node_compare(const void * first_node, const void * second_node)
+static void create_huffman_tree(const size_t * freq, huffman_node_t node_arena[NODE_ARENA_SIZE], huffman_node_t ** head_node)
 {
-	huffman_node_t * first	= *(huffman_node_t **)first_node;
-	huffman_node_t * second	= *(huffman_node_t **)second_node;
+	size_t leaf_count = 0;
 
-	if(!(first->freq - second->freq)) {
-		if(first->child[1] && !second->child[1]) {
-			return 1;
-		} else if(!first->child[1] && second->child[1]) {
-			return -1;
-		} else {
-			return 0;
+	for(size_t i = 0; i < MAX_INPUT_SET_SIZE; i++) {
+		if(freq[i]) {
+			node_arena[leaf_count].freq = freq[i];
+			node_arena[leaf_count].child[1] = NULL;
+			node_arena[leaf_count].c = i;
+			leaf_count++;
 		}
-	} else {
-		return first->freq - second->freq;
 	}
-}
 
-static int create_huffman_tree(const size_t * freq, huffman_node_t ** head_node)
-{
-	huffman_node_t * node_list[MAX_INPUT_SET_SIZE] = { NULL };
-	huffman_node_t * internal_node;
-	huffman_node_t ** node_list_p;
-	size_t node_count = 0;
+	qsort(node_arena, leaf_count, sizeof(huffman_node_t), leaf_compare);
 
-	for(size_t i = 0; i < MAX_INPUT_SET_SIZE; i++) {
-		if(freq[i] && !(node_list[node_count++] = create_byte_node((uint8_t)i, freq[i]))) {
-			return MEM_ERROR;
-		}
-	}
+	/* 
+	 *	Byte nodes are sorted once up front and internal nodes are appended after them as they're
+	 *	created. Each internal node is at least as frequent as the one before it, so the two least
+	 *	frequent nodes are always at the front of either the byte node or the internal node queue
+	 */
 
-	for(node_list_p = node_list; node_count > 1; node_count--) {
-		qsort(node_list_p, node_count, sizeof(huffman_node_t *), node_compare);
+	size_t next_leaf = 0;
+	size_t next_internal = leaf_count;
+	size_t node_count = leaf_count;
 
-		if(!(internal_node = create_internal_node(node_list_p[0], node_list_p[1])))
-			return MEM_ERROR;
+	while((leaf_count - next_leaf) + (node_count - next_internal) > 1) {
+		huffman_node_t * child[2];
 
-		node_list_p[1] = internal_node;
-		node_list_p++;
-	}
+		for(size_t i = 0; i < 2; i++) {
+			if(next_leaf < leaf_count && (next_internal == node_count || node_arena[next_leaf].freq <= node_arena[next_internal].freq)) {
+				child[i] = &node_arena[next_leaf++]; /* Byte nodes win ties to keep the tree shallow */
+			} else {
+				child[i] = &node_arena[next_internal++];
+			}
+		}
 
-	*head_node = node_list_p[0];
+		node_arena[node_count++] = (huffman_node_t){ .freq = child[0]->freq + child[1]->freq, .child = { child[0], child[1] } };
+	}
 
-	return VALID_TREE;
+	*head_node = leaf_count ? &node_arena[node_count - 1] : NULL;
 }
 
-static void create_encoding_table(const huffman_node_t * node, huffman_coding_table_t encoding_table[MAX_INPUT_SET_SIZE], uint8_t bits_set)
+static void create_encoding_table(const huffman_node_t * node, huffman_coding_table_t encoding_table[MAX_INPUT_SET_SIZE], const uint8_t bits_set, const uint16_t value)
 {
-	static size_t value = '\0';
-
 	if(node->child[1]) {
-		value &= ~(0x1 << bits_set);
-		create_encoding_table(node->child[0], encoding_table, bits_set + 1);
-		value |= 0x1 << bits_set;
-		create_encoding_table(node->child[1], encoding_table, bits_set + 1);
+		create_encoding_table(node->child[0], encoding_table, bits_set + 1, value); /* The path taken so far is passed down rather than kept in a static so encoding is reentrant */
+		create_encoding_table(node->child[1], encoding_table, bits_set + 1, value | (0x1 << bits_set));
 	} else {
-		encoding_table[node->c].code = value & ((1U << bits_set) - 1);
+		encoding_table[node->c].code = value;
 		encoding_table[node->c].length = bits_set;
 	}
 }
 
-static void destroy_huffman_tree(huffman_node_t * node)
+static bool validate_huffman_tree(const huffman_node_t * node, const uint8_t max_depth)
 {
-	if(node->child[1]) {
-		destroy_huffman_tree(node->child[0]);
-		destroy_huffman_tree(node->child[1]);
-	}
+	if(!node->child[1])
+		return VALID_TREE;
 
-	free(node);
+	if(!max_depth) /* The children of this node would be deeper than the limit */
+		return INVALID_TREE;
+
+	if(validate_huffman_tree(node->child[0], max_depth - 1) == INVALID_TREE)
+		return INVALID_TREE;
 
-	return;
+	return validate_huffman_tree(node->child[1], max_depth - 1);
 }
 
-static bool validate_huffman_tree(huffman_node_t * node)
+static void limit_code_lengths(const size_t * freq, huffman_coding_table_t * encoding_table, const size_t table_length, const uint8_t max_length)
 {
-	static int depth = 0;
-
-	if(depth == MAX_CODE_LENGTH)
-		return INVALID_TREE;
+	huffman_node_t leaves[MAX_INPUT_SET_SIZE];
+	size_t weight[2][2 * MAX_INPUT_SET_SIZE];
+	bool is_package[MAX_CODE_LENGTH][2 * MAX_INPUT_SET_SIZE];
+	size_t list_length[MAX_CODE_LENGTH];
+	size_t leaf_count = 0;
+
+	/* 
+	 *	Package-merge: the list for the deepest level is just the leaves sorted by frequency. Every
+	 *	level above it pairs up neighbouring items of the level below into packages and merges them
+	 *	back in with the leaves. The first 2n - 2 items of the top level make up an optimal code.
+	 */
+
+	for(size_t i = 0; i < table_length; i++) {
+		if(freq[i])
+			leaves[leaf_count++] = (huffman_node_t){ .freq = freq[i], .c = i };
+	}
 
-	if(node->child[1]) {
-		depth++;
+	qsort(leaves, leaf_count, sizeof(huffman_node_t), leaf_compare);
 
-		if(validate_huffman_tree(node->child[0]) == INVALID_TREE)
-			return INVALID_TREE;
+	for(size_t i = 0; i < leaf_count; i++) {
+		weight[0][i] = leaves[i].freq;
+		is_package[0][i] = false;
+	}
 
-		if(validate_huffman_tree(node->child[1]) == INVALID_TREE)
-			return INVALID_TREE;
+	list_length[0] = leaf_count;
+
+	for(uint8_t level = 1; level < max_length; level++) {
+		const size_t * below = weight[(level - 1) & 1];
+		size_t * current = weight[level & 1];
+		size_t package_count = list_length[level - 1] >> 1;
+		size_t leaf = 0;
+		size_t package = 0;
+		size_t length = 0;
+
+		while(leaf < leaf_count || package < package_count) {
+			if(package == package_count || (leaf < leaf_count && leaves[leaf].freq <= below[package << 1] + below[(package << 1) + 1])) {
+				current[length] = leaves[leaf++].freq;
+				is_package[level][length++] = false;
+			} else {
+				current[length] = below[package << 1] + below[(package << 1) + 1];
+				is_package[level][length++] = true;
+				package++;
+			}
+		}
 
-		depth--;
+		list_length[level] = length;
 	}
 
-	return VALID_TREE;
+	/* Every time a leaf is picked, from the top level down through the packages it's part of, its code grows by a bit */
+
+	for(size_t i = 0; i < table_length; i++)
+		encoding_table[i].length = 0;
+
+	for(size_t level = max_length, picked = (leaf_count << 1) - 2; level-- > 0 && picked;) {
+		size_t picked_leaves = 0;
+
+		for(size_t i = 0; i < picked; i++) {
+			if(!is_package[level][i])
+				picked_leaves++;
+		}
+
+		for(size_t i = 0; i < picked_leaves; i++) /* Leaves are merged in order, so the picked leaves are always the least frequent ones */
+			encoding_table[leaves[i].c].length++;
+
+		picked = (picked - picked_leaves) << 1;
+	}
 }
 
 static inline void write_k_bits(uint8_t * buffer, uint16_t value, size_t * bit_pos, const uint8_t bits)
@@ -232,7 +596,7 @@ static inline void write_k_bits(uint8_t * buffer, uint16_t value, size_t * bit_p
 	size_t bits_to_first_byte = 8 - bit_offset;
 	size_t extra_bytes_needed = ((bit_offset + bits) >> 3) - (bit_offset >> 3);
 
-	buffer[byte_pos] &= ~0 >> bits_to_first_byte; /* Clear the top n bits of the first byte we're writing to */
+	buffer[byte_pos] &= (1U << bit_offset) - 1; /* Clear the top n bits of the first byte we're writing to */
 	buffer[byte_pos] |= value << bit_offset; /* Shift `value` so that the largest relevant bit is in the MSB position and write as many bits as we can to the first byte of the buffer */
 
 	if(extra_bytes_needed > 0) {
@@ -250,181 +614,2865 @@ static inline void write_k_bits(uint8_t * buffer, uint16_t value, size_t * bit_p
 	*bit_pos += bits;
 }
 
-/* Internal decoding functions */
+static inline void store_bit_buffer(uint8_t * buffer, uint64_t value)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	value = __builtin_bswap64(value);
+#endif
 
-static inline uint16_t peek_buffer(const uint8_t * input, const size_t bit_pos)
+	memcpy(buffer, &value, sizeof(value)); /* Compiles down to a single unaligned store */
+}
+
+static void bit_writer_init(bit_writer_t * writer, uint8_t * buffer, const size_t bit_pos)
 {
-	size_t byte_pos = bit_pos >> 3;
-	uint32_t concat = (input[byte_pos + 2] << 0x10) | (input[byte_pos + 1] << 0x8) | input[byte_pos];
+	writer->buffer = buffer;
+	writer->byte_pos = bit_pos >> 3;
+	writer->bit_count = bit_pos & 7;
+	writer->accumulator = buffer[writer->byte_pos] & ((1U << writer->bit_count) - 1); /* Keep the bits already written to the first byte */
+}
+
+static inline void bit_writer_write(bit_writer_t * writer, const uint64_t value, const uint8_t bits)
+{
+	/* At most 32 bits are written at a time, so the accumulator only ever overflows into a single new word */
 
-	return concat >> (bit_pos & 7); /* Concatenate three successive bytes together and return a two bytes at the calculated bit offset */
+	writer->accumulator |= value << writer->bit_count;
+
+	if(writer->bit_count + bits >= 64) {
+		store_bit_buffer(&writer->buffer[writer->byte_pos], writer->accumulator);
+		writer->byte_pos += 8;
+		writer->accumulator = value >> (64 - writer->bit_count); /* Nonzero bit_count is guaranteed, we can't reach 64 bits from an empty accumulator */
+		writer->bit_count += bits - 64;
+	} else {
+		writer->bit_count += bits;
+	}
 }
 
-/* Interface functions */
+static void bit_writer_flush(bit_writer_t * writer)
+{
+	for(uint8_t bits = 0; bits < writer->bit_count; bits += 8) /* Only write the bytes that are in use, the buffer may end right after them */
+		writer->buffer[writer->byte_pos++] = writer->accumulator >> bits;
 
-int huffman_encode(const uint8_t * input, uint8_t ** output, const uint32_t decompressed_length)
+	writer->accumulator = 0;
+	writer->bit_count = 0;
+}
+
+static void encode_symbols(const huffman_coding_table_t encoding_table[ENCODING_TABLE_LENGTH], const uint8_t * input, const size_t length, uint8_t * buffer, const size_t bit_pos)
 {
-	size_t freq[MAX_INPUT_SET_SIZE] = { 0 };
-	size_t encoded_bytes = 0;
+	bit_writer_t writer;
+	size_t byte_count = 0;
+
+	bit_writer_init(&writer, buffer, bit_pos);
+
+	for(; length - byte_count >= 2; byte_count += 2) { /* Two symbols at a time since a pair of codes always fits in one write */
+		huffman_coding_table_t first = encoding_table[input[byte_count]];
+		huffman_coding_table_t second = encoding_table[input[byte_count + 1]];
+
+		bit_writer_write(&writer, first.code | ((uint32_t)second.code << first.length), first.length + second.length);
+	}
+
+	if(byte_count < length)
+		bit_writer_write(&writer, encoding_table[input[byte_count]].code, encoding_table[input[byte_count]].length);
+
+	bit_writer_flush(&writer);
+}
+
+static void encode_context_symbols(const huffman_coding_table_t * context_tables[MAX_INPUT_SET_SIZE], const uint8_t * input, const size_t length, uint8_t * buffer, const size_t bit_pos)
+{
+	bit_writer_t writer;
+	size_t byte_count = 0;
+	uint8_t previous = 0;
+
+	bit_writer_init(&writer, buffer, bit_pos);
+
+	for(; length - byte_count >= 2; byte_count += 2) {
+		huffman_coding_table_t first = context_tables[previous][input[byte_count]];
+		huffman_coding_table_t second = context_tables[input[byte_count]][input[byte_count + 1]];
+
+		bit_writer_write(&writer, first.code | ((uint32_t)second.code << first.length), first.length + second.length);
+		previous = input[byte_count + 1];
+	}
+
+	if(byte_count < length)
+		bit_writer_write(&writer, context_tables[previous][input[byte_count]].code, context_tables[previous][input[byte_count]].length);
 
-	/* Frequency analysis */
+	bit_writer_flush(&writer);
+}
+
+static void create_canonical_codes(huffman_coding_table_t * encoding_table, const size_t table_length)
+{
+	uint16_t length_count[MAX_CODE_LENGTH + 1] = { 0 };
+	uint16_t next_code[MAX_CODE_LENGTH + 1] = { 0 };
+
+	for(size_t i = 0; i < table_length; i++)
+		length_count[encoding_table[i].length]++;
+
+	length_count[0] = 0;
+
+	for(size_t length = 1; length <= MAX_CODE_LENGTH; length++)
+		next_code[length] = (next_code[length - 1] + length_count[length - 1]) << 1;
+
+	for(size_t i = 0; i < table_length; i++) {
+		uint8_t length = encoding_table[i].length;
+
+		if(length) {
+			uint16_t code = next_code[length]++;
+			uint16_t reversed = 0;
 
-	if(decompressed_length > MAX_INPUT_SET_SIZE) {
-		for(size_t i = 0; i < decompressed_length; i++) {
-			freq[input[i]]++;
+			for(uint8_t bit = 0; bit < length; bit++)
+				reversed |= ((code >> bit) & 1) << (length - 1 - bit); /* The first bit of the code has to be the first bit read from the buffer */
+
+			encoding_table[i].code = reversed;
 		}
-		
-		for(size_t i = 0; i < MAX_INPUT_SET_SIZE; i++) {
-			if(freq[i]) {
-				encoded_bytes++;
-			}
+	}
+}
+
+static int create_code_lengths(const size_t * freq, huffman_coding_table_t * encoding_table, const size_t table_length, const uint8_t max_length)
+{
+	huffman_coding_table_t tree_table[ENCODING_TABLE_LENGTH] = {{ .code = 0, .length = 0 }};
+	size_t tree_freq[MAX_INPUT_SET_SIZE] = { 0 };
+	huffman_node_t node_arena[NODE_ARENA_SIZE];
+	huffman_node_t * head_node = NULL;
+	size_t used = 0;
+
+	for(size_t i = 0; i < table_length; i++) {
+		if((tree_freq[i] = freq[i]))
+			used++;
+
+		encoding_table[i].length = 0;
+	}
+
+	if(!max_length || max_length > MAX_CODE_LENGTH || (1U << max_length) < used) /* Not enough codes of at most max_length bits for every symbol */
+		return INPUT_ERROR;
+
+	if(used < 2) { /* A tree with one leaf has no depth, give the only symbol a single bit code */
+		for(size_t i = 0; i < table_length; i++) {
+			if(freq[i])
+				encoding_table[i].length = 1;
 		}
+
+		return VALID_TREE;
+	}
+
+	create_huffman_tree(tree_freq, node_arena, &head_node);
+
+	if(validate_huffman_tree(head_node, max_length) == VALID_TREE) {
+		create_encoding_table(head_node, tree_table, 0, 0);
+
+		for(size_t i = 0; i < table_length; i++)
+			encoding_table[i].length = tree_table[i].length;
 	} else {
-		for(size_t i = 0; i < decompressed_length; i++) {
-			if(!freq[input[i]]) {
-				encoded_bytes++;
-			}
+		limit_code_lengths(freq, encoding_table, table_length, max_length); /* The tree is too deep, find the best code within the limit instead */
+	}
+
+	return VALID_TREE;
+}
+
+static int plan_code_lengths(const huffman_coding_table_t encoding_table[ENCODING_TABLE_LENGTH], code_length_header_t * header)
+{
+	size_t code_length_freq[CODE_LENGTH_ALPHABET_SIZE] = { 0 };
+	size_t last_used = 0;
+	size_t encoded_bytes = 0;
 
-			freq[input[i]]++;
+	for(size_t i = 0; i < ENCODING_TABLE_LENGTH; i++) {
+		if(encoding_table[i].length) {
+			last_used = i;
+			encoded_bytes++;
 		}
 	}
 
-	/* Handle strings with either one unique byte or zero bytes */
+	size_t sparse_bit_length = 1 + 8 + encoded_bytes * 12;
 
-	if(!encoded_bytes)
-		return INPUT_ERROR;
+	header->token_count = 0;
 
-	if(encoded_bytes == 1) {
-		for(size_t i = 0; i < MAX_INPUT_SET_SIZE; i++) {
-			if(freq[i]) {
-				freq[i > 0 ? i - 1 : i + 1]++;
+	/* Turn the code lengths into a list of code length symbols, stopping after the last encoded byte */
+
+	for(size_t i = 0; i <= last_used;) {
+		uint8_t length = encoding_table[i].length;
+		size_t run = 1;
+
+		while(i + run <= last_used && encoding_table[i + run].length == length)
+			run++;
+
+		i += run;
+
+		if(length) { /* Write the length once then repeat it */
+			header->tokens[header->token_count++] = (code_length_token_t){ .symbol = length, .extra = 0 };
+			run--;
+
+			while(run >= 3) {
+				size_t repeat = run > 6 ? 6 : run;
+
+				header->tokens[header->token_count++] = (code_length_token_t){ .symbol = REPEAT_PREVIOUS, .extra = repeat - 3 };
+				run -= repeat;
+			}
+		} else {
+			while(run >= 11) {
+				size_t repeat = run > 138 ? 138 : run;
+
+				header->tokens[header->token_count++] = (code_length_token_t){ .symbol = REPEAT_ZERO_LONG, .extra = repeat - 11 };
+				run -= repeat;
+			}
+
+			if(run >= 3) {
+				header->tokens[header->token_count++] = (code_length_token_t){ .symbol = REPEAT_ZERO_SHORT, .extra = run - 3 };
+				run = 0;
 			}
 		}
+
+		while(run--)
+			header->tokens[header->token_count++] = (code_length_token_t){ .symbol = length, .extra = 0 };
 	}
 
-	/* Construct a Huffman tree from the frequency analysis */
+	for(size_t i = 0; i < header->token_count; i++)
+		code_length_freq[header->tokens[i].symbol]++;
 
-	huffman_node_t * head_node = NULL;
+	int error;
 
-	if(create_huffman_tree(freq, &head_node) != VALID_TREE)
-		return MEM_ERROR;
+	if((error = create_code_lengths(code_length_freq, header->code_length_codes, CODE_LENGTH_ALPHABET_SIZE, MAX_CODE_LENGTH_CODE_LENGTH)) != VALID_TREE)
+		return error;
 
-	while(validate_huffman_tree(head_node) != VALID_TREE) {
-		destroy_huffman_tree(head_node);
+	create_canonical_codes(header->code_length_codes, CODE_LENGTH_ALPHABET_SIZE);
 
-		return INPUT_ERROR; /* Fail gracefully if the tree is deeper than MAX_CODE_LENGTH */
+	header->code_length_count = CODE_LENGTH_ALPHABET_SIZE;
 
-		/* TODO: Find a way to fix invalid trees and continue */
-	}
+	while(!header->code_length_codes[code_length_order[header->code_length_count - 1]].length) /* Trailing unused code length symbols are left out */
+		header->code_length_count--;
 
-	huffman_coding_table_t encoding_table[ENCODING_TABLE_LENGTH] = {{ .code = 0, .length = 0 }};
+	size_t run_length_bit_length = 1 + 5 + header->code_length_count * 3;
 
-	/* Convert the tree to a lookup table */
+	for(size_t i = 0; i < header->token_count; i++)
+		run_length_bit_length += header->code_length_codes[header->tokens[i].symbol].length + code_length_extra_bits[header->tokens[i].symbol];
 
-	create_encoding_table(head_node, encoding_table, 0);
-	destroy_huffman_tree(head_node);
+	header->format = sparse_bit_length <= run_length_bit_length ? SPARSE_HEADER : RUN_LENGTH_HEADER;
+	header->bit_length = header->format == SPARSE_HEADER ? sparse_bit_length : run_length_bit_length;
 
-	uint16_t header_bit_length = 0;
+	return EXIT_SUCCESS;
+}
 
-	/* Use the generated encoding table to calculate the byte length of the output */
+static void write_code_lengths(const huffman_coding_table_t encoding_table[ENCODING_TABLE_LENGTH], const code_length_header_t * header, uint8_t * buffer, size_t * bit_pos)
+{
+	write_k_bits(buffer, header->format, bit_pos, 1);
 
-	for(size_t i = 0; i < ENCODING_TABLE_LENGTH; i++) {
-		if(encoding_table[i].length) {
-			header_bit_length += 16 + encoding_table[i].length;
+	if(header->format == SPARSE_HEADER) {
+		size_t encoded_bytes = 0;
+
+		for(size_t i = 0; i < ENCODING_TABLE_LENGTH; i++) {
+			if(encoding_table[i].length)
+				encoded_bytes++;
+		}
+
+		write_k_bits(buffer, encoded_bytes - 1, bit_pos, 8);
+
+		for(size_t i = 0; i < ENCODING_TABLE_LENGTH; i++) {
+			if(encoding_table[i].length) {
+				write_k_bits(buffer, i, bit_pos, 8);
+				write_k_bits(buffer, encoding_table[i].length - 1, bit_pos, 4);
+			}
+		}
+	} else {
+		write_k_bits(buffer, header->code_length_count - 1, bit_pos, 5);
+
+		for(size_t i = 0; i < header->code_length_count; i++)
+			write_k_bits(buffer, header->code_length_codes[code_length_order[i]].length, bit_pos, 3);
+
+		for(size_t i = 0; i < header->token_count; i++) {
+			code_length_token_t token = header->tokens[i];
+
+			write_k_bits(buffer, header->code_length_codes[token.symbol].code, bit_pos, header->code_length_codes[token.symbol].length);
+			write_k_bits(buffer, token.extra, bit_pos, code_length_extra_bits[token.symbol]);
 		}
 	}
+}
 
-	size_t encoded_bit_length = 0;
+static uint32_t code_table_id(const huffman_coding_table_t encoding_table[ENCODING_TABLE_LENGTH])
+{
+	uint32_t id = 2166136261U; /* FNV-1a over the code lengths */
 
-	for(size_t i = 0; i < decompressed_length; i++)
-		encoded_bit_length += encoding_table[input[i]].length;
+	for(size_t i = 0; i < ENCODING_TABLE_LENGTH; i++)
+		id = (id ^ encoding_table[i].length) * 16777619U;
 
-	size_t total_length = HEADER_BASE_SIZE + ((encoded_bit_length + header_bit_length + 7) >> 3) + PEEK_PADDING; /* Fast division by 8, add one if there's a remainder */
+	return id;
+}
 
-	if(!(*output = calloc(total_length, sizeof(uint8_t))))
-		return MEM_ERROR;
+static int write_dictionary(const huffman_coding_table_t encoding_table[ENCODING_TABLE_LENGTH], const uint32_t id, uint8_t output[DICTIONARY_MAX_SIZE + PEEK_PADDING], size_t * output_length)
+{
+	code_length_header_t header;
+	uint32_t magic = DICTIONARY_MAGIC;
+	size_t bit_pos = DICTIONARY_HEADER_SIZE << 3;
+	int error;
 
-	/* Write header information */
+	if((error = plan_code_lengths(encoding_table, &header)) != EXIT_SUCCESS)
+		return error;
 
-	((uint32_t *)(*output))[0] = decompressed_length;
-	((uint16_t *)(*output))[2] = header_bit_length;
+	uint16_t header_bit_length = header.bit_length;
 
-	size_t bit_pos = HEADER_BASE_SIZE << 3;
+	memcpy(output, &magic, sizeof(magic));
+	memcpy(&output[4], &id, sizeof(id));
+	memcpy(&output[8], &header_bit_length, sizeof(header_bit_length));
 
-	/* Store the encoding information */
+	write_code_lengths(encoding_table, &header, output, &bit_pos); /* write_k_bits() touches a few bytes past the last bit, so the output is zeroed and padded */
 
-	for(size_t i = 0; i < ENCODING_TABLE_LENGTH; i++) {
-		if(encoding_table[i].length) {
-			write_k_bits(*output, i, &bit_pos, 8);
-			write_k_bits(*output, encoding_table[i].length, &bit_pos, 8);
-			write_k_bits(*output, encoding_table[i].code, &bit_pos, encoding_table[i].length);
-		}
+	*output_length = DICTIONARY_HEADER_SIZE + ((header_bit_length + 7) >> 3);
+
+	return EXIT_SUCCESS;
+}
+
+/* Internal functions for the header */
+
+static inline size_t jump_table_entry_length(const uint8_t flags)
+{
+	return flags & LONG_LENGTH_FLAG ? sizeof(uint64_t) : sizeof(uint32_t);
+}
+
+static inline void store_length(uint8_t * buffer, const uint64_t length, const size_t entry_length)
+{
+	uint32_t short_length = length;
+
+	memcpy(buffer, entry_length == sizeof(uint64_t) ? (const void *)&length : (const void *)&short_length, entry_length);
+}
+
+static inline uint64_t load_length(const uint8_t * buffer, const size_t entry_length)
+{
+	uint64_t length;
+	uint32_t short_length;
+
+	if(entry_length == sizeof(uint64_t)) {
+		memcpy(&length, buffer, sizeof(length));
+	} else {
+		memcpy(&short_length, buffer, sizeof(short_length));
+		length = short_length;
 	}
 
-	/* Encode output stream */
+	return length;
+}
+
+static inline size_t header_base_size(const uint8_t * input)
+{
+	return HEADER_BASE_SIZE + (input[HEADER_FLAGS_OFFSET] & LONG_LENGTH_FLAG ? LONG_LENGTH_EXTENSION : 0);
+}
+
+static inline uint64_t read_decompressed_length(const uint8_t * input)
+{
+	uint64_t decompressed_length = load_length(input, sizeof(uint32_t));
 
-	for(size_t i = 0; i < decompressed_length; i++)
-		write_k_bits(*output, encoding_table[input[i]].code, &bit_pos, encoding_table[input[i]].length);
+	if(input[HEADER_FLAGS_OFFSET] & LONG_LENGTH_FLAG)
+		decompressed_length |= load_length(&input[HEADER_BASE_SIZE], sizeof(uint32_t)) << 32;
 
-	return total_length;
+	return decompressed_length;
 }
 
-int huffman_decode(const uint8_t * input, uint8_t ** output)
+static inline size_t header_end(const uint8_t * input)
 {
-	uint32_t decompressed_length = *(uint32_t *)&input[0];
+	uint16_t header_bit_length;
 
-	if(!(*output = calloc(decompressed_length + 1, sizeof(uint8_t))))
-		return MEM_ERROR;
+	memcpy(&header_bit_length, &input[4], sizeof(header_bit_length));
 
-	return huffman_decode_to_existing_buffer(input, *output, decompressed_length);
+	return (header_base_size(input) << 3) + header_bit_length;
 }
 
-int huffman_decode_to_existing_buffer(const uint8_t * input, uint8_t * output, const uint32_t output_length)
+static inline void write_header_base(uint8_t * output, const uint64_t decompressed_length, const uint16_t header_bit_length, const uint8_t flags)
 {
-	size_t bit_pos = HEADER_BASE_SIZE << 3;
-	huffman_coding_table_t decoding_table[DECODING_TABLE_LENGTH] = { {.symbol = 0, .length = 0 } };
+	store_length(output, decompressed_length, sizeof(uint32_t));
+	memcpy(&output[4], &header_bit_length, sizeof(header_bit_length));
+	output[HEADER_FLAGS_OFFSET] = flags;
 
-	/* Extract header information */
+	if(flags & LONG_LENGTH_FLAG)
+		store_length(&output[HEADER_BASE_SIZE], decompressed_length >> 32, sizeof(uint32_t));
+}
+
+static inline uint8_t block_mode(const uint8_t * input)
+{
+	return (input[HEADER_FLAGS_OFFSET] & BLOCK_MODE_MASK) >> BLOCK_MODE_SHIFT;
+}
+
+static inline size_t seek_index_length(const uint32_t interval, const uint64_t decompressed_length)
+{
+	return SEEK_INDEX_INTERVAL_LENGTH + (interval && decompressed_length ? (decompressed_length - 1) / interval * SEEK_INDEX_ENTRY_LENGTH : 0);
+}
 
-	uint32_t decompressed_length = *(uint32_t*)&input[0];
-	uint16_t header_bit_length = *(uint16_t*)&input[4] + (HEADER_BASE_SIZE << 3);
+static uint8_t locate_streams(const uint8_t * input, const size_t input_length, const size_t bit_pos, size_t stream_bit_pos[HUFFMAN_MAX_STREAMS], size_t * index_pos)
+{
+	uint8_t flags = input[HEADER_FLAGS_OFFSET];
+	uint8_t stream_count = (flags & STREAM_COUNT_MASK) + 1;
+	size_t entry_length = jump_table_entry_length(flags);
+	size_t byte_pos = (bit_pos + 7) >> 3; /* The jump table starts at the first whole byte after the code lengths */
+	size_t stream_start = byte_pos + (stream_count - 1) * entry_length;
+
+	if(byte_pos > input_length || (stream_count - 1) * entry_length > input_length - byte_pos)
+		return 0;
 
-	/* Build decoding lookup table */
+	*index_pos = stream_start;
 
-	while(bit_pos < header_bit_length) {
-		uint8_t decoded_byte = peek_buffer(input, bit_pos);
+	if(stream_count == 1 && !(flags & SEEK_INDEX_FLAG)) { /* A lone stream follows straight on from the header */
+		stream_bit_pos[0] = bit_pos;
+
+		return stream_count;
+	}
 
-		bit_pos += 8;
+	if(flags & SEEK_INDEX_FLAG) {
+		if(input_length - stream_start < SEEK_INDEX_INTERVAL_LENGTH)
+			return 0;
 
-		uint8_t encoded_length = peek_buffer(input, bit_pos) & 15;
+		uint32_t interval = load_length(&input[*index_pos], SEEK_INDEX_INTERVAL_LENGTH);
+		size_t index_length = seek_index_length(interval, read_decompressed_length(input));
 
-		if(!encoded_length)
-			encoded_length = 16;
+		if(!interval || index_length > input_length - stream_start) /* The entries themselves are checked as decode_range() uses them */
+			return 0;
 
-		bit_pos += 8;
+		stream_start += index_length;
+	}
 
-		uint8_t pad_length = MAX_CODE_LENGTH - encoded_length;
-		uint16_t encoded_byte = peek_buffer(input, bit_pos) & ((1U << encoded_length) - 1); /* Trim all leading bits */
+	for(uint8_t stream = 0; stream < stream_count; stream++) {
+		stream_bit_pos[stream] = stream_start << 3;
 
-		bit_pos += encoded_length;
+		if(stream < stream_count - 1) { /* The last stream runs to the end of the payload so its size isn't stored */
+			uint64_t stream_length = load_length(&input[byte_pos + stream * entry_length], entry_length);
 
-		uint16_t padmask = (1U << pad_length) - 1;
+			if(stream_length > input_length - stream_start)
+				return 0;
 
-		for(uint16_t padding = 0; padding <= padmask; padding++)
-			decoding_table[encoded_byte | (padding << encoded_length)] = (huffman_coding_table_t){ .symbol = decoded_byte, .length = encoded_length };
+			stream_start += stream_length;
+		}
 	}
 
-	if(decompressed_length > output_length) /* As long as the output buffer is longer than or the same length as the decompressed string */
-		return LENGTH_ERROR;
+	return stream_count;
+}
 
-	/* Decode input stream */
+/* Internal encoding functions built on the header helpers */
+
+static int stream_histograms(const uint8_t * input, const size_t input_length, const huffman_options_t * options, size_t stream_freq[HUFFMAN_MAX_STREAMS][MAX_INPUT_SET_SIZE])
+{
+	uint8_t stream_count = options && options->stream_count ? options->stream_count : 1;
+
+	if(stream_count > HUFFMAN_MAX_STREAMS)
+		return INPUT_ERROR;
+
+	size_t segment_length = (input_length + stream_count - 1) / stream_count;
+	STATS_MARK(start);
 
-	for(uint32_t byte_count = 0; byte_count < decompressed_length; byte_count++) {
-		uint16_t buffer = peek_buffer(input, bit_pos);
+	for(uint8_t stream = 0; stream < stream_count; stream++) {
+		size_t segment_start = stream * segment_length < input_length ? stream * segment_length : input_length;
+		size_t segment_end = segment_start + segment_length < input_length ? segment_start + segment_length : input_length;
 
-		output[byte_count] = decoding_table[buffer].symbol;
-		bit_pos += decoding_table[buffer].length;
+		huffman_histogram(&input[segment_start], segment_end - segment_start, stream_freq[stream]);
 	}
 
-	return decompressed_length;
-}
\ No newline at end of file
+	STATS_ELAPSED(histogram_cycles, start);
+
+	return EXIT_SUCCESS;
+}
+
+static size_t coded_block_length(size_t stream_freq[][MAX_INPUT_SET_SIZE], const uint8_t histogram_count, const uint8_t stream_count, const huffman_coding_table_t encoding_table[ENCODING_TABLE_LENGTH], const size_t header_bit_length, const block_plan_t * plan, size_t stream_bit_length[HUFFMAN_MAX_STREAMS])
+{
+	size_t entry_length = jump_table_entry_length(plan->flags);
+	size_t total_length;
+
+	for(uint8_t stream = 0; stream < histogram_count; stream++) {
+		stream_bit_length[stream] = 0;
+
+		for(size_t i = 0; i < MAX_INPUT_SET_SIZE; i++)
+			stream_bit_length[stream] += stream_freq[stream][i] * encoding_table[i].length;
+	}
+
+	if(stream_count == 1 && !plan->index_length)
+		return plan->base_size + ((stream_bit_length[0] + header_bit_length + 7) >> 3) + PEEK_PADDING; /* Fast division by 8, add one if there's a remainder */
+
+	total_length = plan->base_size + ((header_bit_length + 7) >> 3) + (stream_count - 1) * entry_length + plan->index_length + PEEK_PADDING; /* Every stream starts on a whole byte */
+
+	for(uint8_t stream = 0; stream < histogram_count; stream++)
+		total_length += (stream_bit_length[stream] + 7) >> 3;
+
+	return total_length + stream_count - histogram_count; /* Without a histogram per stream, allow for each stream rounding up to a whole byte */
+}
+
+static bool can_repeat_table(const huffman_coding_table_t previous_table[ENCODING_TABLE_LENGTH], const size_t freq[MAX_INPUT_SET_SIZE], const uint8_t max_code_length)
+{
+	for(size_t i = 0; i < MAX_INPUT_SET_SIZE; i++) {
+		if(previous_table[i].length > max_code_length || (freq[i] && !previous_table[i].length))
+			return false;
+	}
+
+	return true;
+}
+
+static int plan_block(size_t stream_freq[][MAX_INPUT_SET_SIZE], const uint8_t histogram_count, const size_t input_length, const huffman_options_t * options, const huffman_coding_table_t * previous_table, block_plan_t * plan)
+{
+	uint8_t max_code_length = options && options->max_code_length ? options->max_code_length : MAX_CODE_LENGTH;
+	uint8_t stream_count = options && options->stream_count ? options->stream_count : 1;
+	uint32_t index_interval = options ? options->index_interval : 0;
+	size_t freq[MAX_INPUT_SET_SIZE] = { 0 };
+	size_t encoded_bytes = 0;
+	int error;
+
+	if(stream_count > HUFFMAN_MAX_STREAMS)
+		return INPUT_ERROR;
+
+	for(uint8_t stream = 0; stream < histogram_count; stream++) {
+		for(size_t i = 0; i < MAX_INPUT_SET_SIZE; i++)
+			freq[i] += stream_freq[stream][i];
+	}
+
+	for(size_t i = 0; i < MAX_INPUT_SET_SIZE; i++) {
+		if(freq[i])
+			encoded_bytes++;
+	}
+
+	plan->flags = ((uint64_t)input_length > UINT32_MAX ? LONG_LENGTH_FLAG : 0);
+	plan->context = NULL;
+	plan->base_size = HEADER_BASE_SIZE + (plan->flags & LONG_LENGTH_FLAG ? LONG_LENGTH_EXTENSION : 0);
+	plan->index_length = 0;
+
+	/* Handle strings with zero bytes, strings with one unique byte are stored as just that byte */
+
+	if(!encoded_bytes)
+		return INPUT_ERROR;
+
+	if(encoded_bytes == 1) {
+		plan->mode = RLE_BLOCK;
+		plan->total_length = plan->base_size + 1;
+
+		return EXIT_SUCCESS;
+	}
+
+	/* Construct a Huffman tree from the frequency analysis and convert it to a lookup table, limiting the code lengths if the tree is too deep */
+
+	memset(plan->encoding_table, 0, sizeof(plan->encoding_table));
+	STATS_MARK(tree_start);
+
+	if((error = create_code_lengths(freq, plan->encoding_table, ENCODING_TABLE_LENGTH, max_code_length)) != VALID_TREE)
+		return error;
+
+	STATS_ELAPSED(tree_cycles, tree_start);
+	STATS_MARK(table_start);
+
+	create_canonical_codes(plan->encoding_table, ENCODING_TABLE_LENGTH);
+
+	/* Use the generated encoding table to calculate the byte length of the output */
+
+	if((error = plan_code_lengths(plan->encoding_table, &plan->header)) != EXIT_SUCCESS)
+		return error;
+
+	plan->flags |= (stream_count - 1) | (index_interval ? SEEK_INDEX_FLAG : 0);
+	plan->index_length = index_interval ? seek_index_length(index_interval, input_length) : 0;
+	plan->total_length = coded_block_length(stream_freq, histogram_count, stream_count, plan->encoding_table, plan->header.bit_length, plan, plan->stream_bit_length);
+	plan->mode = HUFFMAN_BLOCK;
+
+	/* The table of the previous block costs no header at all, so reuse it whenever that comes out smaller */
+
+	if(previous_table && can_repeat_table(previous_table, freq, max_code_length)) {
+		size_t stream_bit_length[HUFFMAN_MAX_STREAMS];
+		size_t repeat_length = coded_block_length(stream_freq, histogram_count, stream_count, previous_table, 0, plan, stream_bit_length);
+
+		if(repeat_length < plan->total_length) {
+			memcpy(plan->encoding_table, previous_table, sizeof(plan->encoding_table));
+			memcpy(plan->stream_bit_length, stream_bit_length, sizeof(stream_bit_length));
+			plan->flags |= REPEAT_TABLE_FLAG;
+			plan->header.bit_length = 0;
+			plan->total_length = repeat_length;
+		}
+	}
+
+	if(plan->total_length >= plan->base_size + input_length) { /* Huffman coding wouldn't save anything, store the input as it is */
+		plan->mode = RAW_BLOCK;
+		plan->flags &= LONG_LENGTH_FLAG;
+		plan->total_length = plan->base_size + input_length;
+	}
+
+	STATS_ELAPSED(code_table_cycles, table_start);
+
+	return EXIT_SUCCESS;
+}
+
+static int table_bit_length(const size_t freq[MAX_INPUT_SET_SIZE], const uint8_t max_code_length, size_t * bit_length)
+{
+	huffman_coding_table_t encoding_table[ENCODING_TABLE_LENGTH];
+	code_length_header_t header;
+	int error;
+
+	if((error = create_code_lengths(freq, encoding_table, ENCODING_TABLE_LENGTH, max_code_length)) != VALID_TREE)
+		return error;
+
+	if((error = plan_code_lengths(encoding_table, &header)) != EXIT_SUCCESS)
+		return error;
+
+	*bit_length = CONTEXT_TABLE_LENGTH_BITS + header.bit_length;
+
+	for(size_t i = 0; i < MAX_INPUT_SET_SIZE; i++)
+		*bit_length += freq[i] * encoding_table[i].length;
+
+	return EXIT_SUCCESS;
+}
+
+static int merged_bit_length(const context_plan_t * context, const uint8_t first, const uint8_t second, const uint8_t max_code_length, size_t * bit_length)
+{
+	size_t freq[MAX_INPUT_SET_SIZE];
+
+	for(size_t i = 0; i < MAX_INPUT_SET_SIZE; i++)
+		freq[i] = context->table_freq[first][i] + context->table_freq[second][i];
+
+	return table_bit_length(freq, max_code_length, bit_length);
+}
+
+static int cluster_contexts(context_plan_t * context, const uint8_t max_tables, const uint8_t max_code_length)
+{
+	huffman_coding_table_t encoding_table[ENCODING_TABLE_LENGTH];
+	size_t table_bits[MAX_CONTEXT_TABLES];
+	size_t merged_bits[MAX_CONTEXT_TABLES][MAX_CONTEXT_TABLES];
+	bool picked[MAX_INPUT_SET_SIZE] = { false };
+	uint8_t seed_count = 0;
+	int error;
+
+	/* The busiest contexts each start out with a table of their own */
+
+	for(; seed_count < max_tables; seed_count++) {
+		size_t best = MAX_INPUT_SET_SIZE;
+
+		for(size_t i = 0; i < MAX_INPUT_SET_SIZE; i++) {
+			if(!picked[i] && context->context_total[i] && (best == MAX_INPUT_SET_SIZE || context->context_total[i] > context->context_total[best]))
+				best = i;
+		}
+
+		if(best == MAX_INPUT_SET_SIZE)
+			break;
+
+		picked[best] = true;
+		memcpy(context->table_freq[seed_count], context->freq[best], sizeof(context->table_freq[seed_count]));
+	}
+
+	context->table_count = seed_count;
+
+	/*
+	 *	Much like k-means: code every context with each table in turn, move it to whichever table codes
+	 *	it in the fewest bits, then rebuild every table from the contexts it ended up with. Tables left
+	 *	with no contexts are dropped
+	 */
+
+	for(uint8_t pass = 0; pass < CONTEXT_CLUSTER_PASSES; pass++) {
+		uint8_t lengths[MAX_CONTEXT_TABLES][MAX_INPUT_SET_SIZE];
+		uint8_t renumber[MAX_CONTEXT_TABLES];
+		uint8_t table_count = 0;
+
+		for(uint8_t table = 0; table < context->table_count; table++) {
+			if((error = create_code_lengths(context->table_freq[table], encoding_table, ENCODING_TABLE_LENGTH, max_code_length)) != VALID_TREE)
+				return error;
+
+			for(size_t i = 0; i < MAX_INPUT_SET_SIZE; i++)
+				lengths[table][i] = encoding_table[i].length ? encoding_table[i].length : CONTEXT_MISSING_CODE_COST;
+		}
+
+		for(size_t c = 0; c < MAX_INPUT_SET_SIZE; c++) {
+			size_t best_bits = SIZE_MAX;
+
+			if(!context->context_total[c])
+				continue;
+
+			for(uint8_t table = 0; table < context->table_count; table++) {
+				size_t bits = 0;
+
+				for(size_t i = 0; i < MAX_INPUT_SET_SIZE; i++)
+					bits += context->freq[c][i] * lengths[table][i];
+
+				if(bits < best_bits) {
+					best_bits = bits;
+					context->context_map[c] = table;
+				}
+			}
+		}
+
+		memset(context->table_freq, 0, sizeof(context->table_freq));
+		memset(renumber, UINT8_MAX, sizeof(renumber));
+
+		for(size_t c = 0; c < MAX_INPUT_SET_SIZE; c++) {
+			if(!context->context_total[c])
+				continue;
+
+			if(renumber[context->context_map[c]] == UINT8_MAX)
+				renumber[context->context_map[c]] = table_count++;
+
+			context->context_map[c] = renumber[context->context_map[c]];
+
+			for(size_t i = 0; i < MAX_INPUT_SET_SIZE; i++)
+				context->table_freq[context->context_map[c]][i] += context->freq[c][i];
+		}
+
+		context->table_count = table_count;
+	}
+
+	/* Every table costs its code lengths on top of its codes, keep merging whichever pair of tables saves the most bits until none do */
+
+	for(uint8_t first = 0; first < context->table_count; first++) {
+		if((error = table_bit_length(context->table_freq[first], max_code_length, &table_bits[first])) != EXIT_SUCCESS)
+			return error;
+
+		for(uint8_t second = 0; second < first; second++) {
+			if((error = merged_bit_length(context, first, second, max_code_length, &merged_bits[first][second])) != EXIT_SUCCESS)
+				return error;
+
+			merged_bits[second][first] = merged_bits[first][second];
+		}
+	}
+
+	while(context->table_count > 1) {
+		uint8_t last = context->table_count - 1;
+		uint8_t keep = 0, drop = 0;
+		size_t best_saving = 0;
+
+		for(uint8_t first = 0; first < context->table_count; first++) {
+			for(uint8_t second = first + 1; second < context->table_count; second++) {
+				size_t separate_bits = table_bits[first] + table_bits[second];
+
+				if(merged_bits[first][second] < separate_bits && separate_bits - merged_bits[first][second] > best_saving) {
+					best_saving = separate_bits - merged_bits[first][second];
+					keep = first;
+					drop = second;
+				}
+			}
+		}
+
+		if(!best_saving)
+			break;
+
+		/* Fold `drop` into `keep`, then move the last table into the gap so the tables stay numbered from zero */
+
+		for(size_t i = 0; i < MAX_INPUT_SET_SIZE; i++)
+			context->table_freq[keep][i] += context->table_freq[drop][i];
+
+		table_bits[keep] = merged_bits[keep][drop];
+
+		for(size_t c = 0; c < MAX_INPUT_SET_SIZE; c++) {
+			if(context->context_map[c] == drop)
+				context->context_map[c] = keep;
+			else if(context->context_map[c] == last)
+				context->context_map[c] = drop;
+		}
+
+		if(drop != last) {
+			memcpy(context->table_freq[drop], context->table_freq[last], sizeof(context->table_freq[drop]));
+			table_bits[drop] = table_bits[last];
+
+			for(uint8_t table = 0; table < last; table++) {
+				merged_bits[drop][table] = merged_bits[last][table];
+				merged_bits[table][drop] = merged_bits[table][last];
+			}
+		}
+
+		context->table_count--;
+
+		for(uint8_t table = 0; table < context->table_count; table++) {
+			if(table != keep) {
+				if((error = merged_bit_length(context, keep, table, max_code_length, &merged_bits[keep][table])) != EXIT_SUCCESS)
+					return error;
+
+				merged_bits[table][keep] = merged_bits[keep][table];
+			}
+		}
+	}
+
+	return EXIT_SUCCESS;
+}
+
+static int plan_context_block(const uint8_t * input, const size_t input_length, const huffman_options_t * options, block_plan_t * plan)
+{
+	uint8_t max_code_length = options && options->max_code_length ? options->max_code_length : MAX_CODE_LENGTH;
+	uint8_t max_tables = options ? options->context_tables : 0;
+	context_plan_t * context;
+	size_t map_runs = 1;
+	size_t payload_bit_length = 0;
+	uint8_t index_bits = 0;
+	int error;
+
+	if(max_tables > MAX_CONTEXT_TABLES)
+		return INPUT_ERROR;
+
+	/* Context modelled blocks are a single stream with no seek index, and can't beat a block of one repeated byte */
+
+	if(max_tables < 2 || plan->mode == RLE_BLOCK || options->stream_count > 1 || options->index_interval)
+		return EXIT_SUCCESS;
+
+	if(!(context = malloc(sizeof(context_plan_t))))
+		return MEM_ERROR;
+
+	STATS_MARK(start);
+	memset(context->freq, 0, sizeof(context->freq));
+	memset(context->context_total, 0, sizeof(context->context_total));
+
+	for(size_t i = 0, previous = 0; i < input_length; previous = input[i++])
+		context->freq[previous][input[i]]++;
+
+	for(size_t c = 0; c < MAX_INPUT_SET_SIZE; c++) {
+		for(size_t i = 0; i < MAX_INPUT_SET_SIZE; i++)
+			context->context_total[c] += context->freq[c][i];
+	}
+
+	if((error = cluster_contexts(context, max_tables, max_code_length)) != EXIT_SUCCESS || context->table_count < 2) { /* One table is just an order-0 block with a bigger header */
+		free(context);
+		STATS_ELAPSED(context_cycles, start);
+
+		return error;
+	}
+
+	/* Contexts that never occur take the table of the one before them so the map has fewer runs */
+
+	for(size_t c = 1; c < MAX_INPUT_SET_SIZE; c++) {
+		if(!context->context_total[c])
+			context->context_map[c] = context->context_map[c - 1];
+
+		if(context->context_map[c] != context->context_map[c - 1])
+			map_runs++;
+	}
+
+	while((1U << index_bits) < context->table_count)
+		index_bits++;
+
+	context->map_format = map_runs * (index_bits + CONTEXT_RUN_BITS) < MAX_INPUT_SET_SIZE * index_bits ? CONTEXT_MAP_RUNS : CONTEXT_MAP_FLAT;
+	context->header_bit_length = CONTEXT_COUNT_BITS + 1 + (context->map_format == CONTEXT_MAP_RUNS ? map_runs * (index_bits + CONTEXT_RUN_BITS) : MAX_INPUT_SET_SIZE * index_bits);
+
+	for(uint8_t table = 0; table < context->table_count; table++) {
+		if((error = create_code_lengths(context->table_freq[table], context->encoding_tables[table], ENCODING_TABLE_LENGTH, max_code_length)) != VALID_TREE || (error = plan_code_lengths(context->encoding_tables[table], &context->headers[table])) != EXIT_SUCCESS) {
+			free(context);
+
+			return error;
+		}
+
+		create_canonical_codes(context->encoding_tables[table], ENCODING_TABLE_LENGTH);
+		context->header_bit_length += CONTEXT_TABLE_LENGTH_BITS + context->headers[table].bit_length;
+	}
+
+	for(size_t c = 0; c < MAX_INPUT_SET_SIZE; c++) {
+		for(size_t i = 0; i < MAX_INPUT_SET_SIZE; i++)
+			payload_bit_length += context->freq[c][i] * context->encoding_tables[context->context_map[c]][i].length;
+	}
+
+	assert(context->header_bit_length <= UINT16_MAX); /* At most 4 + 1 + 256 * 4 + 16 * (12 + 1 + 8 + 256 * 12) bits */
+
+	size_t total_length = plan->base_size + ((context->header_bit_length + payload_bit_length + 7) >> 3) + PEEK_PADDING;
+
+	STATS_ELAPSED(context_cycles, start);
+
+	if(total_length >= plan->total_length) { /* Only worth it if it beats the order-0 block */
+		free(context);
+
+		return EXIT_SUCCESS;
+	}
+
+	plan->mode = CONTEXT_BLOCK;
+	plan->flags &= LONG_LENGTH_FLAG;
+	plan->total_length = total_length;
+	plan->context = context;
+
+	return EXIT_SUCCESS;
+}
+
+static void free_plan(block_plan_t * plan)
+{
+	free(plan->context);
+	plan->context = NULL;
+}
+
+static void store_block(const uint8_t * input, const size_t input_length, const uint8_t mode, uint8_t * output)
+{
+	uint8_t flags = (mode << BLOCK_MODE_SHIFT) | ((uint64_t)input_length > UINT32_MAX ? LONG_LENGTH_FLAG : 0);
+	size_t base_size = HEADER_BASE_SIZE + (flags & LONG_LENGTH_FLAG ? LONG_LENGTH_EXTENSION : 0);
+
+	write_header_base(output, input_length, 0, flags);
+
+	if(mode == RAW_BLOCK)
+		memcpy(&output[base_size], input, input_length);
+	else
+		output[base_size] = input[0];
+}
+
+
+static void write_seek_index(const huffman_coding_table_t encoding_table[ENCODING_TABLE_LENGTH], const uint8_t * input, const size_t length, const size_t segment_length, const uint32_t interval, const size_t stream_bit_pos[HUFFMAN_MAX_STREAMS], uint8_t * index)
+{
+	size_t bit_pos = 0, next_segment = 0, next_point = interval;
+	uint8_t stream = 0;
+
+	store_length(index, interval, SEEK_INDEX_INTERVAL_LENGTH);
+	index += SEEK_INDEX_INTERVAL_LENGTH;
+
+	for(size_t i = 0; i < length; i++) { /* Walk the code lengths of the input in the same order the streams were encoded */
+		if(i == next_segment) {
+			bit_pos = stream_bit_pos[stream++];
+			next_segment += segment_length;
+		}
+
+		if(i == next_point) {
+			store_length(index, bit_pos, SEEK_INDEX_ENTRY_LENGTH);
+			index += SEEK_INDEX_ENTRY_LENGTH;
+			next_point += interval;
+		}
+
+		bit_pos += encoding_table[input[i]].length;
+	}
+}
+
+#ifdef HUFFMAN_STATS
+
+static void record_block_stats(const size_t input_length, const block_plan_t * plan)
+{
+	uint8_t table_count = plan->mode == CONTEXT_BLOCK ? plan->context->table_count : plan->mode == HUFFMAN_BLOCK;
+
+	thread_stats.blocks_encoded++;
+	thread_stats.encode_input_bytes += input_length;
+	thread_stats.encode_output_bytes += plan->total_length;
+	thread_stats.header_bits += plan->mode == CONTEXT_BLOCK ? plan->context->header_bit_length : plan->mode == HUFFMAN_BLOCK ? plan->header.bit_length : 0;
+
+	for(uint8_t table = 0; table < table_count; table++) {
+		const huffman_coding_table_t * encoding_table = plan->mode == CONTEXT_BLOCK ? plan->context->encoding_tables[table] : plan->encoding_table;
+
+		for(size_t i = 0; i < ENCODING_TABLE_LENGTH; i++) {
+			if(encoding_table[i].length > thread_stats.max_code_length)
+				thread_stats.max_code_length = encoding_table[i].length;
+		}
+	}
+}
+
+#endif
+
+static void write_context_block(const uint8_t * input, const size_t input_length, const block_plan_t * plan, uint8_t * output)
+{
+	const context_plan_t * context = plan->context;
+	const huffman_coding_table_t * context_tables[MAX_INPUT_SET_SIZE];
+	size_t bit_pos = plan->base_size << 3;
+	uint8_t index_bits = 0;
+
+	while((1U << index_bits) < context->table_count)
+		index_bits++;
+
+	STATS_MARK(header_start);
+	memset(output, 0, plan->base_size + ((context->header_bit_length + 7) >> 3));
+	memset(&output[plan->total_length - PEEK_PADDING], 0, PEEK_PADDING);
+
+	write_header_base(output, input_length, context->header_bit_length, plan->flags | (CONTEXT_BLOCK << BLOCK_MODE_SHIFT));
+	write_k_bits(output, context->table_count - 1, &bit_pos, CONTEXT_COUNT_BITS);
+	write_k_bits(output, context->map_format, &bit_pos, 1);
+
+	/* Context map, either one table index per context or runs of contexts sharing a table */
+
+	for(size_t c = 0; c < MAX_INPUT_SET_SIZE;) {
+		size_t run = 1;
+
+		if(context->map_format == CONTEXT_MAP_FLAT) {
+			write_k_bits(output, context->context_map[c], &bit_pos, index_bits);
+		} else {
+			while(c + run < MAX_INPUT_SET_SIZE && context->context_map[c + run] == context->context_map[c])
+				run++;
+
+			write_k_bits(output, context->context_map[c], &bit_pos, index_bits);
+			write_k_bits(output, run - 1, &bit_pos, CONTEXT_RUN_BITS);
+		}
+
+		c += run;
+	}
+
+	/* Each table's code lengths behind their bit length, since a run-length coded table relies on knowing where it ends */
+
+	for(uint8_t table = 0; table < context->table_count; table++) {
+		write_k_bits(output, context->headers[table].bit_length, &bit_pos, CONTEXT_TABLE_LENGTH_BITS);
+		write_code_lengths(context->encoding_tables[table], &context->headers[table], output, &bit_pos);
+	}
+
+	STATS_ELAPSED(header_cycles, header_start);
+	STATS_MARK(payload_start);
+
+	for(size_t c = 0; c < MAX_INPUT_SET_SIZE; c++)
+		context_tables[c] = context->encoding_tables[context->context_map[c]];
+
+	encode_context_symbols(context_tables, input, input_length, output, bit_pos);
+	STATS_ELAPSED(payload_cycles, payload_start);
+}
+
+static void write_block(const uint8_t * input, const size_t input_length, const huffman_options_t * options, const block_plan_t * plan, uint8_t * output)
+{
+#ifdef HUFFMAN_STATS
+	record_block_stats(input_length, plan);
+#endif
+
+	if(plan->mode == CONTEXT_BLOCK) {
+		write_context_block(input, input_length, plan, output);
+
+		return;
+	}
+
+	if(plan->mode != HUFFMAN_BLOCK) {
+		STATS_MARK(store_start);
+		store_block(input, input_length, plan->mode, output);
+		STATS_ELAPSED(payload_cycles, store_start);
+
+		return;
+	}
+
+	uint8_t stream_count = (plan->flags & STREAM_COUNT_MASK) + 1;
+	size_t segment_length = (input_length + stream_count - 1) / stream_count;
+	size_t entry_length = jump_table_entry_length(plan->flags);
+
+	/* The output may not be zeroed, clear the bytes the header is written into bit by bit and the padding */
+
+	STATS_MARK(header_start);
+	memset(output, 0, plan->base_size + ((plan->header.bit_length + 7) >> 3));
+	memset(&output[plan->total_length - PEEK_PADDING], 0, PEEK_PADDING);
+
+	/* Write header information */
+
+	write_header_base(output, input_length, plan->header.bit_length, plan->flags);
+
+	size_t bit_pos = plan->base_size << 3;
+
+	/* Store the code lengths, unless the decoder already has them from the block before */
+
+	if(!(plan->flags & REPEAT_TABLE_FLAG))
+		write_code_lengths(plan->encoding_table, &plan->header, output, &bit_pos);
+
+	STATS_ELAPSED(header_cycles, header_start);
+	STATS_MARK(payload_start);
+
+	/* Encode output stream, or each segment of the input to its own stream after a table of stream sizes */
+
+	if(stream_count == 1 && !plan->index_length) {
+		encode_symbols(plan->encoding_table, input, input_length, output, bit_pos);
+	} else {
+		size_t stream_bit_pos[HUFFMAN_MAX_STREAMS];
+		size_t byte_pos = (bit_pos + 7) >> 3;
+		size_t index_pos = byte_pos + (stream_count - 1) * entry_length;
+		size_t stream_start = index_pos + plan->index_length;
+
+		for(uint8_t stream = 0; stream < stream_count; stream++) {
+			size_t segment_start = stream * segment_length < input_length ? stream * segment_length : input_length;
+			size_t segment_end = segment_start + segment_length < input_length ? segment_start + segment_length : input_length;
+			size_t stream_size = (plan->stream_bit_length[stream] + 7) >> 3;
+
+			if(stream < stream_count - 1)
+				store_length(&output[byte_pos + stream * entry_length], stream_size, entry_length);
+
+			stream_bit_pos[stream] = stream_start << 3;
+			encode_symbols(plan->encoding_table, &input[segment_start], segment_end - segment_start, output, stream_bit_pos[stream]);
+			stream_start += stream_size;
+		}
+
+		if(plan->index_length)
+			write_seek_index(plan->encoding_table, input, input_length, segment_length, options->index_interval, stream_bit_pos, &output[index_pos]);
+	}
+
+	STATS_ELAPSED(payload_cycles, payload_start);
+}
+
+static int compress_block(const uint8_t * input, const size_t input_length, uint8_t * output, const size_t output_capacity, const huffman_options_t * options, const huffman_coding_table_t * previous_table, block_plan_t * plan, size_t * output_length)
+{
+	size_t stream_freq[HUFFMAN_MAX_STREAMS][MAX_INPUT_SET_SIZE];
+	int error;
+
+	if((error = stream_histograms(input, input_length, options, stream_freq)) != EXIT_SUCCESS)
+		return error;
+
+	if((error = plan_block(stream_freq, options && options->stream_count ? options->stream_count : 1, input_length, options, previous_table, plan)) != EXIT_SUCCESS || (error = plan_context_block(input, input_length, options, plan)) != EXIT_SUCCESS)
+		return error;
+
+	if(plan->total_length > output_capacity) {
+		free_plan(plan);
+
+		return LENGTH_ERROR;
+	}
+
+	write_block(input, input_length, options, plan, output);
+	free_plan(plan);
+
+	*output_length = plan->total_length;
+
+	return EXIT_SUCCESS;
+}
+
+/* Internal decoding functions */
+
+static inline uint16_t peek_buffer(const uint8_t * input, const size_t bit_pos)
+{
+	size_t byte_pos = bit_pos >> 3;
+	uint32_t concat = (input[byte_pos + 2] << 0x10) | (input[byte_pos + 1] << 0x8) | input[byte_pos];
+
+	return concat >> (bit_pos & 7); /* Concatenate three successive bytes together and return the 16 bits at the calculated bit offset */
+}
+
+static inline uint64_t refill_bit_buffer(const uint8_t * input, const size_t bit_pos)
+{
+	uint64_t concat;
+
+	memcpy(&concat, &input[bit_pos >> 3], sizeof(concat)); /* Compiles down to a single unaligned load */
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	concat = __builtin_bswap64(concat);
+#endif
+
+	return concat >> (bit_pos & 7); /* The top (bit_pos & 7) bits are left empty, which leaves at least 57 valid bits */
+}
+
+static inline uint64_t refill_bit_buffer_checked(const uint8_t * input, const size_t input_length, const size_t bit_pos)
+{
+	uint8_t tail[sizeof(uint64_t)] = { 0 };
+	size_t byte_pos = bit_pos >> 3;
+
+	if(byte_pos < input_length && input_length - byte_pos >= sizeof(uint64_t))
+		return refill_bit_buffer(input, bit_pos);
+
+	if(byte_pos < input_length)
+		memcpy(tail, &input[byte_pos], input_length - byte_pos);
+
+	return refill_bit_buffer(tail, bit_pos & 7);
+}
+
+static inline size_t unchecked_rounds(const size_t input_length, const size_t bit_pos, const size_t round_bytes)
+{
+	size_t byte_pos = bit_pos >> 3;
+
+	if(input_length < sizeof(uint64_t) || byte_pos > input_length - sizeof(uint64_t))
+		return 0;
+
+	return (input_length - sizeof(uint64_t) - byte_pos) / round_bytes + 1; /* Every round but the last has to leave room for the next full refill */
+}
+
+static inline uint16_t read_k_bits(const uint8_t * input, size_t * bit_pos, const uint8_t bits)
+{
+	uint16_t value = peek_buffer(input, *bit_pos) & ((1U << bits) - 1);
+
+	*bit_pos += bits;
+
+	return value;
+}
+
+static uint8_t read_canonical_symbol(const uint8_t * input, size_t * bit_pos, const uint16_t * length_count, const uint8_t * sorted_symbols, const uint8_t max_length)
+{
+	int code = 0; /* Codes are read from their first bit, each length owns a contiguous range of codes */
+	int first = 0;
+	int index = 0;
+
+	for(uint8_t length = 1; length <= max_length; length++) {
+		code |= read_k_bits(input, bit_pos, 1);
+
+		if(code - first < length_count[length])
+			return sorted_symbols[index + code - first];
+
+		index += length_count[length];
+		first = (first + length_count[length]) << 1;
+		code <<= 1;
+	}
+
+	return 0; /* Not a valid code, only possible with a corrupt header */
+}
+
+static int read_code_lengths(const uint8_t * input, size_t bit_pos, const size_t header_bit_length, huffman_coding_table_t code_table[ENCODING_TABLE_LENGTH])
+{
+	uint32_t code_space = 0;
+
+	if(header_bit_length < bit_pos + 9) /* Too short for even the smallest code lengths */
+		return INPUT_ERROR;
+
+	if(read_k_bits(input, &bit_pos, 1) == SPARSE_HEADER) {
+		size_t encoded_bytes = read_k_bits(input, &bit_pos, 8) + 1;
+
+		if(header_bit_length - bit_pos < encoded_bytes * 12)
+			return INPUT_ERROR;
+
+		for(size_t i = 0; i < encoded_bytes; i++) {
+			uint8_t decoded_byte = read_k_bits(input, &bit_pos, 8);
+
+			code_table[decoded_byte].length = read_k_bits(input, &bit_pos, 4) + 1;
+		}
+	} else {
+		uint16_t length_count[MAX_CODE_LENGTH_CODE_LENGTH + 1] = { 0 };
+		uint8_t code_lengths[CODE_LENGTH_ALPHABET_SIZE] = { 0 };
+		uint8_t sorted_symbols[CODE_LENGTH_ALPHABET_SIZE];
+		size_t code_length_count = read_k_bits(input, &bit_pos, 5) + 1;
+		size_t sorted_count = 0;
+
+		if(header_bit_length - bit_pos < code_length_count * 3)
+			return INPUT_ERROR;
+
+		/* Rebuild the code length code */
+
+		for(size_t i = 0; i < code_length_count && i < CODE_LENGTH_ALPHABET_SIZE; i++)
+			code_lengths[code_length_order[i]] = read_k_bits(input, &bit_pos, 3);
+
+		for(uint8_t length = 1; length <= MAX_CODE_LENGTH_CODE_LENGTH; length++) {
+			for(uint8_t symbol = 0; symbol < CODE_LENGTH_ALPHABET_SIZE; symbol++) {
+				if(code_lengths[symbol] == length) {
+					sorted_symbols[sorted_count++] = symbol;
+					length_count[length]++;
+				}
+			}
+		}
+
+		/* Expand the code length symbols until the header runs out */
+
+		uint8_t previous = 0;
+
+		for(size_t i = 0; i < ENCODING_TABLE_LENGTH && bit_pos < header_bit_length;) {
+			uint8_t symbol = read_canonical_symbol(input, &bit_pos, length_count, sorted_symbols, MAX_CODE_LENGTH_CODE_LENGTH);
+
+			if(symbol <= MAX_CODE_LENGTH) {
+				code_table[i++].length = previous = symbol;
+			} else {
+				size_t repeat = code_length_repeat_base[symbol] + read_k_bits(input, &bit_pos, code_length_extra_bits[symbol]);
+				uint8_t length = symbol == REPEAT_PREVIOUS ? previous : 0;
+
+				while(repeat-- && i < ENCODING_TABLE_LENGTH)
+					code_table[i++].length = length;
+			}
+		}
+	}
+
+	for(size_t i = 0; i < ENCODING_TABLE_LENGTH; i++) {
+		if(code_table[i].length)
+			code_space += 1U << (MAX_CODE_LENGTH - code_table[i].length);
+	}
+
+	if(code_space > (1U << MAX_CODE_LENGTH)) /* More codes than the lengths have room for, no prefix code looks like this */
+		return INPUT_ERROR;
+
+	create_canonical_codes(code_table, ENCODING_TABLE_LENGTH);
+
+	return EXIT_SUCCESS;
+}
+
+static int read_code_table(const uint8_t * input, huffman_coding_table_t code_table[ENCODING_TABLE_LENGTH], size_t * bit_pos)
+{
+	*bit_pos = header_end(input);
+
+	if(input[HEADER_FLAGS_OFFSET] & REPEAT_TABLE_FLAG) /* The table is in an earlier block, only a decoder built from that block can decode this one */
+		return INPUT_ERROR;
+
+	return read_code_lengths(input, header_base_size(input) << 3, *bit_pos, code_table);
+}
+
+static uint8_t find_table_bits(const huffman_coding_table_t code_table[ENCODING_TABLE_LENGTH], const bool two_level, uint8_t * code_bits)
+{
+	uint8_t longest = 0;
+
+	for(size_t i = 0; i < ENCODING_TABLE_LENGTH; i++) {
+		if(code_table[i].length > longest)
+			longest = code_table[i].length;
+	}
+
+	/* A table no bigger than the longest code needs, only split in two when the codes are too long for TWO_LEVEL_LOOKUP_BITS */
+
+	*code_bits = longest > MIN_TABLE_BITS ? longest : MIN_TABLE_BITS;
+
+	if(two_level && *code_bits > TWO_LEVEL_LOOKUP_BITS) {
+		if(longest <= TWO_LEVEL_LOOKUP_BITS) /* Every code fits the primary table, so it never needs a link */
+			*code_bits = TWO_LEVEL_LOOKUP_BITS;
+
+		return TWO_LEVEL_LOOKUP_BITS;
+	}
+
+	return *code_bits;
+}
+
+static void find_subtable_bits(const huffman_coding_table_t code_table[ENCODING_TABLE_LENGTH], const uint8_t table_bits, uint8_t subtable_bits[SUBTABLE_PREFIX_COUNT])
+{
+	memset(subtable_bits, 0, SUBTABLE_PREFIX_COUNT);
+
+	for(size_t i = 0; i < ENCODING_TABLE_LENGTH; i++) {
+		if(code_table[i].length > table_bits) {
+			uint16_t prefix = code_table[i].code & ((1U << table_bits) - 1);
+			uint8_t bits = code_table[i].length - table_bits;
+
+			assert(table_bits <= TWO_LEVEL_LOOKUP_BITS); /* Only two level tables have codes longer than the primary table index */
+
+			if(bits > subtable_bits[prefix])
+				subtable_bits[prefix] = bits;
+		}
+	}
+}
+
+static size_t count_decoding_entries(const huffman_coding_table_t code_table[ENCODING_TABLE_LENGTH], const uint8_t table_bits)
+{
+	uint8_t subtable_bits[SUBTABLE_PREFIX_COUNT];
+	size_t entries = 1U << table_bits;
+
+	if(table_bits < LOOKUP_BITS) {
+		find_subtable_bits(code_table, table_bits, subtable_bits);
+
+		for(size_t prefix = 0; prefix < SUBTABLE_PREFIX_COUNT; prefix++) {
+			if(subtable_bits[prefix])
+				entries += 1U << subtable_bits[prefix];
+		}
+	}
+
+	return entries;
+}
+
+static void create_decoding_table(const huffman_coding_table_t code_table[ENCODING_TABLE_LENGTH], huffman_decoding_entry_t * decoding_table, const uint8_t table_bits, const bool * pair_after)
+{
+	const huffman_decoding_entry_t unused_entry = { .symbol = { 0 }, .length = 1, .count = 1 };
+	uint8_t subtable_bits[SUBTABLE_PREFIX_COUNT];
+	uint16_t length_start[MAX_CODE_LENGTH + 2] = { 0 };
+	uint16_t length_next[MAX_CODE_LENGTH + 1];
+	uint8_t sorted_symbols[ENCODING_TABLE_LENGTH];
+	size_t table_length = 1U << table_bits;
+	STATS_MARK(start);
+
+	/* Sort the symbols that fit in the primary table by code length */
+
+	for(size_t i = 0; i < ENCODING_TABLE_LENGTH; i++) {
+		if(code_table[i].length && code_table[i].length <= table_bits)
+			length_start[code_table[i].length + 1]++;
+	}
+
+	for(uint8_t length = 1; length <= MAX_CODE_LENGTH; length++)
+		length_start[length + 1] += length_start[length];
+
+	memcpy(length_next, length_start, sizeof(length_next));
+
+	for(size_t i = 0; i < ENCODING_TABLE_LENGTH; i++) {
+		uint8_t encoded_length = code_table[i].length;
+
+		if(encoded_length && encoded_length <= table_bits)
+			sorted_symbols[length_next[encoded_length]++] = i;
+	}
+
+	/* 
+	 *	A code of `length` bits owns every index whose low `length` bits are the code. Filling the table
+	 *	one length at a time, the first 2^length entries are complete once every code up to that length
+	 *	is in, so copying them on top of themselves repeats each code for the next bit before the codes
+	 *	of the next length go in. An incomplete code leaves entries no code reaches, any that turn up in
+	 *	corrupt input decode as a zero byte so decoding always moves on
+	 */
+
+	decoding_table[0] = decoding_table[1] = unused_entry;
+
+	for(uint8_t length = 1; length <= table_bits; length++) {
+		if(length > 1)
+			memcpy(&decoding_table[1U << (length - 1)], decoding_table, (1U << (length - 1)) * sizeof(huffman_decoding_entry_t));
+
+		for(size_t i = length_start[length]; i < length_start[length + 1]; i++) {
+			uint8_t symbol = sorted_symbols[i];
+
+			decoding_table[code_table[symbol].code] = (huffman_decoding_entry_t){ .symbol = { symbol }, .length = length, .count = 1 };
+		}
+	}
+
+	/* Longer codes share a second level table with every other code that starts with the same `table_bits` bits */
+
+	if(table_bits < LOOKUP_BITS) {
+		find_subtable_bits(code_table, table_bits, subtable_bits);
+
+		for(size_t prefix = 0; prefix < SUBTABLE_PREFIX_COUNT; prefix++) {
+			if(subtable_bits[prefix]) {
+				decoding_table[prefix] = (huffman_decoding_entry_t){ .subtable = table_length, .length = subtable_bits[prefix], .count = 0 };
+
+				for(size_t i = 0; i < (1U << subtable_bits[prefix]); i++)
+					decoding_table[table_length + i] = unused_entry;
+
+				table_length += 1U << subtable_bits[prefix];
+			}
+		}
+
+		for(size_t i = 0; i < ENCODING_TABLE_LENGTH; i++) {
+			uint8_t encoded_length = code_table[i].length;
+
+			if(encoded_length > table_bits) {
+				huffman_decoding_entry_t link = decoding_table[code_table[i].code & ((1U << table_bits) - 1)];
+				uint8_t suffix_length = encoded_length - table_bits;
+				uint16_t suffix = code_table[i].code >> table_bits;
+
+				for(size_t padding = 0; padding < (1U << (link.length - suffix_length)); padding++)
+					decoding_table[link.subtable + (suffix | (padding << suffix_length))] = (huffman_decoding_entry_t){ .symbol = { i }, .length = encoded_length, .count = 1 };
+			}
+		}
+	}
+
+	/* 
+	 *	Every primary entry starts out holding a single symbol. Walking the table from the top down, an
+	 *	index `i` whose first code leaves enough bits for a second code looks up the rest of its bits
+	 *	at `i >> length`, which is always lower than `i` and so has not been merged into a pair yet.
+	 *	With a context model the second code is only from this table if `pair_after` says so
+	 */
+
+	for(size_t i = 1U << table_bits; i-- > 0;) {
+		huffman_decoding_entry_t first = decoding_table[i];
+		huffman_decoding_entry_t second = decoding_table[i >> first.length];
+		huffman_decoding_entry_t pair = { .symbol = { first.symbol[0], second.symbol[0] }, .length = first.length + second.length, .count = 2 };
+
+		/* Whether an entry pairs up is close to random from one index to the next, a select instead of a branch keeps the fill from mispredicting */
+
+		bool pairs = (first.count == 1) & (first.length < table_bits) & (second.count == 1) & (second.length <= table_bits - first.length) & (!pair_after || pair_after[first.symbol[0]]);
+
+		decoding_table[i] = pairs ? pair : first;
+	}
+
+	STATS_ELAPSED(decoding_table_cycles, start);
+}
+
+static inline huffman_decoding_entry_t lookup_symbols(const huffman_decoding_entry_t * decoding_table, const uint8_t table_bits, const uint8_t code_bits, const uint64_t buffer)
+{
+	huffman_decoding_entry_t entry = decoding_table[buffer & ((1U << table_bits) - 1)];
+
+	if(code_bits > table_bits && !entry.count) /* Follow the link to a second level table, single level tables have none */
+		entry = decoding_table[entry.subtable + ((buffer >> table_bits) & ((1U << entry.length) - 1))];
+
+	return entry;
+}
+
+static FORCE_INLINE int decode_symbols_with(const huffman_decoding_entry_t * decoding_table, const uint8_t table_bits, const uint8_t code_bits, const uint8_t * input, const size_t input_length, size_t bit_pos, uint8_t * output, const size_t decompressed_length)
+{
+	const size_t lookups = REFILL_VALID_BITS / code_bits;
+	const size_t round_bytes = (lookups * code_bits + 7) >> 3;
+	size_t byte_count = 0;
+	STATS_MARK(start);
+	STATS_COUNT(decode_input_bits, -(uint64_t)bit_pos); /* The final bit position is added back at the end, which leaves the number of bits read */
+
+	/* 
+	 *	As many lookups per refill as codes of code_bits fit in it, while there's room to write every
+	 *	symbol they could emit and to refill without reaching the end of the input. Both limits are
+	 *	worked out up front as a number of rounds so the rounds themselves run without any checks
+	 */
+
+	for(;;) {
+		size_t rounds = (decompressed_length - byte_count) / (lookups * SYMBOLS_PER_ENTRY);
+		size_t input_rounds = unchecked_rounds(input_length, bit_pos, round_bytes);
+
+		if(input_rounds < rounds)
+			rounds = input_rounds;
+
+		if(!rounds)
+			break;
+
+		while(rounds--) {
+			uint64_t buffer = refill_bit_buffer(input, bit_pos);
+
+			for(size_t lookup = 0; lookup < lookups; lookup++) {
+				huffman_decoding_entry_t entry = lookup_symbols(decoding_table, table_bits, code_bits, buffer);
+
+				output[byte_count] = entry.symbol[0]; /* Always write both symbols to keep the loop branch free, the second is overwritten later if it isn't used */
+				output[byte_count + 1] = entry.symbol[1];
+				byte_count += entry.count;
+				buffer >>= entry.length;
+				bit_pos += entry.length;
+			}
+		}
+	}
+
+	/* Decode the last few symbols one lookup at a time, reading the end of the input as zeros */
+
+	while(byte_count < decompressed_length) {
+		huffman_decoding_entry_t entry = lookup_symbols(decoding_table, table_bits, code_bits, refill_bit_buffer_checked(input, input_length, bit_pos));
+
+		output[byte_count++] = entry.symbol[0];
+
+		if(entry.count > 1) {
+			if(byte_count == decompressed_length) /* Only the first symbol of the pair is wanted and nothing comes after it */
+				break;
+
+			output[byte_count++] = entry.symbol[1];
+		}
+
+		bit_pos += entry.length;
+	}
+
+	STATS_COUNT(decode_input_bits, bit_pos);
+	STATS_COUNT(decode_output_bytes, byte_count);
+	STATS_ELAPSED(decode_cycles, start);
+
+	return (bit_pos + 7) >> 3 > input_length ? INPUT_ERROR : EXIT_SUCCESS; /* The last codes ran off the end of the input */
+}
+
+static int decode_symbols(const huffman_decoding_entry_t * decoding_table, const uint8_t table_bits, const uint8_t code_bits, const uint8_t * input, const size_t input_length, size_t bit_pos, uint8_t * output, const size_t decompressed_length)
+{
+	/* Single level tables get a copy of the loop for each table size, two level tables share one that allows for codes of any length */
+
+#define DECODE_SYMBOLS_CASE(bits) case bits: return decode_symbols_with(decoding_table, bits, bits, input, input_length, bit_pos, output, decompressed_length);
+
+	if(code_bits == table_bits) {
+		switch(table_bits) {
+			DECODE_SYMBOLS_CASE(12)
+			DECODE_SYMBOLS_CASE(13)
+			DECODE_SYMBOLS_CASE(14)
+			DECODE_SYMBOLS_CASE(15)
+			DECODE_SYMBOLS_CASE(16)
+		}
+	}
+
+#undef DECODE_SYMBOLS_CASE
+
+	return decode_symbols_with(decoding_table, table_bits, code_bits, input, input_length, bit_pos, output, decompressed_length);
+}
+
+#ifdef HAVE_AVX2_DECODER
+
+__attribute__((target("avx2"))) static inline __m128i lookup_symbols_avx2(const huffman_decoding_entry_t * decoding_table, const uint8_t table_bits, const __m256i buffer)
+{
+	const __m128i field_mask = _mm_set1_epi32(0xff);
+	__m128i entry = _mm256_i64gather_epi32((const int *)decoding_table, _mm256_and_si256(buffer, _mm256_set1_epi64x((1U << table_bits) - 1)), sizeof(huffman_decoding_entry_t));
+	__m128i links = _mm_cmpeq_epi32(_mm_srli_epi32(entry, 24), _mm_setzero_si128());
+
+	if(!_mm_testz_si128(links, links)) { /* Follow the links to second level tables in just the lanes that have one */
+		__m256i suffix_mask = _mm256_sub_epi64(_mm256_sllv_epi64(_mm256_set1_epi64x(1), _mm256_cvtepu32_epi64(_mm_and_si128(_mm_srli_epi32(entry, 16), field_mask))), _mm256_set1_epi64x(1));
+		__m256i suffix = _mm256_and_si256(_mm256_srli_epi64(buffer, table_bits), suffix_mask);
+		__m256i index = _mm256_add_epi64(_mm256_cvtepu32_epi64(_mm_and_si128(entry, _mm_set1_epi32(0xffff))), suffix);
+
+		entry = _mm256_mask_i64gather_epi32(entry, (const int *)decoding_table, index, links, sizeof(huffman_decoding_entry_t));
+	}
+
+	return entry;
+}
+
+__attribute__((target("avx2"))) static void decode_streams_avx2(const huffman_decoding_entry_t * decoding_table, const uint8_t table_bits, const uint8_t * input, const size_t input_length, size_t bit_pos[HUFFMAN_MAX_STREAMS], uint8_t * output, size_t byte_count[HUFFMAN_MAX_STREAMS], const size_t segment_end[HUFFMAN_MAX_STREAMS], const uint8_t stream_count)
+{
+	int64_t lane_pos[VECTOR_LANES];
+	uint32_t entries[VECTOR_LANES];
+
+	/* Lanes with no stream of their own shadow the first stream, nothing they decode is written out */
+
+	for(uint8_t lane = 0; lane < VECTOR_LANES; lane++)
+		lane_pos[lane] = bit_pos[lane < stream_count ? lane : 0];
+
+	__m256i pos[2] = { _mm256_loadu_si256((const __m256i *)&lane_pos[0]), _mm256_loadu_si256((const __m256i *)&lane_pos[4]) };
+	const __m128i field_mask = _mm_set1_epi32(0xff);
+	const __m256i bit_mask = _mm256_set1_epi64x(7);
+
+	/*
+	 *	The same rounds as decode_streams(), with the lanes split over two vectors of four 64-bit bit
+	 *	buffers. Each refill is a gather, each lookup a gather of four decoding table entries per
+	 *	vector, and the two vectors never wait on each other. Only writing the symbols out is done a
+	 *	lane at a time
+	 */
+
+	for(;;) {
+		size_t rounds = SIZE_MAX;
+
+		_mm256_storeu_si256((__m256i *)&lane_pos[0], pos[0]);
+		_mm256_storeu_si256((__m256i *)&lane_pos[4], pos[1]);
+
+		for(uint8_t stream = 0; stream < stream_count; stream++) {
+			size_t stream_rounds = (segment_end[stream] - byte_count[stream]) / (LOOKUPS_PER_REFILL * SYMBOLS_PER_ENTRY);
+			size_t input_rounds = unchecked_rounds(input_length, lane_pos[stream], ROUND_INPUT_BYTES);
+
+			if(stream_rounds < rounds)
+				rounds = stream_rounds;
+
+			if(input_rounds < rounds)
+				rounds = input_rounds;
+		}
+
+		if(!rounds)
+			break;
+
+		while(rounds--) {
+			__m256i buffer[2];
+
+			for(size_t half = 0; half < 2; half++)
+				buffer[half] = _mm256_srlv_epi64(_mm256_i64gather_epi64((const long long *)input, _mm256_srli_epi64(pos[half], 3), 1), _mm256_and_si256(pos[half], bit_mask));
+
+			for(size_t lookup = 0; lookup < LOOKUPS_PER_REFILL; lookup++) {
+				for(size_t half = 0; half < 2; half++) {
+					__m128i entry = lookup_symbols_avx2(decoding_table, table_bits, buffer[half]);
+					__m256i length = _mm256_cvtepu32_epi64(_mm_and_si128(_mm_srli_epi32(entry, 16), field_mask));
+
+					buffer[half] = _mm256_srlv_epi64(buffer[half], length);
+					pos[half] = _mm256_add_epi64(pos[half], length);
+					_mm_storeu_si128((__m128i *)&entries[4 * half], entry);
+				}
+
+				for(uint8_t stream = 0; stream < stream_count; stream++) {
+					memcpy(&output[byte_count[stream]], &entries[stream], SYMBOLS_PER_ENTRY); /* Both symbols, the second is overwritten later if it isn't used */
+					byte_count[stream] += entries[stream] >> 24;
+				}
+			}
+		}
+	}
+
+	for(uint8_t stream = 0; stream < stream_count; stream++)
+		bit_pos[stream] = lane_pos[stream];
+}
+
+#endif
+
+static FORCE_INLINE void decode_stream_rounds_with(const huffman_decoding_entry_t * decoding_table, const uint8_t table_bits, const uint8_t code_bits, const uint8_t * input, const size_t input_length, size_t bit_pos[HUFFMAN_MAX_STREAMS], uint8_t * output, size_t byte_count[HUFFMAN_MAX_STREAMS], const size_t segment_end[HUFFMAN_MAX_STREAMS], const uint8_t stream_count)
+{
+	const size_t lookups = REFILL_VALID_BITS / code_bits;
+	const size_t round_bytes = (lookups * code_bits + 7) >> 3;
+
+	/* 
+	 *	Each stream only depends on its own bit position, so stepping through the streams in lockstep
+	 *	keeps one lookup per stream in flight at once. Rather than checking every stream for room
+	 *	after each round, work out how many rounds the shortest stream can take and run them all
+	 */
+
+	for(;;) {
+		size_t rounds = SIZE_MAX;
+
+		for(uint8_t stream = 0; stream < stream_count; stream++) {
+			size_t stream_rounds = (segment_end[stream] - byte_count[stream]) / (lookups * SYMBOLS_PER_ENTRY);
+			size_t input_rounds = unchecked_rounds(input_length, bit_pos[stream], round_bytes);
+
+			if(stream_rounds < rounds)
+				rounds = stream_rounds;
+
+			if(input_rounds < rounds)
+				rounds = input_rounds;
+		}
+
+		if(!rounds)
+			break;
+
+		while(rounds--) {
+			uint64_t buffer[HUFFMAN_MAX_STREAMS];
+
+			for(uint8_t stream = 0; stream < stream_count; stream++)
+				buffer[stream] = refill_bit_buffer(input, bit_pos[stream]);
+
+			for(size_t lookup = 0; lookup < lookups; lookup++) {
+				for(uint8_t stream = 0; stream < stream_count; stream++) {
+					huffman_decoding_entry_t entry = lookup_symbols(decoding_table, table_bits, code_bits, buffer[stream]);
+
+					output[byte_count[stream]] = entry.symbol[0];
+					output[byte_count[stream] + 1] = entry.symbol[1];
+					byte_count[stream] += entry.count;
+					buffer[stream] >>= entry.length;
+					bit_pos[stream] += entry.length;
+				}
+			}
+		}
+	}
+}
+
+static void decode_stream_rounds(const huffman_decoding_entry_t * decoding_table, const uint8_t table_bits, const uint8_t code_bits, const uint8_t * input, const size_t input_length, size_t bit_pos[HUFFMAN_MAX_STREAMS], uint8_t * output, size_t byte_count[HUFFMAN_MAX_STREAMS], const size_t segment_end[HUFFMAN_MAX_STREAMS], const uint8_t stream_count)
+{
+	/* Specialised per table size the same way as decode_symbols() */
+
+#define DECODE_STREAM_ROUNDS_CASE(bits) case bits: decode_stream_rounds_with(decoding_table, bits, bits, input, input_length, bit_pos, output, byte_count, segment_end, stream_count); return;
+
+	if(code_bits == table_bits) {
+		switch(table_bits) {
+			DECODE_STREAM_ROUNDS_CASE(12)
+			DECODE_STREAM_ROUNDS_CASE(13)
+			DECODE_STREAM_ROUNDS_CASE(14)
+			DECODE_STREAM_ROUNDS_CASE(15)
+			DECODE_STREAM_ROUNDS_CASE(16)
+		}
+	}
+
+#undef DECODE_STREAM_ROUNDS_CASE
+
+	decode_stream_rounds_with(decoding_table, table_bits, code_bits, input, input_length, bit_pos, output, byte_count, segment_end, stream_count);
+}
+
+static int decode_streams(const huffman_decoding_entry_t * decoding_table, const uint8_t table_bits, const uint8_t code_bits, const uint8_t * input, const size_t input_length, size_t bit_pos[HUFFMAN_MAX_STREAMS], uint8_t * output, const size_t decompressed_length, const uint8_t stream_count, const bool vector_decode)
+{
+	size_t segment_length = (decompressed_length + stream_count - 1) / stream_count;
+	size_t byte_count[HUFFMAN_MAX_STREAMS];
+	size_t segment_end[HUFFMAN_MAX_STREAMS];
+	int error = EXIT_SUCCESS;
+
+	for(uint8_t stream = 0; stream < stream_count; stream++) {
+		byte_count[stream] = stream * segment_length < decompressed_length ? stream * segment_length : decompressed_length;
+		segment_end[stream] = byte_count[stream] + segment_length < decompressed_length ? byte_count[stream] + segment_length : decompressed_length;
+	}
+
+	STATS_MARK(start);
+
+#ifdef HUFFMAN_STATS
+	for(uint8_t stream = 0; stream < stream_count; stream++) { /* Taken off here and added back once the lockstep rounds are done, the tails count themselves */
+		thread_stats.decode_input_bits -= bit_pos[stream];
+		thread_stats.decode_output_bytes -= byte_count[stream];
+	}
+#endif
+
+#ifdef HAVE_AVX2_DECODER
+	if(vector_decode && __builtin_cpu_supports("avx2")) /* Most of the input goes through the vector rounds, the scalar rounds below pick up where they stop */
+		decode_streams_avx2(decoding_table, table_bits, input, input_length, bit_pos, output, byte_count, segment_end, stream_count);
+#else
+	(void)vector_decode; /* Built without the vector decoder, every stream takes the scalar rounds */
+#endif
+
+	decode_stream_rounds(decoding_table, table_bits, code_bits, input, input_length, bit_pos, output, byte_count, segment_end, stream_count);
+
+#ifdef HUFFMAN_STATS
+	for(uint8_t stream = 0; stream < stream_count; stream++) {
+		thread_stats.decode_input_bits += bit_pos[stream];
+		thread_stats.decode_output_bytes += byte_count[stream];
+	}
+#endif
+
+	STATS_ELAPSED(decode_cycles, start);
+
+	for(uint8_t stream = 0; stream < stream_count && !error; stream++)
+		error = decode_symbols(decoding_table, table_bits, code_bits, input, input_length, bit_pos[stream], &output[byte_count[stream]], segment_end[stream] - byte_count[stream]);
+
+	return error;
+}
+
+static int decode_payload(const huffman_decoding_entry_t * decoding_table, const uint8_t table_bits, const uint8_t code_bits, const uint8_t * input, const size_t input_length, const size_t bit_pos, uint8_t * output, const size_t decompressed_length, const bool vector_decode)
+{
+	size_t stream_bit_pos[HUFFMAN_MAX_STREAMS];
+	size_t index_pos;
+	uint8_t stream_count = locate_streams(input, input_length, bit_pos, stream_bit_pos, &index_pos);
+
+	if(!stream_count)
+		return INPUT_ERROR;
+
+	if(stream_count == 1)
+		return decode_symbols(decoding_table, table_bits, code_bits, input, input_length, stream_bit_pos[0], output, decompressed_length);
+
+	return decode_streams(decoding_table, table_bits, code_bits, input, input_length, stream_bit_pos, output, decompressed_length, stream_count, vector_decode);
+}
+
+static void decode_stored(const uint8_t * input, const size_t offset, const size_t length, uint8_t * output)
+{
+	size_t base_size = header_base_size(input);
+
+	if(block_mode(input) == RLE_BLOCK) /* huffman_decompressed_length() has already checked the payload is all there */
+		memset(output, input[base_size], length);
+	else
+		memcpy(output, &input[base_size + offset], length);
+}
+
+static int decode_range(const huffman_decoding_entry_t * decoding_table, const uint8_t table_bits, const uint8_t code_bits, const uint8_t * input, const size_t input_length, const size_t offset, const size_t length, uint8_t * output)
+{
+	size_t stream_bit_pos[HUFFMAN_MAX_STREAMS];
+	size_t index_pos;
+	size_t decompressed_length = read_decompressed_length(input);
+	uint8_t stream_count = locate_streams(input, input_length, header_end(input), stream_bit_pos, &index_pos);
+	int error;
+
+	if(!stream_count)
+		return INPUT_ERROR;
+
+	size_t segment_length = (decompressed_length + stream_count - 1) / stream_count;
+	size_t interval = input[HEADER_FLAGS_OFFSET] & SEEK_INDEX_FLAG ? load_length(&input[index_pos], SEEK_INDEX_INTERVAL_LENGTH) : 0;
+	size_t position = offset;
+	size_t end = offset + length;
+
+	if(!interval) /* Without an index only the start of each stream is a known position */
+		interval = decompressed_length;
+
+	/*
+	 *	Every seek point and stream start is a known bit position, so the range is decoded in pieces
+	 *	running from one known position to the next. Only the first piece can start before the range,
+	 *	its unwanted leading bytes are decoded to a scratch buffer and dropped
+	 */
+
+	while(position < end) {
+		size_t point = position / interval * interval;
+		size_t segment_start = position / segment_length * segment_length;
+		size_t piece_start, piece_bit_pos, piece_end;
+
+		if(point > segment_start) {
+			piece_start = point;
+			piece_bit_pos = load_length(&input[index_pos + SEEK_INDEX_INTERVAL_LENGTH + (point / interval - 1) * SEEK_INDEX_ENTRY_LENGTH], SEEK_INDEX_ENTRY_LENGTH);
+
+			if(piece_bit_pos >> 3 > input_length)
+				return INPUT_ERROR;
+		} else {
+			piece_start = segment_start;
+			piece_bit_pos = stream_bit_pos[segment_start / segment_length];
+		}
+
+		piece_end = point + interval < segment_start + segment_length ? point + interval : segment_start + segment_length;
+		piece_end = piece_end < end ? piece_end : end;
+
+		if(piece_start == position) {
+			error = decode_symbols(decoding_table, table_bits, code_bits, input, input_length, piece_bit_pos, &output[position - offset], piece_end - position);
+		} else {
+			uint8_t * scratch;
+
+			if(!(scratch = malloc(piece_end - piece_start)))
+				return MEM_ERROR;
+
+			error = decode_symbols(decoding_table, table_bits, code_bits, input, input_length, piece_bit_pos, scratch, piece_end - piece_start);
+			memcpy(&output[position - offset], &scratch[position - piece_start], piece_end - position);
+			free(scratch);
+		}
+
+		if(error != EXIT_SUCCESS)
+			return error;
+
+		position = piece_end;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+static int read_context_tables(const uint8_t * input, huffman_coding_table_t code_tables[MAX_CONTEXT_TABLES][ENCODING_TABLE_LENGTH], uint8_t context_map[MAX_INPUT_SET_SIZE], uint8_t * table_count, size_t * bit_pos)
+{
+	size_t end = header_end(input);
+	uint8_t index_bits = 0;
+
+	*bit_pos = header_base_size(input) << 3;
+
+	if(end - *bit_pos < CONTEXT_COUNT_BITS + 1)
+		return INPUT_ERROR;
+
+	*table_count = read_k_bits(input, bit_pos, CONTEXT_COUNT_BITS) + 1;
+
+	while((1U << index_bits) < *table_count)
+		index_bits++;
+
+	if(read_k_bits(input, bit_pos, 1) == CONTEXT_MAP_FLAT) {
+		if(end - *bit_pos < MAX_INPUT_SET_SIZE * index_bits)
+			return INPUT_ERROR;
+
+		for(size_t c = 0; c < MAX_INPUT_SET_SIZE; c++) {
+			if((context_map[c] = read_k_bits(input, bit_pos, index_bits)) >= *table_count)
+				return INPUT_ERROR;
+		}
+	} else {
+		for(size_t c = 0; c < MAX_INPUT_SET_SIZE;) {
+			if(end - *bit_pos < (size_t)index_bits + CONTEXT_RUN_BITS)
+				return INPUT_ERROR;
+
+			uint8_t table = read_k_bits(input, bit_pos, index_bits);
+			size_t run = read_k_bits(input, bit_pos, CONTEXT_RUN_BITS) + 1;
+
+			if(table >= *table_count || run > MAX_INPUT_SET_SIZE - c)
+				return INPUT_ERROR;
+
+			memset(&context_map[c], table, run);
+			c += run;
+		}
+	}
+
+	for(uint8_t table = 0; table < *table_count; table++) {
+		if(end - *bit_pos < CONTEXT_TABLE_LENGTH_BITS)
+			return INPUT_ERROR;
+
+		size_t table_bit_length = read_k_bits(input, bit_pos, CONTEXT_TABLE_LENGTH_BITS);
+
+		if(table_bit_length > end - *bit_pos || read_code_lengths(input, *bit_pos, *bit_pos + table_bit_length, code_tables[table]) != EXIT_SUCCESS)
+			return INPUT_ERROR;
+
+		*bit_pos += table_bit_length;
+	}
+
+	if(*bit_pos != end) /* The payload starts right after the last table */
+		return INPUT_ERROR;
+
+	return EXIT_SUCCESS;
+}
+
+static int decode_context_symbols(const huffman_decoding_entry_t * context_tables[MAX_INPUT_SET_SIZE], const uint8_t * input, const size_t input_length, size_t bit_pos, uint8_t * output, const size_t decompressed_length)
+{
+	size_t byte_count = 0;
+	uint8_t previous = 0;
+	STATS_MARK(start);
+	STATS_COUNT(decode_input_bits, -(uint64_t)bit_pos);
+
+	/* The same rounds as decode_symbols(), except every lookup waits on the last symbol of the one before it to pick its table */
+
+	for(;;) {
+		size_t rounds = (decompressed_length - byte_count) / (LOOKUPS_PER_REFILL * SYMBOLS_PER_ENTRY);
+		size_t input_rounds = unchecked_rounds(input_length, bit_pos, ROUND_INPUT_BYTES);
+
+		if(input_rounds < rounds)
+			rounds = input_rounds;
+
+		if(!rounds)
+			break;
+
+		while(rounds--) {
+			uint64_t buffer = refill_bit_buffer(input, bit_pos);
+
+			for(size_t lookup = 0; lookup < LOOKUPS_PER_REFILL; lookup++) {
+				huffman_decoding_entry_t entry = lookup_symbols(context_tables[previous], CONTEXT_TABLE_BITS, LOOKUP_BITS, buffer);
+
+				output[byte_count] = entry.symbol[0];
+				output[byte_count + 1] = entry.symbol[1];
+				byte_count += entry.count;
+				previous = entry.count > 1 ? entry.symbol[1] : entry.symbol[0];
+				buffer >>= entry.length;
+				bit_pos += entry.length;
+			}
+		}
+	}
+
+	while(byte_count < decompressed_length) {
+		huffman_decoding_entry_t entry = lookup_symbols(context_tables[previous], CONTEXT_TABLE_BITS, LOOKUP_BITS, refill_bit_buffer_checked(input, input_length, bit_pos));
+
+		output[byte_count++] = previous = entry.symbol[0];
+
+		if(entry.count > 1) {
+			if(byte_count == decompressed_length)
+				break;
+
+			output[byte_count++] = previous = entry.symbol[1];
+		}
+
+		bit_pos += entry.length;
+	}
+
+	STATS_COUNT(decode_input_bits, bit_pos);
+	STATS_COUNT(decode_output_bytes, byte_count);
+	STATS_ELAPSED(decode_cycles, start);
+
+	return (bit_pos + 7) >> 3 > input_length ? INPUT_ERROR : EXIT_SUCCESS;
+}
+
+static int decode_context_block(const uint8_t * input, const size_t input_length, uint8_t * output, const size_t length)
+{
+	huffman_coding_table_t code_tables[MAX_CONTEXT_TABLES][ENCODING_TABLE_LENGTH] = {{{ .code = 0, .length = 0 }}};
+	const huffman_decoding_entry_t * context_tables[MAX_INPUT_SET_SIZE];
+	huffman_decoding_entry_t * decoding_tables;
+	size_t table_start[MAX_CONTEXT_TABLES];
+	uint8_t context_map[MAX_INPUT_SET_SIZE];
+	uint8_t table_count;
+	size_t table_length = 0, bit_pos;
+	int error;
+
+	if((error = read_context_tables(input, code_tables, context_map, &table_count, &bit_pos)) != EXIT_SUCCESS)
+		return error;
+
+	for(uint8_t table = 0; table < table_count; table++) {
+		table_start[table] = table_length;
+		table_length += count_decoding_entries(code_tables[table], CONTEXT_TABLE_BITS);
+	}
+
+	if(!(decoding_tables = malloc(table_length * sizeof(huffman_decoding_entry_t)))) /* create_decoding_table() writes every entry */
+		return MEM_ERROR;
+
+	/* A pair of symbols can only share an entry if the first one picks the same table again for the second */
+
+	for(uint8_t table = 0; table < table_count; table++) {
+		bool pair_after[MAX_INPUT_SET_SIZE];
+
+		for(size_t c = 0; c < MAX_INPUT_SET_SIZE; c++)
+			pair_after[c] = context_map[c] == table;
+
+		create_decoding_table(code_tables[table], &decoding_tables[table_start[table]], CONTEXT_TABLE_BITS, pair_after);
+	}
+
+	for(size_t c = 0; c < MAX_INPUT_SET_SIZE; c++)
+		context_tables[c] = &decoding_tables[table_start[context_map[c]]];
+
+	error = decode_context_symbols(context_tables, input, input_length, bit_pos, output, length);
+	free(decoding_tables);
+
+	return error;
+}
+
+static int decode_context_range(const uint8_t * input, const size_t input_length, const size_t offset, const size_t length, uint8_t * output)
+{
+	uint8_t * scratch;
+	int error;
+
+	if(!offset)
+		return decode_context_block(input, input_length, output, length);
+
+	if(!(scratch = malloc(offset + length))) /* Every byte depends on the one before it, so the whole prefix has to be decoded */
+		return MEM_ERROR;
+
+	if((error = decode_context_block(input, input_length, scratch, offset + length)) == EXIT_SUCCESS)
+		memcpy(output, &scratch[offset], length);
+
+	free(scratch);
+
+	return error;
+}
+
+static void build_dictionary(huffman_dictionary_t * dictionary)
+{
+	uint8_t code_bits;
+
+	dictionary->id = code_table_id(dictionary->encoding_table);
+	dictionary->table_bits = find_table_bits(dictionary->encoding_table, false, &code_bits);
+
+	create_decoding_table(dictionary->encoding_table, dictionary->decoding_table, dictionary->table_bits, NULL);
+}
+
+static int read_batch_length(const uint8_t * input, const size_t input_length, size_t * decompressed_length)
+{
+	int error;
+
+	/* The arena always carries on for at least PEEK_PADDING bytes after a message, which stands in for the padding it was stored without */
+
+	if((error = huffman_decompressed_length(input, input_length + PEEK_PADDING, decompressed_length)) != EXIT_SUCCESS)
+		return error;
+
+	if(input_length < header_base_size(input) || (block_mode(input) == RLE_BLOCK && input_length == header_base_size(input)))
+		return INPUT_ERROR;
+
+	if(block_mode(input) == RAW_BLOCK && *decompressed_length > input_length - header_base_size(input))
+		return INPUT_ERROR;
+
+	return EXIT_SUCCESS;
+}
+
+static int decode_batch_message(huffman_decoder_t * decoder, uint8_t code_lengths[ENCODING_TABLE_LENGTH], const uint8_t * input, const size_t input_length, uint8_t * output, const size_t decompressed_length)
+{
+	huffman_coding_table_t code_table[ENCODING_TABLE_LENGTH] = {{ .code = 0, .length = 0 }};
+	bool same_table = decoder->table_bits;
+	uint8_t longest = 0;
+	size_t bit_pos;
+	int error;
+
+	if(block_mode(input) == CONTEXT_BLOCK)
+		return decode_context_block(input, input_length, output, decompressed_length);
+
+	if(block_mode(input) != HUFFMAN_BLOCK) {
+		decode_stored(input, 0, decompressed_length, output);
+
+		return EXIT_SUCCESS;
+	}
+
+	if((error = read_code_table(input, code_table, &bit_pos)) != EXIT_SUCCESS)
+		return error;
+
+	/* Canonical codes follow from their lengths, so equal lengths mean the table built for an earlier message still fits */
+
+	for(size_t i = 0; i < ENCODING_TABLE_LENGTH; i++) {
+		same_table &= code_lengths[i] == code_table[i].length;
+		code_lengths[i] = code_table[i].length;
+
+		if(code_table[i].length > longest)
+			longest = code_table[i].length;
+	}
+
+	/* A table with more entries than the message has bytes costs more to fill than pairing symbols saves, so small messages get one just big enough for their longest code */
+
+	uint8_t code_bits, table_bits = find_table_bits(code_table, false, &code_bits);
+
+	if(decompressed_length < (1U << table_bits) && longest) /* Corrupt input can have no codes at all, which the usual table still decodes safely */
+		table_bits = code_bits = longest;
+
+	if(!same_table || table_bits != decoder->table_bits) {
+		decoder->table_bits = table_bits;
+		decoder->code_bits = code_bits;
+		create_decoding_table(code_table, decoder->decoding_table, table_bits, NULL);
+	}
+
+	return decode_payload(decoder->decoding_table, decoder->table_bits, decoder->code_bits, input, input_length, bit_pos, output, decompressed_length, false);
+}
+
+/* Interface functions */
+
+size_t huffman_histogram(const uint8_t * input, const size_t length, size_t freq[MAX_INPUT_SET_SIZE])
+{
+	size_t encoded_bytes = 0;
+	size_t i = 0;
+
+	memset(freq, 0, MAX_INPUT_SET_SIZE * sizeof(size_t));
+
+	/* 
+	 *	Runs of the same byte make every increment wait on the store of the one before it. Spreading
+	 *	successive bytes over separate banks of counts keeps several increments in flight at once.
+	 *	Banks are 32 bits wide to halve their cache footprint, so they're summed into `freq` before
+	 *	any of them can overflow
+	 */
+
+	if(length >= HISTOGRAM_BANK_MIN_LENGTH) {
+		uint32_t banks[HISTOGRAM_BANKS][MAX_INPUT_SET_SIZE];
+
+		while(length - i >= 16) {
+			size_t chunk_end = length - i > HISTOGRAM_CHUNK_LENGTH ? i + HISTOGRAM_CHUNK_LENGTH : length;
+
+			memset(banks, 0, sizeof(banks));
+
+			for(; chunk_end - i >= 16; i += 16) {
+				uint64_t first;
+				uint64_t second;
+
+				memcpy(&first, &input[i], sizeof(first));
+				memcpy(&second, &input[i + 8], sizeof(second));
+
+				banks[0][(uint8_t)(first)]++;
+				banks[1][(uint8_t)(first >> 8)]++;
+				banks[2][(uint8_t)(first >> 16)]++;
+				banks[3][(uint8_t)(first >> 24)]++;
+				banks[0][(uint8_t)(first >> 32)]++;
+				banks[1][(uint8_t)(first >> 40)]++;
+				banks[2][(uint8_t)(first >> 48)]++;
+				banks[3][(uint8_t)(first >> 56)]++;
+				banks[0][(uint8_t)(second)]++;
+				banks[1][(uint8_t)(second >> 8)]++;
+				banks[2][(uint8_t)(second >> 16)]++;
+				banks[3][(uint8_t)(second >> 24)]++;
+				banks[0][(uint8_t)(second >> 32)]++;
+				banks[1][(uint8_t)(second >> 40)]++;
+				banks[2][(uint8_t)(second >> 48)]++;
+				banks[3][(uint8_t)(second >> 56)]++;
+			}
+
+			for(size_t symbol = 0; symbol < MAX_INPUT_SET_SIZE; symbol++) /* Straight line sums that the compiler turns into vector adds */
+				freq[symbol] += (size_t)banks[0][symbol] + banks[1][symbol] + banks[2][symbol] + banks[3][symbol];
+		}
+	}
+
+	for(; i < length; i++)
+		freq[input[i]]++;
+
+	for(size_t symbol = 0; symbol < MAX_INPUT_SET_SIZE; symbol++) {
+		if(freq[symbol])
+			encoded_bytes++;
+	}
+
+	return encoded_bytes;
+}
+
+int huffman_encode(const uint8_t * input, uint8_t ** output, const uint32_t decompressed_length)
+{
+	return huffman_encode_limited(input, output, decompressed_length, MAX_CODE_LENGTH);
+}
+
+int huffman_encode_limited(const uint8_t * input, uint8_t ** output, const uint32_t decompressed_length, const uint8_t max_code_length)
+{
+	huffman_options_t options = { .max_code_length = max_code_length, .stream_count = 1 };
+
+	return huffman_encode_with_options(input, output, decompressed_length, &options);
+}
+
+int huffman_encode_with_options(const uint8_t * input, uint8_t ** output, const uint32_t decompressed_length, const huffman_options_t * options)
+{
+	size_t compressed_length;
+	int error;
+
+	if((error = huffman_compress(input, decompressed_length, output, &compressed_length, options)) != EXIT_SUCCESS)
+		return error;
+
+	if(compressed_length > INT_MAX) { /* The size can't be returned alongside the error codes */
+		free(*output);
+		*output = NULL;
+
+		return LENGTH_ERROR;
+	}
+
+	return compressed_length;
+}
+
+int huffman_encode_to_existing_buffer(const uint8_t * input, uint8_t * output, const uint32_t decompressed_length, const uint32_t output_length)
+{
+	size_t compressed_length;
+	int error;
+
+	if((error = huffman_compress_to_existing_buffer(input, decompressed_length, output, output_length, &compressed_length, NULL)) != EXIT_SUCCESS)
+		return error;
+
+	if(compressed_length > INT_MAX)
+		return LENGTH_ERROR;
+
+	return compressed_length;
+}
+
+int huffman_compress(const uint8_t * input, const size_t input_length, uint8_t ** output, size_t * output_length, const huffman_options_t * options)
+{
+	const huffman_allocator_t * allocator = options ? options->allocator : NULL;
+	size_t stream_freq[HUFFMAN_MAX_STREAMS][MAX_INPUT_SET_SIZE];
+	block_plan_t plan;
+	int error;
+
+	/* Frequency analysis, each stream gets its own so its length is known before anything is written */
+
+	if((error = stream_histograms(input, input_length, options, stream_freq)) != EXIT_SUCCESS)
+		return error;
+
+	/* Work out the codes and the byte length of the output, or fall back to storing the input if coding wouldn't help */
+
+	if((error = plan_block(stream_freq, options && options->stream_count ? options->stream_count : 1, input_length, options, NULL, &plan)) != EXIT_SUCCESS || (error = plan_context_block(input, input_length, options, &plan)) != EXIT_SUCCESS)
+		return error;
+
+	if(!(*output = allocator ? allocator->alloc(allocator->context, plan.total_length) : malloc(plan.total_length))) {
+		free_plan(&plan);
+
+		return MEM_ERROR;
+	}
+
+	write_block(input, input_length, options, &plan, *output);
+	free_plan(&plan);
+
+	*output_length = plan.total_length;
+
+	return EXIT_SUCCESS;
+}
+
+int huffman_compress_to_existing_buffer(const uint8_t * input, const size_t input_length, uint8_t * output, const size_t output_capacity, size_t * output_length, const huffman_options_t * options)
+{
+	block_plan_t plan;
+
+	return compress_block(input, input_length, output, output_capacity, options, NULL, &plan, output_length);
+}
+
+size_t huffman_compress_bound(const size_t input_length)
+{
+	return HEADER_BASE_SIZE + ((uint64_t)input_length > UINT32_MAX ? LONG_LENGTH_EXTENSION : 0) + input_length; /* Anything Huffman coding can't shrink is stored raw */
+}
+
+int huffman_estimate_size(const uint8_t * input, const size_t input_length, const huffman_options_t * options, size_t * estimated_length)
+{
+	size_t stream_freq[HUFFMAN_MAX_STREAMS][MAX_INPUT_SET_SIZE];
+	block_plan_t plan;
+	int error;
+
+	if((error = stream_histograms(input, input_length, options, stream_freq)) != EXIT_SUCCESS)
+		return error;
+
+	if((error = plan_block(stream_freq, options && options->stream_count ? options->stream_count : 1, input_length, options, NULL, &plan)) != EXIT_SUCCESS || (error = plan_context_block(input, input_length, options, &plan)) != EXIT_SUCCESS)
+		return error;
+
+	free_plan(&plan);
+
+	*estimated_length = plan.total_length;
+
+	return EXIT_SUCCESS;
+}
+
+int huffman_estimate_size_from_histogram(const size_t freq[MAX_INPUT_SET_SIZE], const huffman_options_t * options, size_t * estimated_length)
+{
+	size_t stream_freq[1][MAX_INPUT_SET_SIZE];
+	size_t input_length = 0;
+	block_plan_t plan;
+	int error;
+
+	for(size_t i = 0; i < MAX_INPUT_SET_SIZE; i++)
+		input_length += stream_freq[0][i] = freq[i];
+
+	if((error = plan_block(stream_freq, 1, input_length, options, NULL, &plan)) != EXIT_SUCCESS)
+		return error;
+
+	*estimated_length = plan.total_length;
+
+	return EXIT_SUCCESS;
+}
+
+int huffman_decode(const uint8_t * input, uint8_t ** output)
+{
+	size_t decompressed_length;
+	int error;
+
+	if((error = huffman_decompress(input, SIZE_MAX, output, &decompressed_length)) != EXIT_SUCCESS)
+		return error;
+
+	if(decompressed_length > INT_MAX) {
+		free(*output);
+		*output = NULL;
+
+		return LENGTH_ERROR;
+	}
+
+	return decompressed_length;
+}
+
+int huffman_decode_to_existing_buffer(const uint8_t * input, uint8_t * output, const uint32_t output_length)
+{
+	size_t decompressed_length;
+	int error;
+
+	if(read_decompressed_length(input) > INT_MAX)
+		return LENGTH_ERROR;
+
+	if((error = huffman_decompress_to_existing_buffer(input, SIZE_MAX, output, output_length, &decompressed_length)) != EXIT_SUCCESS)
+		return error;
+
+	return decompressed_length;
+}
+
+int huffman_decompressed_length(const uint8_t * input, const size_t input_length, size_t * decompressed_length)
+{
+	if(input_length < HEADER_BASE_SIZE || input_length < header_base_size(input))
+		return INPUT_ERROR;
+
+	uint64_t length = read_decompressed_length(input);
+	size_t base_size = header_base_size(input);
+
+	if(length > SIZE_MAX)
+		return LENGTH_ERROR;
+
+	/* Check everything a decoder reads without looking at the input length again */
+
+	switch(block_mode(input)) {
+		case CONTEXT_BLOCK:
+			if(input[HEADER_FLAGS_OFFSET] & (STREAM_COUNT_MASK | SEEK_INDEX_FLAG | REPEAT_TABLE_FLAG)) /* Always a single stream with its own tables */
+				return INPUT_ERROR;
+
+			/* Fall through */
+
+		case HUFFMAN_BLOCK:
+			if(((header_end(input) + 7) >> 3) + PEEK_PADDING > input_length)
+				return INPUT_ERROR;
+
+			if(input_length <= SIZE_MAX >> 3 && length > (uint64_t)input_length << 3) /* Every byte takes at least one bit */
+				return INPUT_ERROR;
+
+			break;
+
+		case RAW_BLOCK:
+			if(input[HEADER_FLAGS_OFFSET] & REPEAT_TABLE_FLAG)
+				return INPUT_ERROR;
+
+			if(length > input_length - base_size)
+				return INPUT_ERROR;
+
+			break;
+
+		case RLE_BLOCK:
+			if(input_length == base_size || input[HEADER_FLAGS_OFFSET] & REPEAT_TABLE_FLAG)
+				return INPUT_ERROR;
+
+			break;
+
+		default:
+			return INPUT_ERROR;
+	}
+
+	*decompressed_length = length;
+
+	return EXIT_SUCCESS;
+}
+
+int huffman_decompress(const uint8_t * input, const size_t input_length, uint8_t ** output, size_t * output_length)
+{
+	size_t decompressed_length;
+	int error;
+
+	if((error = huffman_decompressed_length(input, input_length, &decompressed_length)) != EXIT_SUCCESS)
+		return error;
+
+	if(decompressed_length == SIZE_MAX || !(*output = calloc(decompressed_length + 1, sizeof(uint8_t))))
+		return MEM_ERROR;
+
+	if((error = huffman_decompress_to_existing_buffer(input, input_length, *output, decompressed_length, output_length)) != EXIT_SUCCESS) {
+		free(*output);
+		*output = NULL;
+	}
+
+	return error;
+}
+
+int huffman_decompress_to_existing_buffer(const uint8_t * input, const size_t input_length, uint8_t * output, const size_t output_capacity, size_t * output_length)
+{
+	huffman_coding_table_t code_table[ENCODING_TABLE_LENGTH] = {{ .code = 0, .length = 0 }};
+	huffman_decoding_entry_t decoding_table[DECODING_TABLE_LENGTH];
+	size_t decompressed_length;
+	int error;
+
+	/* Extract header information */
+
+	if((error = huffman_decompressed_length(input, input_length, &decompressed_length)) != EXIT_SUCCESS)
+		return error;
+
+	if(decompressed_length > output_capacity) /* As long as the output buffer is longer than or the same length as the decompressed string */
+		return LENGTH_ERROR;
+
+	*output_length = decompressed_length;
+
+	if(block_mode(input) == CONTEXT_BLOCK)
+		return decode_context_block(input, input_length, output, decompressed_length);
+
+	if(block_mode(input) != HUFFMAN_BLOCK) { /* Nothing to build a table for */
+		decode_stored(input, 0, decompressed_length, output);
+
+		return EXIT_SUCCESS;
+	}
+
+	size_t bit_pos;
+
+	if((error = read_code_table(input, code_table, &bit_pos)) != EXIT_SUCCESS)
+		return error;
+
+	/* Build decoding lookup table, only as big as the longest code needs */
+
+	uint8_t code_bits, table_bits = find_table_bits(code_table, false, &code_bits);
+
+	create_decoding_table(code_table, decoding_table, table_bits, NULL);
+
+	/* Decode input stream */
+
+	return decode_payload(decoding_table, table_bits, code_bits, input, input_length, bit_pos, output, decompressed_length, false);
+}
+
+int huffman_decode_range(const uint8_t * input, const size_t input_length, const size_t offset, const size_t length, uint8_t * output)
+{
+	huffman_coding_table_t code_table[ENCODING_TABLE_LENGTH] = {{ .code = 0, .length = 0 }};
+	huffman_decoding_entry_t decoding_table[DECODING_TABLE_LENGTH];
+	size_t decompressed_length, bit_pos;
+	int error;
+
+	if((error = huffman_decompressed_length(input, input_length, &decompressed_length)) != EXIT_SUCCESS)
+		return error;
+
+	if(offset > decompressed_length || length > decompressed_length - offset)
+		return LENGTH_ERROR;
+
+	if(block_mode(input) == CONTEXT_BLOCK)
+		return decode_context_range(input, input_length, offset, length, output);
+
+	if(block_mode(input) != HUFFMAN_BLOCK) {
+		decode_stored(input, offset, length, output);
+
+		return EXIT_SUCCESS;
+	}
+
+	if((error = read_code_table(input, code_table, &bit_pos)) != EXIT_SUCCESS)
+		return error;
+
+	uint8_t code_bits, table_bits = find_table_bits(code_table, false, &code_bits);
+
+	create_decoding_table(code_table, decoding_table, table_bits, NULL);
+
+	return decode_range(decoding_table, table_bits, code_bits, input, input_length, offset, length, output);
+}
+
+int huffman_decoder_create(huffman_decoder_t ** decoder, const uint8_t * input, const size_t input_length, const int flags)
+{
+	huffman_coding_table_t code_table[ENCODING_TABLE_LENGTH] = {{ .code = 0, .length = 0 }};
+	uint8_t table_bits, code_bits;
+	size_t decompressed_length, bit_pos;
+	int error;
+
+	if((error = huffman_decompressed_length(input, input_length, &decompressed_length)) != EXIT_SUCCESS)
+		return error;
+
+	if(block_mode(input) == HUFFMAN_BLOCK && (error = read_code_table(input, code_table, &bit_pos)) != EXIT_SUCCESS) /* Stored and context modelled blocks have no codes for the decoder to keep, it can still decode them */
+		return error;
+
+	table_bits = find_table_bits(code_table, flags & HUFFMAN_TWO_LEVEL_TABLE, &code_bits);
+
+	size_t table_length = count_decoding_entries(code_table, table_bits);
+
+	if(!(*decoder = malloc(sizeof(huffman_decoder_t) + table_length * sizeof(huffman_decoding_entry_t)))) /* create_decoding_table() writes every entry */
+		return MEM_ERROR;
+
+	(*decoder)->table_bits = table_bits;
+	(*decoder)->code_bits = code_bits;
+	(*decoder)->vector_decode = flags & HUFFMAN_VECTOR_DECODE;
+
+	create_decoding_table(code_table, (*decoder)->decoding_table, table_bits, NULL);
+
+	return EXIT_SUCCESS;
+}
+
+int huffman_decoder_decode(const huffman_decoder_t * decoder, const uint8_t * input, uint8_t * output, const uint32_t output_length)
+{
+	size_t decompressed_length;
+	int error;
+
+	if(read_decompressed_length(input) > INT_MAX)
+		return LENGTH_ERROR;
+
+	if((error = huffman_decoder_decompress(decoder, input, SIZE_MAX, output, output_length, &decompressed_length)) != EXIT_SUCCESS)
+		return error;
+
+	return decompressed_length;
+}
+
+int huffman_decoder_decompress(const huffman_decoder_t * decoder, const uint8_t * input, const size_t input_length, uint8_t * output, const size_t output_capacity, size_t * output_length)
+{
+	size_t decompressed_length;
+	int error;
+
+	/* Extract header information, the code table itself is skipped since the decoder already has it */
+
+	if((error = huffman_decompressed_length(input, input_length, &decompressed_length)) != EXIT_SUCCESS)
+		return error;
+
+	if(decompressed_length > output_capacity)
+		return LENGTH_ERROR;
+
+	*output_length = decompressed_length;
+
+	if(block_mode(input) == CONTEXT_BLOCK) /* Context modelled blocks carry their own tables, the decoder's aren't used */
+		return decode_context_block(input, input_length, output, decompressed_length);
+
+	if(block_mode(input) != HUFFMAN_BLOCK) {
+		decode_stored(input, 0, decompressed_length, output);
+
+		return EXIT_SUCCESS;
+	}
+
+	return decode_payload(decoder->decoding_table, decoder->table_bits, decoder->code_bits, input, input_length, header_end(input), output, decompressed_length, decoder->vector_decode);
+}
+
+int huffman_decoder_decode_range(const huffman_decoder_t * decoder, const uint8_t * input, const size_t input_length, const size_t offset, const size_t length, uint8_t * output)
+{
+	size_t decompressed_length;
+	int error;
+
+	if((error = huffman_decompressed_length(input, input_length, &decompressed_length)) != EXIT_SUCCESS)
+		return error;
+
+	if(offset > decompressed_length || length > decompressed_length - offset)
+		return LENGTH_ERROR;
+
+	if(block_mode(input) == CONTEXT_BLOCK)
+		return decode_context_range(input, input_length, offset, length, output);
+
+	if(block_mode(input) != HUFFMAN_BLOCK) {
+		decode_stored(input, offset, length, output);
+
+		return EXIT_SUCCESS;
+	}
+
+	return decode_range(decoder->decoding_table, decoder->table_bits, decoder->code_bits, input, input_length, offset, length, output);
+}
+
+void huffman_decoder_destroy(huffman_decoder_t * decoder)
+{
+	free(decoder);
+}
+
+int huffman_decoder_decompress_block(huffman_decoder_t ** decoder, const int flags, const uint8_t * input, const size_t input_length, uint8_t * output, const size_t output_capacity, size_t * output_length)
+{
+	huffman_decoder_t * next;
+	size_t decompressed_length;
+	int error;
+
+	if((error = huffman_decompressed_length(input, input_length, &decompressed_length)) != EXIT_SUCCESS)
+		return error;
+
+	if(block_mode(input) == HUFFMAN_BLOCK) {
+		if(!(input[HEADER_FLAGS_OFFSET] & REPEAT_TABLE_FLAG)) { /* A new table replaces the old one, blocks that repeat it skip building one at all */
+			if((error = huffman_decoder_create(&next, input, input_length, flags)) != EXIT_SUCCESS)
+				return error;
+
+			huffman_decoder_destroy(*decoder);
+			*decoder = next;
+		} else if(!*decoder) {
+			return INPUT_ERROR; /* Nothing to repeat */
+		}
+	}
+
+	return huffman_decoder_decompress(*decoder, input, input_length, output, output_capacity, output_length);
+}
+
+int huffman_encoder_create(huffman_encoder_t ** encoder)
+{
+	if(!(*encoder = calloc(1, sizeof(huffman_encoder_t))))
+		return MEM_ERROR;
+
+	return EXIT_SUCCESS;
+}
+
+int huffman_encoder_compress(huffman_encoder_t * encoder, const uint8_t * input, const size_t input_length, uint8_t * output, const size_t output_capacity, size_t * output_length, const huffman_options_t * options)
+{
+	block_plan_t plan;
+	int error;
+
+	if((error = compress_block(input, input_length, output, output_capacity, options, encoder->has_table ? encoder->encoding_table : NULL, &plan, output_length)) != EXIT_SUCCESS)
+		return error;
+
+	if(plan.mode == HUFFMAN_BLOCK && !(plan.flags & REPEAT_TABLE_FLAG)) { /* Stored blocks leave the table alone, so the decoder keeps the same one too */
+		memcpy(encoder->encoding_table, plan.encoding_table, sizeof(encoder->encoding_table));
+		encoder->has_table = true;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+void huffman_encoder_destroy(huffman_encoder_t * encoder)
+{
+	free(encoder);
+}
+
+int huffman_dictionary_train(huffman_dictionary_t ** dictionary, const uint8_t * samples, const size_t samples_length, const uint8_t max_code_length)
+{
+	size_t freq[MAX_INPUT_SET_SIZE];
+	int error;
+
+	huffman_histogram(samples, samples_length, freq);
+
+	for(size_t i = 0; i < MAX_INPUT_SET_SIZE; i++) /* Every byte needs a code since messages may contain bytes the samples don't */
+		freq[i]++;
+
+	if(!(*dictionary = calloc(1, sizeof(huffman_dictionary_t))))
+		return MEM_ERROR;
+
+	if((error = create_code_lengths(freq, (*dictionary)->encoding_table, ENCODING_TABLE_LENGTH, max_code_length ? max_code_length : MAX_CODE_LENGTH)) != VALID_TREE) {
+		free(*dictionary);
+		*dictionary = NULL;
+
+		return error;
+	}
+
+	create_canonical_codes((*dictionary)->encoding_table, ENCODING_TABLE_LENGTH);
+	build_dictionary(*dictionary);
+
+	return EXIT_SUCCESS;
+}
+
+int huffman_dictionary_save(const huffman_dictionary_t * dictionary, uint8_t ** output, size_t * output_length)
+{
+	int error;
+
+	if(!(*output = calloc(DICTIONARY_MAX_SIZE + PEEK_PADDING, sizeof(uint8_t))))
+		return MEM_ERROR;
+
+	if((error = write_dictionary(dictionary->encoding_table, dictionary->id, *output, output_length)) != EXIT_SUCCESS) {
+		free(*output);
+		*output = NULL;
+	}
+
+	return error;
+}
+
+int huffman_dictionary_load(huffman_dictionary_t ** dictionary, const uint8_t * input, const size_t input_length)
+{
+	uint8_t padded[DICTIONARY_MAX_SIZE + PEEK_PADDING] = { 0 };
+	uint32_t magic, id;
+	uint16_t header_bit_length;
+
+	if(input_length < DICTIONARY_HEADER_SIZE)
+		return INPUT_ERROR;
+
+	memcpy(&magic, input, sizeof(magic));
+	memcpy(&id, &input[4], sizeof(id));
+	memcpy(&header_bit_length, &input[8], sizeof(header_bit_length));
+
+	size_t length = DICTIONARY_HEADER_SIZE + ((header_bit_length + 7) >> 3);
+
+	if(magic != DICTIONARY_MAGIC || length > input_length || length > sizeof(padded) - PEEK_PADDING)
+		return INPUT_ERROR;
+
+	memcpy(padded, input, length);
+
+	if(!(*dictionary = calloc(1, sizeof(huffman_dictionary_t))))
+		return MEM_ERROR;
+
+	int error = read_code_lengths(padded, DICTIONARY_HEADER_SIZE << 3, (DICTIONARY_HEADER_SIZE << 3) + header_bit_length, (*dictionary)->encoding_table);
+
+	if(error == EXIT_SUCCESS)
+		build_dictionary(*dictionary);
+
+	if(error != EXIT_SUCCESS || (*dictionary)->id != id) { /* Either corrupt or not the table it claims to be */
+		free(*dictionary);
+		*dictionary = NULL;
+
+		return INPUT_ERROR;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+uint32_t huffman_dictionary_id(const huffman_dictionary_t * dictionary)
+{
+	return dictionary->id;
+}
+
+int huffman_dictionary_encode(const huffman_dictionary_t * dictionary, const uint8_t * input, const size_t input_length, uint8_t ** output, size_t * output_length)
+{
+	size_t freq[MAX_INPUT_SET_SIZE];
+	size_t bit_length = 0;
+
+	huffman_histogram(input, input_length, freq);
+
+	for(size_t i = 0; i < MAX_INPUT_SET_SIZE; i++)
+		bit_length += freq[i] * dictionary->encoding_table[i].length;
+
+	*output_length = (bit_length + 7) >> 3;
+
+	if(!(*output = calloc(*output_length + PEEK_PADDING, sizeof(uint8_t)))) /* The bit writer stores whole words, the padding isn't part of the message */
+		return MEM_ERROR;
+
+	encode_symbols(dictionary->encoding_table, input, input_length, *output, 0);
+
+	return EXIT_SUCCESS;
+}
+
+int huffman_dictionary_decode(const huffman_dictionary_t * dictionary, const uint8_t * input, const size_t input_length, uint8_t * output, const size_t decompressed_length)
+{
+	return decode_symbols(dictionary->decoding_table, dictionary->table_bits, dictionary->table_bits, input, input_length, 0, output, decompressed_length); /* Messages have no padding of their own, the checked tail reads up to their last byte */
+}
+
+void huffman_dictionary_destroy(huffman_dictionary_t * dictionary)
+{
+	free(dictionary);
+}
+
+int huffman_encode_batch(const huffman_span_t * inputs, const size_t count, uint8_t ** output, size_t offsets[], const huffman_options_t * options, const int flags)
+{
+	const huffman_allocator_t * allocator = options ? options->allocator : NULL;
+	huffman_coding_table_t encoding_table[ENCODING_TABLE_LENGTH] = {{ .code = 0, .length = 0 }};
+	uint8_t table[DICTIONARY_MAX_SIZE + PEEK_PADDING] = { 0 };
+	size_t freq[MAX_INPUT_SET_SIZE], total_freq[MAX_INPUT_SET_SIZE] = { 0 };
+	size_t table_length = 0, arena_length = PEEK_PADDING, position = 0, total_bytes = 0;
+	int error;
+
+	if(!(flags & HUFFMAN_BATCH_SHARED_TABLE)) {
+		size_t stream_freq[HUFFMAN_MAX_STREAMS][MAX_INPUT_SET_SIZE]; /* Scratch shared by every message */
+		block_plan_t plan;
+
+		/* Every message is a block of its own, encoded straight into an arena big enough for all of them at their worst */
+
+		for(size_t i = 0; i < count; i++) {
+			if(arena_length > SIZE_MAX - huffman_compress_bound(inputs[i].length))
+				return LENGTH_ERROR;
+
+			arena_length += huffman_compress_bound(inputs[i].length);
+		}
+
+		if(!(*output = allocator ? allocator->alloc(allocator->context, arena_length) : malloc(arena_length)))
+			return MEM_ERROR;
+
+		for(size_t i = 0; i < count; i++) {
+			offsets[i] = position;
+
+			if(inputs[i].length) { /* Empty messages take no space at all */
+				if((error = stream_histograms(inputs[i].data, inputs[i].length, options, stream_freq)) != EXIT_SUCCESS || (error = plan_block(stream_freq, options && options->stream_count ? options->stream_count : 1, inputs[i].length, options, NULL, &plan)) != EXIT_SUCCESS || (error = plan_context_block(inputs[i].data, inputs[i].length, options, &plan)) != EXIT_SUCCESS) {
+					if(allocator)
+						allocator->free(allocator->context, *output);
+					else
+						free(*output);
+
+					*output = NULL;
+
+					return error;
+				}
+
+				write_block(inputs[i].data, inputs[i].length, options, &plan, &(*output)[position]);
+				free_plan(&plan);
+
+				position += plan.total_length;
+
+				if(plan.mode == HUFFMAN_BLOCK || plan.mode == CONTEXT_BLOCK) /* The next message is written over the padding, only the end of the arena needs any */
+					position -= PEEK_PADDING;
+			}
+
+			offsets[i + 1] = position;
+		}
+
+		if(!count)
+			offsets[0] = 0;
+
+		memset(&(*output)[position], 0, PEEK_PADDING); /* The bit writer may have stored whole words past the last message */
+
+		return EXIT_SUCCESS;
+	}
+
+	/* One code table for the whole batch, built from the combined histogram of every message */
+
+	for(size_t i = 0; i < count; i++) {
+		if(inputs[i].length > UINT32_MAX)
+			return LENGTH_ERROR;
+
+		huffman_histogram(inputs[i].data, inputs[i].length, freq);
+		total_bytes += inputs[i].length;
+
+		for(size_t byte = 0; byte < MAX_INPUT_SET_SIZE; byte++)
+			total_freq[byte] += freq[byte];
+	}
+
+	if(!total_bytes) /* Every message is empty, but the table still needs a code */
+		total_freq[0] = 1;
+
+	if((error = create_code_lengths(total_freq, encoding_table, ENCODING_TABLE_LENGTH, options && options->max_code_length ? options->max_code_length : MAX_CODE_LENGTH)) != VALID_TREE)
+		return error;
+
+	create_canonical_codes(encoding_table, ENCODING_TABLE_LENGTH);
+
+	if((error = write_dictionary(encoding_table, code_table_id(encoding_table), table, &table_length)) != EXIT_SUCCESS)
+		return error;
+
+	/* Work out where every message goes, then encode them one after the other behind the table */
+
+	offsets[0] = arena_length = table_length;
+
+	for(size_t i = 0; i < count; i++) {
+		size_t bit_length = 0;
+
+		for(size_t byte = 0; byte < inputs[i].length; byte++)
+			bit_length += encoding_table[inputs[i].data[byte]].length;
+
+		arena_length += BATCH_LENGTH_SIZE + ((bit_length + 7) >> 3);
+		offsets[i + 1] = arena_length;
+	}
+
+	if(!(*output = allocator ? allocator->alloc(allocator->context, arena_length + PEEK_PADDING) : malloc(arena_length + PEEK_PADDING)))
+		return MEM_ERROR;
+
+	memcpy(*output, table, table_length);
+	memset(&(*output)[arena_length], 0, PEEK_PADDING);
+
+	for(size_t i = 0; i < count; i++) {
+		position = offsets[i];
+		store_length(&(*output)[position], inputs[i].length, BATCH_LENGTH_SIZE);
+
+		if(inputs[i].length) /* An empty message is only its length, there's no first byte for the bit writer to start on */
+			encode_symbols(encoding_table, inputs[i].data, inputs[i].length, *output, (position + BATCH_LENGTH_SIZE) << 3);
+	}
+
+	return EXIT_SUCCESS;
+}
+
+int huffman_decode_batch(const uint8_t * input, const size_t offsets[], const size_t count, uint8_t ** output, size_t output_offsets[])
+{
+	huffman_dictionary_t * dictionary = NULL;
+	huffman_decoder_t * decoder = NULL;
+	uint8_t code_lengths[ENCODING_TABLE_LENGTH] = { 0 };
+	size_t decompressed_length, total_length = 0;
+	int error = EXIT_SUCCESS;
+
+	/* Find every message's decompressed length first so the output is allocated once */
+
+	if(offsets[0] && (error = huffman_dictionary_load(&dictionary, input, offsets[0])) != EXIT_SUCCESS)
+		return error;
+
+	output_offsets[0] = 0;
+
+	for(size_t i = 0; i < count && !error; i++) {
+		size_t message_length = offsets[i + 1] - offsets[i];
+
+		if(offsets[i + 1] < offsets[i]) {
+			error = INPUT_ERROR;
+		} else if(dictionary) {
+			if(message_length < BATCH_LENGTH_SIZE)
+				error = INPUT_ERROR;
+			else if((decompressed_length = load_length(&input[offsets[i]], BATCH_LENGTH_SIZE)) > (message_length - BATCH_LENGTH_SIZE) << 3) /* Every byte takes at least one bit */
+				error = INPUT_ERROR;
+		} else if(!message_length) {
+			decompressed_length = 0;
+		} else {
+			error = read_batch_length(&input[offsets[i]], message_length, &decompressed_length);
+		}
+
+		if(!error && decompressed_length > SIZE_MAX - 1 - total_length)
+			error = LENGTH_ERROR;
+
+		if(!error)
+			output_offsets[i + 1] = total_length += decompressed_length;
+	}
+
+	/* One decoder for every message that has its own table, big enough for the largest single level table */
+
+	if(!error && !dictionary && !(decoder = malloc(sizeof(huffman_decoder_t) + DECODING_TABLE_LENGTH * sizeof(huffman_decoding_entry_t))))
+		error = MEM_ERROR;
+
+	if(decoder) {
+		decoder->table_bits = 0; /* No table built yet */
+		decoder->vector_decode = false;
+	}
+
+	if(!error && !(*output = malloc(total_length + 1)))
+		error = MEM_ERROR;
+
+	/* Then decode them all, with either the shared table or each message's own header */
+
+	for(size_t i = 0; i < count && !error; i++) {
+		const uint8_t * message = &input[offsets[i]];
+		size_t message_length = offsets[i + 1] - offsets[i];
+
+		decompressed_length = output_offsets[i + 1] - output_offsets[i];
+
+		if(dictionary)
+			error = decode_symbols(dictionary->decoding_table, dictionary->table_bits, dictionary->table_bits, &message[BATCH_LENGTH_SIZE], message_length - BATCH_LENGTH_SIZE, 0, &(*output)[output_offsets[i]], decompressed_length);
+		else if(message_length)
+			error = decode_batch_message(decoder, code_lengths, message, message_length, &(*output)[output_offsets[i]], decompressed_length);
+
+		if(error) {
+			free(*output);
+			*output = NULL;
+		}
+	}
+
+	huffman_dictionary_destroy(dictionary);
+	huffman_decoder_destroy(decoder);
+
+	return error;
+}
+
+#ifdef HUFFMAN_STATS
+
+void huffman_stats_read(huffman_stats_t * stats)
+{
+	*stats = thread_stats;
+}
+
+void huffman_stats_reset(void)
+{
+	memset(&thread_stats, 0, sizeof(thread_stats));
+}
+
+#endif
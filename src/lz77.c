@@ -0,0 +1,622 @@
+/*
+ *	Filename:	lz77.c
+ *	Author:	 	Jess Ferguson
+ *	Date:		14/10/26
+ *	Licence:	GNU GPL V3
+ *
+ *	Remove repeated strings with an LZ77 match finder and Huffman code what's left, much like DEFLATE
+ *
+ *	Internal Functions:
+ *		- hash_position()		- Hash the four bytes starting at a position of the input
+ *		- insert_positions()	- Add every position not yet in the hash chains up to a given position
+ *		- match_length()		- Count the bytes two strings have in common
+ *		- find_match()			- Walk the hash chain of a position for the longest match inside the window
+ *		- value_code()			- Split a length or distance into a code and its extra bits
+ *		- write_extra_bits()	- Append extra bits to the extra bits section, growing it as needed
+ *		- add_sequence()		- Record a run of literals and the match after it
+ *		- parse_sequences()		- Split the whole input into sequences and the literals after the last one
+ *		- compress_section()	- Huffman code one section, an empty section stays empty
+ *		- read_extra_bits()		- Read extra bits, checking they lie inside the extra bits section
+ *		- read_value()			- Read the value of a code and its extra bits
+ *		- decompress_section()	- Decode one section, checking it holds the expected number of bytes
+ *		- replay_sequences()	- Rebuild the input from the literals and sequences, checking every copy stays inside the output
+ *
+ *	Data structures:
+ *
+ *		Match finder:
+ *			- head[hash] is the latest position whose first four bytes have that hash, chain[position % chain size] the position before it with the same hash
+ *			- Positions are 32 bits, inputs over 2 GB are matched in 2 GB segments that start over with empty chains
+ *			- Only chain_length candidates are compared for each position, so repetitive input can't make matching quadratic
+ *			- One step lazy matching, a match is put off for a literal whenever the next position starts a longer one, unless it's already NICE_MATCH bytes, the longer match is kept for the next position rather than searched for again
+ *
+ *		Sequences:
+ *			- A run of literals followed by a match of four to MAX_MATCH bytes, the literals after the last match need no sequence of their own
+ *			- The decompressed length can't be more than the literals and MAX_MATCH bytes for every sequence, so the decoder checks it before allocating the output
+ *			- Literals, literal lengths, match lengths and distances each go to a section of their own so each gets its own Huffman table
+ *
+ *	Encoded data format:
+ *
+ *		- Header
+ *			- Magic number, "HUFz" (1x uint32_t)
+ *			- Decompressed length (1x uint64_t)
+ *			- Number of sequences (1x uint64_t)
+ *			- Byte length of each section (5x uint64_t)
+ *		- Sections, each exactly as produced by huffman_compress(), or nothing at all if it has no bytes
+ *			- Literals, every byte not covered by a match in order
+ *			- Literal length codes, one per sequence
+ *			- Match length codes, one per sequence, of the match length minus four, matches are 4 to 65536 bytes long
+ *			- Distance codes, one per sequence, of the distance minus one
+ *		- Extra bits section, stored as it is, lowest bit first: the literal length, match length and distance extra bits of each sequence in turn
+ *		- Codes, like DEFLATE's length and distance codes
+ *			- 0-15: The value itself, no extra bits
+ *			- 16 and up: A value whose highest set bit is bit b is code 16 + 2 * (b - 4) plus the bit below it, the b - 1 bits under that are extra bits
+ *
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "huffman.h"
+
+#define LZ_MAGIC 0x7a465548 /* "HUFz" when stored as a little endian uint32_t */
+#define LZ_SECTION_COUNT 5
+#define LZ_HEADER_LENGTH (20 + LZ_SECTION_COUNT * 8)
+
+#define LITERAL_SECTION 0
+#define LITERAL_LENGTH_SECTION 1
+#define MATCH_LENGTH_SECTION 2
+#define DISTANCE_SECTION 3
+#define EXTRA_BITS_SECTION 4
+
+#define MIN_MATCH 4 /* Shortest match worth a sequence, and the number of bytes hashed */
+#define MAX_MATCH (1 << 16) /* Longest match one sequence can copy, so a header can't claim more output than its sequences could make */
+#define NICE_MATCH 128 /* A match this long is taken as it is, without looking further down the chain or a byte ahead */
+#define MIN_HASH_BITS 10
+#define MAX_HASH_BITS 20
+#define NO_POSITION UINT32_MAX
+#define SEGMENT_LENGTH ((size_t)1 << 31) /* Positions are stored in 32 bits, so the match finder starts over this often */
+#define DEFAULT_WINDOW (1 << 20)
+#define MIN_WINDOW (1 << 8)
+#define DEFAULT_CHAIN_LENGTH 32
+
+#define DIRECT_CODES 16 /* Values below this are their own code */
+#define MAX_VALUE_CODE (DIRECT_CODES + 2 * (63 - 4) + 1)
+
+/* Match finder state */
+
+typedef struct match_finder_t {
+	const uint8_t * input; /* Start of the current segment */
+	size_t input_length; /* Length of the current segment */
+	size_t window;
+	size_t chain_mask;
+	uint8_t hash_bits;
+	uint16_t chain_length;
+	size_t inserted; /* Every position before this one is in the hash chains */
+	uint32_t * head;
+	uint32_t * chain;
+} match_finder_t;
+
+typedef struct lz_match_t {
+	size_t length;
+	size_t distance;
+} lz_match_t;
+
+/* Sections being built while compressing */
+
+typedef struct sequence_writer_t {
+	uint8_t * literals;
+	size_t literal_count;
+	uint8_t * codes[3]; /* Literal length, match length and distance codes */
+	size_t sequence_count;
+	uint8_t * extra;
+	size_t extra_capacity;
+	size_t extra_bit_pos;
+} sequence_writer_t;
+
+/* Extra bits being read while decompressing */
+
+typedef struct extra_reader_t {
+	const uint8_t * buffer;
+	size_t length;
+	size_t bit_pos;
+} extra_reader_t;
+
+/* Internal functions */
+
+static inline size_t hash_position(const uint8_t * input, const uint8_t hash_bits)
+{
+	uint32_t bytes;
+
+	memcpy(&bytes, input, sizeof(bytes));
+
+	return (bytes * 2654435761U) >> (32 - hash_bits); /* Multiplicative hashing, the top bits are the best mixed */
+}
+
+static void insert_positions(match_finder_t * finder, const size_t position)
+{
+	for(; finder->inserted < position && finder->inserted + MIN_MATCH <= finder->input_length; finder->inserted++) {
+		size_t hash = hash_position(&finder->input[finder->inserted], finder->hash_bits);
+
+		finder->chain[finder->inserted & finder->chain_mask] = finder->head[hash];
+		finder->head[hash] = finder->inserted;
+	}
+
+	if(finder->inserted < position) /* Too close to the end to hash, nothing can match from there anyway */
+		finder->inserted = position;
+}
+
+static inline size_t match_length(const uint8_t * first, const uint8_t * second, const size_t limit)
+{
+	size_t length = 0;
+
+	while(limit - length >= sizeof(uint64_t)) { /* Eight bytes at a time until they differ */
+		uint64_t first_word, second_word;
+
+		memcpy(&first_word, &first[length], sizeof(first_word));
+		memcpy(&second_word, &second[length], sizeof(second_word));
+
+		if(first_word != second_word)
+			break;
+
+		length += sizeof(uint64_t);
+	}
+
+	while(length < limit && first[length] == second[length])
+		length++;
+
+	return length;
+}
+
+static lz_match_t find_match(match_finder_t * finder, const size_t position)
+{
+	lz_match_t best = { .length = 0, .distance = 0 };
+	size_t limit = finder->input_length - position < MAX_MATCH ? finder->input_length - position : MAX_MATCH;
+	uint16_t attempts = finder->chain_length;
+
+	if(limit < MIN_MATCH)
+		return best;
+
+	insert_positions(finder, position);
+
+	for(size_t candidate = finder->head[hash_position(&finder->input[position], finder->hash_bits)]; candidate != NO_POSITION && position - candidate <= finder->window && attempts--;) {
+		if(finder->input[candidate + best.length] == finder->input[position + best.length]) { /* Only a match that gets this byte right can be longer than the best so far */
+			size_t length = match_length(&finder->input[candidate], &finder->input[position], limit);
+
+			if(length > best.length) {
+				best = (lz_match_t){ .length = length, .distance = position - candidate };
+
+				if(length == limit || length >= NICE_MATCH)
+					break;
+			}
+		}
+
+		size_t next = finder->chain[candidate & finder->chain_mask];
+
+		if(next == NO_POSITION || next >= candidate) /* The slot has been reused by a newer position, the rest of the chain is gone */
+			break;
+
+		candidate = next;
+	}
+
+	if(best.length < MIN_MATCH)
+		best.length = 0;
+
+	return best;
+}
+
+static inline uint8_t value_code(const uint64_t value, uint8_t * extra_bits, uint64_t * extra)
+{
+	if(value < DIRECT_CODES) {
+		*extra_bits = 0;
+		*extra = 0;
+
+		return value;
+	}
+
+	uint8_t top = 63 - __builtin_clzll(value);
+
+	*extra_bits = top - 1;
+	*extra = value & ((1ULL << *extra_bits) - 1);
+
+	return DIRECT_CODES + 2 * (top - 4) + ((value >> (top - 1)) & 1);
+}
+
+static int write_extra_bits(sequence_writer_t * writer, uint64_t value, uint8_t bits)
+{
+	if(writer->extra_bit_pos + bits > writer->extra_capacity << 3) {
+		size_t capacity = writer->extra_capacity * 2 + sizeof(uint64_t);
+		uint8_t * extra;
+
+		if(!(extra = realloc(writer->extra, capacity)))
+			return MEM_ERROR;
+
+		memset(&extra[writer->extra_capacity], 0, capacity - writer->extra_capacity);
+		writer->extra = extra;
+		writer->extra_capacity = capacity;
+	}
+
+	while(bits) {
+		uint8_t offset = writer->extra_bit_pos & 7;
+		uint8_t take = 8 - offset < bits ? 8 - offset : bits;
+
+		writer->extra[writer->extra_bit_pos >> 3] |= (value & ((1U << take) - 1)) << offset;
+		writer->extra_bit_pos += take;
+		value >>= take;
+		bits -= take;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+static int add_sequence(sequence_writer_t * writer, const uint8_t * literals, const size_t literal_length, const lz_match_t match)
+{
+	uint64_t values[3] = { literal_length, match.length - MIN_MATCH, match.distance - 1 };
+	int error;
+
+	memcpy(&writer->literals[writer->literal_count], literals, literal_length);
+	writer->literal_count += literal_length;
+
+	for(size_t i = 0; i < 3; i++) {
+		uint8_t extra_bits;
+		uint64_t extra;
+
+		writer->codes[i][writer->sequence_count] = value_code(values[i], &extra_bits, &extra);
+
+		if((error = write_extra_bits(writer, extra, extra_bits)) != EXIT_SUCCESS)
+			return error;
+	}
+
+	writer->sequence_count++;
+
+	return EXIT_SUCCESS;
+}
+
+static int parse_sequences(match_finder_t * finder, sequence_writer_t * writer, const uint8_t * input, const size_t input_length)
+{
+	size_t literal_start = 0;
+	int error;
+
+	for(size_t segment = 0; segment < input_length; segment += SEGMENT_LENGTH) {
+		size_t position = 0;
+		lz_match_t next = { .length = 0, .distance = 0 };
+		bool have_next = false;
+
+		finder->input = &input[segment];
+		finder->input_length = input_length - segment < SEGMENT_LENGTH ? input_length - segment : SEGMENT_LENGTH;
+		finder->inserted = 0;
+
+		for(size_t i = 0; i < (1U << finder->hash_bits); i++)
+			finder->head[i] = NO_POSITION;
+
+		/* Take the longest match at each position, unless the next position starts a longer one, which is then already found for the next step */
+
+		while(position < finder->input_length) {
+			lz_match_t match = have_next ? next : find_match(finder, position);
+
+			have_next = false;
+
+			if(!match.length) {
+				position++;
+				continue;
+			}
+
+			if(match.length < NICE_MATCH && (next = find_match(finder, position + 1)).length > match.length) {
+				have_next = true;
+				position++;
+				continue;
+			}
+
+			if((error = add_sequence(writer, &input[literal_start], segment + position - literal_start, match)) != EXIT_SUCCESS)
+				return error;
+
+			position += match.length;
+			literal_start = segment + position;
+		}
+	}
+
+	memcpy(&writer->literals[writer->literal_count], &input[literal_start], input_length - literal_start);
+	writer->literal_count += input_length - literal_start;
+
+	return EXIT_SUCCESS;
+}
+
+static int compress_section(const uint8_t * input, const size_t input_length, const huffman_options_t * options, uint8_t ** output, size_t * output_length)
+{
+	*output = NULL;
+	*output_length = 0;
+
+	if(!input_length)
+		return EXIT_SUCCESS;
+
+	return huffman_compress(input, input_length, output, output_length, options);
+}
+
+static inline int read_extra_bits(extra_reader_t * reader, uint8_t bits, uint64_t * value)
+{
+	if(bits > (reader->length << 3) - reader->bit_pos)
+		return INPUT_ERROR;
+
+	*value = 0;
+
+	for(uint8_t shift = 0; bits;) {
+		uint8_t offset = reader->bit_pos & 7;
+		uint8_t take = 8 - offset < bits ? 8 - offset : bits;
+
+		*value |= (uint64_t)((reader->buffer[reader->bit_pos >> 3] >> offset) & ((1U << take) - 1)) << shift;
+		reader->bit_pos += take;
+		shift += take;
+		bits -= take;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+static inline int read_value(extra_reader_t * reader, const uint8_t code, uint64_t * value)
+{
+	uint64_t extra;
+
+	if(code < DIRECT_CODES) {
+		*value = code;
+
+		return EXIT_SUCCESS;
+	}
+
+	if(code > MAX_VALUE_CODE)
+		return INPUT_ERROR;
+
+	uint8_t top = (code - DIRECT_CODES) / 2 + 4;
+
+	if(read_extra_bits(reader, top - 1, &extra) != EXIT_SUCCESS)
+		return INPUT_ERROR;
+
+	*value = (1ULL << top) | ((uint64_t)((code - DIRECT_CODES) & 1) << (top - 1)) | extra;
+
+	return EXIT_SUCCESS;
+}
+
+static int decompress_section(const uint8_t * input, const size_t input_length, const size_t expected_length, uint8_t ** output)
+{
+	size_t decompressed_length;
+	int error;
+
+	*output = NULL;
+
+	if(!input_length)
+		return expected_length ? INPUT_ERROR : EXIT_SUCCESS;
+
+	if((error = huffman_decompressed_length(input, input_length, &decompressed_length)) != EXIT_SUCCESS || decompressed_length != expected_length) /* Before anything is allocated for it */
+		return error ? error : INPUT_ERROR;
+
+	if((error = huffman_decompress(input, input_length, output, &decompressed_length)) != EXIT_SUCCESS)
+		return error;
+
+	if(decompressed_length != expected_length) {
+		free(*output);
+		*output = NULL;
+
+		return INPUT_ERROR;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+static int replay_sequences(extra_reader_t * reader, const uint8_t * literals, const size_t literal_count, const uint8_t * codes[3], const size_t sequence_count, uint8_t * output, const size_t decompressed_length)
+{
+	size_t position = 0, literal_position = 0;
+
+	for(size_t sequence = 0; sequence < sequence_count; sequence++) {
+		uint64_t literal_length, length, distance;
+
+		if(read_value(reader, codes[0][sequence], &literal_length) || read_value(reader, codes[1][sequence], &length) || read_value(reader, codes[2][sequence], &distance))
+			return INPUT_ERROR;
+
+		if(literal_length > literal_count - literal_position || literal_length > decompressed_length - position)
+			return INPUT_ERROR;
+
+		memcpy(&output[position], &literals[literal_position], literal_length);
+		position += literal_length;
+		literal_position += literal_length;
+
+		if(distance >= position || decompressed_length - position < MIN_MATCH || length > decompressed_length - position - MIN_MATCH || length > MAX_MATCH - MIN_MATCH) /* Both are stored minus their smallest value */
+			return INPUT_ERROR;
+
+		length += MIN_MATCH;
+		distance++;
+
+		if(distance >= length) {
+			memcpy(&output[position], &output[position - distance], length);
+		} else {
+			for(size_t i = 0; i < length; i++) /* The match overlaps itself, later bytes copy ones written by this same match */
+				output[position + i] = output[position + i - distance];
+		}
+
+		position += length;
+	}
+
+	if(literal_count - literal_position != decompressed_length - position) /* The literals after the last match have to fill the rest exactly */
+		return INPUT_ERROR;
+
+	memcpy(&output[position], &literals[literal_position], literal_count - literal_position);
+
+	return EXIT_SUCCESS;
+}
+
+/* Interface functions */
+
+int huffman_lz_compress(const uint8_t * input, const size_t input_length, uint8_t ** output, size_t * output_length, const huffman_options_t * options)
+{
+	const huffman_allocator_t * allocator = options ? options->allocator : NULL;
+	huffman_options_t section_options = { 0 };
+	match_finder_t finder = { .window = DEFAULT_WINDOW, .hash_bits = MIN_HASH_BITS, .chain_length = DEFAULT_CHAIN_LENGTH };
+	sequence_writer_t writer = { 0 };
+	uint8_t * sections[LZ_SECTION_COUNT] = { NULL };
+	size_t section_lengths[LZ_SECTION_COUNT] = { 0 };
+	size_t chain_size = 1;
+	int error = EXIT_SUCCESS;
+
+	if(!input_length)
+		return INPUT_ERROR;
+
+	if(options) { /* Every section is coded with the caller's options, only the joined output comes from their allocator */
+		section_options = *options;
+		section_options.allocator = NULL;
+		section_options.index_interval = 0;
+
+		if(options->lz_window)
+			finder.window = options->lz_window;
+
+		if(options->lz_chain_length)
+			finder.chain_length = options->lz_chain_length;
+	}
+
+	if(finder.window < MIN_WINDOW || finder.window > HUFFMAN_LZ_MAX_WINDOW || (finder.window & (finder.window - 1)))
+		return INPUT_ERROR;
+
+	while(chain_size < finder.window && chain_size < input_length) /* No bigger than the input, positions can't collide in a chain that covers all of it */
+		chain_size <<= 1;
+
+	while(finder.hash_bits < MAX_HASH_BITS && (1U << finder.hash_bits) < chain_size) /* About one head per position in the window keeps the chains short */
+		finder.hash_bits++;
+
+	finder.chain_mask = chain_size - 1;
+
+	size_t max_sequences = input_length / MIN_MATCH + 1; /* Every sequence covers at least MIN_MATCH bytes */
+
+	finder.head = malloc((1U << finder.hash_bits) * sizeof(uint32_t));
+	finder.chain = malloc(chain_size * sizeof(uint32_t));
+	writer.literals = malloc(input_length);
+
+	for(size_t i = 0; i < 3; i++)
+		writer.codes[i] = malloc(max_sequences);
+
+	if(!finder.head || !finder.chain || !writer.literals || !writer.codes[0] || !writer.codes[1] || !writer.codes[2])
+		error = MEM_ERROR;
+
+	if(!error)
+		error = parse_sequences(&finder, &writer, input, input_length);
+
+	/* Huffman code every section with a table of its own, the extra bits are stored as they are */
+
+	if(!error)
+		error = compress_section(writer.literals, writer.literal_count, &section_options, &sections[LITERAL_SECTION], &section_lengths[LITERAL_SECTION]);
+
+	for(size_t i = 0; i < 3 && !error; i++)
+		error = compress_section(writer.codes[i], writer.sequence_count, &section_options, &sections[LITERAL_LENGTH_SECTION + i], &section_lengths[LITERAL_LENGTH_SECTION + i]);
+
+	sections[EXTRA_BITS_SECTION] = writer.extra;
+	section_lengths[EXTRA_BITS_SECTION] = (writer.extra_bit_pos + 7) >> 3;
+
+	*output_length = LZ_HEADER_LENGTH;
+
+	for(size_t i = 0; i < LZ_SECTION_COUNT; i++)
+		*output_length += section_lengths[i];
+
+	if(!error && !(*output = allocator ? allocator->alloc(allocator->context, *output_length) : malloc(*output_length)))
+		error = MEM_ERROR;
+
+	if(!error) {
+		uint32_t magic = LZ_MAGIC;
+		uint64_t header_values[2 + LZ_SECTION_COUNT] = { input_length, writer.sequence_count };
+		size_t offset = LZ_HEADER_LENGTH;
+
+		for(size_t i = 0; i < LZ_SECTION_COUNT; i++)
+			header_values[2 + i] = section_lengths[i];
+
+		memcpy(*output, &magic, sizeof(magic));
+		memcpy(*output + sizeof(magic), header_values, sizeof(header_values));
+
+		for(size_t i = 0; i < LZ_SECTION_COUNT; i++) {
+			if(section_lengths[i]) /* Empty sections may have no buffer at all */
+				memcpy(*output + offset, sections[i], section_lengths[i]);
+
+			offset += section_lengths[i];
+		}
+	}
+
+	for(size_t i = 0; i < LZ_SECTION_COUNT; i++)
+		free(sections[i]);
+
+	for(size_t i = 0; i < 3; i++)
+		free(writer.codes[i]);
+
+	free(writer.literals);
+	free(finder.head);
+	free(finder.chain);
+
+	return error;
+}
+
+int huffman_lz_decompress(const uint8_t * input, const size_t input_length, uint8_t ** output, size_t * output_length)
+{
+	uint8_t * literals = NULL;
+	uint8_t * codes[3] = { NULL };
+	uint32_t magic;
+	uint64_t header_values[2 + LZ_SECTION_COUNT];
+	size_t section_start[LZ_SECTION_COUNT];
+	size_t offset = LZ_HEADER_LENGTH;
+	size_t literal_count = 0;
+	int error = EXIT_SUCCESS;
+
+	if(input_length < LZ_HEADER_LENGTH)
+		return INPUT_ERROR;
+
+	memcpy(&magic, input, sizeof(magic));
+	memcpy(header_values, input + sizeof(magic), sizeof(header_values));
+
+	uint64_t decompressed_length = header_values[0];
+	uint64_t sequence_count = header_values[1];
+
+	if(magic != LZ_MAGIC || !decompressed_length || decompressed_length > SIZE_MAX - 1 || sequence_count > decompressed_length / MIN_MATCH)
+		return INPUT_ERROR;
+
+	for(size_t i = 0; i < LZ_SECTION_COUNT; i++) {
+		if(header_values[2 + i] > input_length - offset)
+			return INPUT_ERROR;
+
+		section_start[i] = offset;
+		offset += header_values[2 + i];
+	}
+
+	/* Decode the Huffman coded sections, the literals take however many bytes their own header says */
+
+	if(header_values[2 + LITERAL_SECTION] && (error = huffman_decompressed_length(&input[section_start[LITERAL_SECTION]], header_values[2 + LITERAL_SECTION], &literal_count)) != EXIT_SUCCESS)
+		return error;
+
+	if(literal_count > decompressed_length)
+		return INPUT_ERROR;
+
+	/* Whatever the literals don't cover has to come from matches, so a header claiming more than they could copy is corrupt */
+
+	uint64_t match_bytes = decompressed_length - literal_count;
+
+	if(match_bytes / MAX_MATCH + (match_bytes % MAX_MATCH != 0) > sequence_count)
+		return INPUT_ERROR;
+
+	error = decompress_section(&input[section_start[LITERAL_SECTION]], header_values[2 + LITERAL_SECTION], literal_count, &literals);
+
+	for(size_t i = 0; i < 3 && !error; i++)
+		error = decompress_section(&input[section_start[LITERAL_LENGTH_SECTION + i]], header_values[2 + LITERAL_LENGTH_SECTION + i], sequence_count, &codes[i]);
+
+	if(!error && !(*output = malloc(decompressed_length + 1)))
+		error = MEM_ERROR;
+
+	if(!error) {
+		extra_reader_t reader = { .buffer = &input[section_start[EXTRA_BITS_SECTION]], .length = header_values[2 + EXTRA_BITS_SECTION], .bit_pos = 0 };
+
+		if((error = replay_sequences(&reader, literals, literal_count, (const uint8_t **)codes, sequence_count, *output, decompressed_length)) != EXIT_SUCCESS) {
+			free(*output);
+			*output = NULL;
+		}
+	}
+
+	if(!error)
+		*output_length = decompressed_length;
+
+	for(size_t i = 0; i < 3; i++)
+		free(codes[i]);
+
+	free(literals);
+
+	return error;
+}
@@ -1,9 +1,19 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
+#include "bench.h"
 #include "huffman.h"
+#include "pipeline.h"
 
 #define BASE_INPUT_LEN 1024
 #define BUFFER_MAX_LEN 65355
@@ -29,7 +39,154 @@ int compare(uint8_t * first, uint8_t * second, size_t len)
 
 void usage(const char * progname)
 {
-	fprintf(stderr, "%s: [file name]\n", progname);
+	fprintf(stderr, "%s: [file name]\n%s: -c|-d [input file] [output file]\n%s: -pc|-pd [input file] [output file] [threads]\n%s: -b [-o results.csv] [size|file]...\n", progname, progname, progname, progname);
+}
+
+int parse_thread_count(const char * argument, unsigned * thread_count)
+{
+	char * end;
+	unsigned long value;
+
+	errno = 0;
+	value = strtoul(argument, &end, 10);
+
+	if(end == argument || *end || strchr(argument, '-') || errno == ERANGE || value > UINT_MAX) /* strtoul() would happily negate " -1" into a huge count */
+		return -1;
+
+	*thread_count = value; /* Zero still means every processor */
+
+	return 0;
+}
+
+uint8_t * map_input(const char * filename, size_t * length)
+{
+	struct stat st;
+	uint8_t * input;
+	int fd;
+
+	if((fd = open(filename, O_RDONLY)) == -1) {
+		fprintf(stderr, "Error: Could not open file \"%s\"!\n", filename);
+		perror("open()");
+		return NULL;
+	}
+
+	if(fstat(fd, &st) == -1) {
+		perror("fstat()");
+		close(fd);
+		return NULL;
+	}
+
+	if(st.st_size == 0) {
+		fprintf(stderr, "Error: File \"%s\" is empty!\n", filename);
+		close(fd);
+		return NULL;
+	}
+
+	input = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd); /* The mapping stays valid after the descriptor is closed */
+
+	if(input == MAP_FAILED) {
+		perror("mmap()");
+		return NULL;
+	}
+
+	posix_madvise(input, st.st_size, POSIX_MADV_SEQUENTIAL);
+	*length = st.st_size;
+
+	return input;
+}
+
+int compress_file(const char * input_filename, const char * output_filename)
+{
+	uint8_t * input, * output;
+	size_t input_length, output_length, output_bound;
+	int fd, error;
+
+	if(!(input = map_input(input_filename, &input_length)))
+		return -1;
+
+	output_bound = huffman_compress_bound(input_length);
+
+	if((fd = open(output_filename, O_RDWR | O_CREAT | O_TRUNC, 0644)) == -1) {
+		fprintf(stderr, "Error: Could not open file \"%s\"!\n", output_filename);
+		perror("open()");
+		munmap(input, input_length);
+		return -1;
+	}
+
+	if(ftruncate(fd, output_bound) == -1 || (output = mmap(NULL, output_bound, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) { /* Encode straight into the page cache of the output file */
+		perror("mmap()");
+		close(fd);
+		unlink(output_filename); /* Don't leave a file of zeros that looks like output */
+		munmap(input, input_length);
+		return -1;
+	}
+
+	if((error = huffman_compress_to_existing_buffer(input, input_length, output, output_bound, &output_length, NULL)) != EXIT_SUCCESS)
+		fprintf(stderr, "[-] Error: Failed to compress \"%s\" (%d)!\n", input_filename, error);
+
+	munmap(output, output_bound);
+	munmap(input, input_length);
+
+	if(!error && ftruncate(fd, output_length) == -1) { /* Trim the file down from the worst case size */
+		perror("ftruncate()");
+		error = -1;
+	}
+
+	close(fd);
+
+	if(error)
+		unlink(output_filename); /* Partly written output is no use to anyone */
+	else
+		printf("[+] Compressed %zu bytes to %zu bytes\n", input_length, output_length);
+
+	return error ? -1 : 0;
+}
+
+int decompress_file(const char * input_filename, const char * output_filename)
+{
+	uint8_t * input, * output;
+	size_t input_length, output_length, decompressed_length;
+	int fd, error;
+
+	if(!(input = map_input(input_filename, &input_length)))
+		return -1;
+
+	if(huffman_decompressed_length(input, input_length, &output_length) != EXIT_SUCCESS) {
+		fprintf(stderr, "[-] Error: \"%s\" is not Huffman encoded!\n", input_filename);
+		munmap(input, input_length);
+		return -1;
+	}
+
+	if((fd = open(output_filename, O_RDWR | O_CREAT | O_TRUNC, 0644)) == -1) {
+		fprintf(stderr, "Error: Could not open file \"%s\"!\n", output_filename);
+		perror("open()");
+		munmap(input, input_length);
+		return -1;
+	}
+
+	if(ftruncate(fd, output_length) == -1 || (output = mmap(NULL, output_length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) { /* Decode straight into the page cache of the output file */
+		perror("mmap()");
+		close(fd);
+		unlink(output_filename); /* Don't leave a file of zeros that looks like output */
+		munmap(input, input_length);
+		return -1;
+	}
+
+	close(fd);
+
+	if((error = huffman_decompress_to_existing_buffer(input, input_length, output, output_length, &decompressed_length)) != EXIT_SUCCESS)
+		fprintf(stderr, "[-] Error: Failed to decompress \"%s\" (%d)!\n", input_filename, error);
+	else
+		printf("[+] Decompressed %zu bytes to %zu bytes\n", input_length, decompressed_length);
+
+	munmap(output, output_length);
+	munmap(input, input_length);
+
+	if(error)
+		unlink(output_filename); /* Partly decoded output is no use to anyone */
+
+	return error ? -1 : 0;
 }
 
 void show_progress(float progress)
@@ -98,6 +255,50 @@ int main(int argc, char ** argv)
 		.decompressed_length = 0
 	};
 
+	if(argc >= 2 && (!strcmp(argv[1], "-c") || !strcmp(argv[1], "-d"))) {
+		if(argc != 4) {
+			usage(argv[0]);
+			return -1;
+		}
+
+		return argv[1][1] == 'c' ? compress_file(argv[2], argv[3]) : decompress_file(argv[2], argv[3]);
+	}
+
+	if(argc >= 2 && (!strcmp(argv[1], "-pc") || !strcmp(argv[1], "-pd"))) { /* Read, code and write blocks on separate threads so the disk and the coding overlap */
+		if(argc != 4 && argc != 5) {
+			usage(argv[0]);
+			return -1;
+		}
+
+		size_t input_length, output_length;
+		unsigned thread_count = 0;
+
+		if(argc == 5 && parse_thread_count(argv[4], &thread_count)) {
+			usage(argv[0]);
+			return -1;
+		}
+
+		if(pipeline_file(argv[2], argv[3], argv[1][2] == 'd', thread_count, &input_length, &output_length))
+			return -1;
+
+		printf("[+] %s %zu bytes to %zu bytes\n", argv[1][2] == 'd' ? "Decompressed" : "Compressed", input_length, output_length);
+
+		return 0;
+	}
+
+	if(argc >= 2 && !strcmp(argv[1], "-b")) { /* Sizes such as 64K or 16M benchmark the synthetic corpora, anything else is read as a file */
+		if(argc >= 3 && !strcmp(argv[2], "-o")) {
+			if(argc < 4) {
+				usage(argv[0]);
+				return -1;
+			}
+
+			return run_benchmark(argc - 4, &argv[4], argv[3]) ? -1 : 0;
+		}
+
+		return run_benchmark(argc - 2, &argv[2], NULL) ? -1 : 0;
+	}
+
 	if(argc >= 2) {
 		printf("[+] Loading tests from \"%s\"\n", argv[1]);
 
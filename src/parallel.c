@@ -0,0 +1,292 @@
+/* 
+ *	Filename:	parallel.c
+ *	Author:	 	Jess Ferguson
+ *	Date:		14/10/26
+ *	Licence:	GNU GPL V3
+ *
+ *	Encode and decode large buffers as independent blocks spread across a pool of threads
+ *
+ *	Internal Functions:
+ *		- thread_count_or_default()	- Use every online processor when no thread count is given
+ *		- run_workers()				- Run a worker on the calling thread and up to thread_count - 1 others until every block is done
+ *		- estimate_worker()			- Work out the exact compressed size of blocks until none are left
+ *		- compress_worker()			- Compress blocks straight into their place in the output until none are left
+ *		- decompress_worker()		- Decompress blocks until none are left
+ *
+ *	Data structures:
+ *
+ *		Job:
+ *			- Blocks are handed out one at a time from a shared atomic counter, so a thread that finishes early takes the next block instead of idling
+ *			- The first error stops every thread from taking more blocks
+ *			- Compressing takes two passes over the blocks, the first sizes every block so the second can write each one at its final offset in the output
+ *
+ *	Encoded data format:
+ *
+ *		- Header
+ *			- Magic number, "HUFp" (1x uint32_t)
+ *			- Block size, the number of input bytes in every block but the last (1x uint32_t)
+ *			- Decompressed length (1x uint64_t)
+ *		- Block index
+ *			- End offset of each block, counted from the first byte after the index (1x uint64_t per block)
+ *		- Blocks
+ *			- Each block exactly as produced by huffman_compress()
+ *
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "huffman.h"
+
+#define PARALLEL_MAGIC 0x70465548 /* "HUFp" when stored as a little endian uint32_t */
+#define PARALLEL_HEADER_LENGTH 16
+#define INDEX_ENTRY_LENGTH 8
+
+#define DEFAULT_BLOCK_SIZE (1 << 20)
+#define MAX_BLOCK_SIZE (1 << 30)
+#define MAX_THREADS 256
+
+/* Job shared by every thread */
+
+typedef struct parallel_job_t {
+	const uint8_t * input;
+	size_t input_length;
+	size_t block_size;
+	size_t block_count;
+	const huffman_options_t * options;
+	size_t * block_lengths; /* Exact compressed size of each block, or NULL while decompressing */
+	size_t * block_offsets; /* Where each compressed block starts in the output */
+	const uint8_t * index; /* Block index, or NULL while compressing */
+	uint8_t * output;
+	atomic_size_t next_block;
+	atomic_int error;
+} parallel_job_t;
+
+/* Internal functions */
+
+static unsigned thread_count_or_default(const unsigned thread_count)
+{
+	long processors;
+
+	if(thread_count)
+		return thread_count < MAX_THREADS ? thread_count : MAX_THREADS;
+
+	processors = sysconf(_SC_NPROCESSORS_ONLN);
+
+	return processors < 1 ? 1 : processors < MAX_THREADS ? processors : MAX_THREADS;
+}
+
+static void run_workers(void * (*worker)(void *), parallel_job_t * job, unsigned thread_count)
+{
+	pthread_t threads[MAX_THREADS];
+	unsigned started = 0;
+
+	if(thread_count > job->block_count)
+		thread_count = job->block_count;
+
+	while(started + 1 < thread_count && !pthread_create(&threads[started], NULL, worker, job)) /* Carry on with fewer threads if one can't be started */
+		started++;
+
+	worker(job);
+
+	while(started)
+		pthread_join(threads[--started], NULL);
+}
+
+static void * estimate_worker(void * arg)
+{
+	parallel_job_t * job = arg;
+	size_t block;
+	int error;
+
+	while(!atomic_load(&job->error) && (block = atomic_fetch_add(&job->next_block, 1)) < job->block_count) {
+		size_t start = block * job->block_size;
+		size_t length = job->input_length - start < job->block_size ? job->input_length - start : job->block_size;
+
+		if((error = huffman_estimate_size(&job->input[start], length, job->options, &job->block_lengths[block])) != EXIT_SUCCESS)
+			atomic_store(&job->error, error);
+	}
+
+	return NULL;
+}
+
+static void * compress_worker(void * arg)
+{
+	parallel_job_t * job = arg;
+	size_t block, compressed_length;
+	int error;
+
+	while(!atomic_load(&job->error) && (block = atomic_fetch_add(&job->next_block, 1)) < job->block_count) {
+		size_t start = block * job->block_size;
+		size_t length = job->input_length - start < job->block_size ? job->input_length - start : job->block_size;
+
+		if((error = huffman_compress_to_existing_buffer(&job->input[start], length, &job->output[job->block_offsets[block]], job->block_lengths[block], &compressed_length, job->options)) != EXIT_SUCCESS)
+			atomic_store(&job->error, error);
+		else if(compressed_length != job->block_lengths[block]) /* The estimate is exact, anything else would leave a gap in the output */
+			atomic_store(&job->error, LENGTH_ERROR);
+	}
+
+	return NULL;
+}
+
+static void * decompress_worker(void * arg)
+{
+	parallel_job_t * job = arg;
+	size_t block, decompressed_length;
+	uint64_t block_start, block_end;
+	int error;
+
+	while(!atomic_load(&job->error) && (block = atomic_fetch_add(&job->next_block, 1)) < job->block_count) {
+		size_t start = block * job->block_size;
+		size_t length = job->input_length - start < job->block_size ? job->input_length - start : job->block_size;
+
+		block_start = 0;
+
+		if(block)
+			memcpy(&block_start, &job->index[(block - 1) * INDEX_ENTRY_LENGTH], sizeof(block_start));
+
+		memcpy(&block_end, &job->index[block * INDEX_ENTRY_LENGTH], sizeof(block_end));
+
+		if((error = huffman_decompress_to_existing_buffer(&job->input[block_start], block_end - block_start, &job->output[start], length, &decompressed_length)) != EXIT_SUCCESS)
+			atomic_store(&job->error, error);
+		else if(decompressed_length != length)
+			atomic_store(&job->error, INPUT_ERROR);
+	}
+
+	return NULL;
+}
+
+/* Interface functions */
+
+int huffman_encode_parallel(const uint8_t * input, const size_t input_length, uint8_t ** output, size_t * output_length, const huffman_options_t * options, size_t block_size, const unsigned thread_count)
+{
+	const huffman_allocator_t * allocator = options ? options->allocator : NULL;
+	parallel_job_t job = { .input = input, .input_length = input_length, .options = options };
+	uint64_t offset = 0;
+	size_t header_length;
+	int error;
+
+	if(!block_size)
+		block_size = DEFAULT_BLOCK_SIZE;
+
+	if(!input_length || block_size > MAX_BLOCK_SIZE)
+		return INPUT_ERROR;
+
+	job.block_size = block_size;
+	job.block_count = (input_length - 1) / block_size + 1;
+
+	if(!(job.block_lengths = calloc(job.block_count, sizeof(size_t))) || !(job.block_offsets = calloc(job.block_count, sizeof(size_t)))) {
+		free(job.block_lengths);
+
+		return MEM_ERROR;
+	}
+
+	/* Size every block first, so the output is allocated once at its final length */
+
+	run_workers(estimate_worker, &job, thread_count_or_default(thread_count));
+
+	header_length = PARALLEL_HEADER_LENGTH + job.block_count * INDEX_ENTRY_LENGTH;
+	*output_length = header_length;
+
+	for(size_t i = 0; i < job.block_count; i++) {
+		job.block_offsets[i] = *output_length;
+		*output_length += job.block_lengths[i];
+	}
+
+	if(!(error = atomic_load(&job.error)) && !(*output = allocator ? allocator->alloc(allocator->context, *output_length) : malloc(*output_length)))
+		error = MEM_ERROR;
+
+	if(!error) {
+		uint32_t magic = PARALLEL_MAGIC, stored_block_size = block_size;
+		uint64_t stored_length = input_length;
+
+		memcpy(*output, &magic, sizeof(magic));
+		memcpy(*output + 4, &stored_block_size, sizeof(stored_block_size));
+		memcpy(*output + 8, &stored_length, sizeof(stored_length));
+
+		for(size_t i = 0; i < job.block_count; i++) {
+			offset += job.block_lengths[i];
+			memcpy(*output + PARALLEL_HEADER_LENGTH + i * INDEX_ENTRY_LENGTH, &offset, sizeof(offset));
+		}
+
+		/* Then compress each block straight into its place */
+
+		job.output = *output;
+		atomic_store(&job.next_block, 0);
+		run_workers(compress_worker, &job, thread_count_or_default(thread_count));
+
+		if((error = atomic_load(&job.error)) != EXIT_SUCCESS) {
+			if(allocator)
+				allocator->free(allocator->context, *output);
+			else
+				free(*output);
+
+			*output = NULL;
+		}
+	}
+
+	free(job.block_lengths);
+	free(job.block_offsets);
+
+	return error;
+}
+
+int huffman_decode_parallel(const uint8_t * input, const size_t input_length, uint8_t ** output, size_t * output_length, const unsigned thread_count)
+{
+	parallel_job_t job = { 0 };
+	uint32_t magic, block_size;
+	uint64_t decompressed_length, offset, last_offset = 0;
+	size_t header_length;
+	int error;
+
+	if(input_length < PARALLEL_HEADER_LENGTH)
+		return INPUT_ERROR;
+
+	memcpy(&magic, input, sizeof(magic));
+	memcpy(&block_size, input + 4, sizeof(block_size));
+	memcpy(&decompressed_length, input + 8, sizeof(decompressed_length));
+
+	if(magic != PARALLEL_MAGIC || !block_size || block_size > MAX_BLOCK_SIZE || !decompressed_length || decompressed_length > SIZE_MAX - 1)
+		return INPUT_ERROR;
+
+	job.block_size = block_size;
+	job.block_count = (decompressed_length - 1) / block_size + 1;
+
+	if(job.block_count > (input_length - PARALLEL_HEADER_LENGTH) / INDEX_ENTRY_LENGTH)
+		return INPUT_ERROR;
+
+	header_length = PARALLEL_HEADER_LENGTH + job.block_count * INDEX_ENTRY_LENGTH;
+	job.index = input + PARALLEL_HEADER_LENGTH;
+	job.input = input + header_length;
+	job.input_length = decompressed_length;
+
+	for(size_t i = 0; i < job.block_count; i++) { /* Check the whole index up front so no worker reads outside the input */
+		memcpy(&offset, &job.index[i * INDEX_ENTRY_LENGTH], sizeof(offset));
+
+		if(offset < last_offset || offset > input_length - header_length)
+			return INPUT_ERROR;
+
+		last_offset = offset;
+	}
+
+	if(!(job.output = calloc(decompressed_length + 1, sizeof(uint8_t))))
+		return MEM_ERROR;
+
+	run_workers(decompress_worker, &job, thread_count_or_default(thread_count));
+
+	if((error = atomic_load(&job.error)) != EXIT_SUCCESS) {
+		free(job.output);
+
+		return error;
+	}
+
+	*output = job.output;
+	*output_length = decompressed_length;
+
+	return EXIT_SUCCESS;
+}
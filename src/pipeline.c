@@ -0,0 +1,475 @@
+/* 
+ *	Filename:	pipeline.c
+ *	Author:	 	Jess Ferguson
+ *	Date:		14/10/26
+ *	Licence:	GNU GPL V3
+ *
+ *	Compress and decompress files in blocks with reading, coding and writing all running at once on separate threads
+ *
+ *	Internal Functions:
+ *		- read_fully()			- Read until a buffer is full or the input ends, carrying on after short reads
+ *		- write_fully()			- Write a whole buffer, carrying on after short writes
+ *		- fail()				- Record the first error and wake every thread so they all stop
+ *		- read_block()			- Read the next block of a file to compress, or the next compressed block of a stream
+ *		- code_block()			- Compress or decompress the block in one slot
+ *		- reader()				- Read blocks into free slots in order until the input ends
+ *		- worker()				- Code blocks the reader has filled until there are none left
+ *		- run_writer()			- Write coded blocks in order and hand their slots back to the reader
+ *		- run_pipeline()		- Allocate the slots, start the reader and the workers and write on the calling thread
+ *
+ *	Data structures:
+ *
+ *		Pipeline:
+ *			- A ring of slots, each with an input and an output buffer that are allocated once and reused by every block that passes through it
+ *			- Block n always goes through slot n % slot_count. The reader fills slots in order and the writer empties them in order, so the ring is also
+ *			  the bounded queue between them and the reader is never more than slot_count blocks ahead of the writer
+ *			- Workers take whichever block the reader filled next, so blocks are coded out of order but written in order
+ *			- There are two slots per worker, so every worker can have its next block read while the writer still has its last one
+ *			- One mutex guards the slot states and counters, with a condition variable for each hand over
+ *
+ *	File format:
+ *
+ *		- The stream format of stream.c, so huffman_stream_update() can decompress the output and a stream can be decompressed here
+ *		- Every block is compressed on its own with huffman_compress_to_existing_buffer(), blocks from a huffman_stream_t that reuse
+ *		  the last block's table depend on the block before them and can't be decompressed in parallel, they fail with INPUT_ERROR
+ *		- Empty input files are rejected with the same error as the -c and -d modes give
+ *
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "huffman.h"
+#include "pipeline.h"
+
+#define STREAM_MAGIC 0x73465548 /* "HUFs" when stored as a little endian uint32_t, the same stream header as stream.c */
+#define STREAM_HEADER_LENGTH 8
+#define BLOCK_PREFIX_LENGTH 4
+
+#define PIPELINE_BLOCK_SIZE (1 << 20)
+#define MAX_BLOCK_SIZE (1 << 30)
+#define MAX_WORKERS 256
+#define SLOTS_PER_WORKER 2
+
+#define SLOT_FREE 0 /* Waiting for the reader */
+#define SLOT_READ 1 /* Waiting for a worker */
+#define SLOT_CODING 2
+#define SLOT_DONE 3 /* Waiting for the writer */
+
+/* One block on its way through the pipeline */
+
+typedef struct pipeline_slot_t {
+	uint8_t * input;
+	size_t input_length;
+	uint8_t * output; /* A compressed block starts with its size, so the writer can write it in one go */
+	size_t output_length;
+	int state;
+} pipeline_slot_t;
+
+/* State shared by the reader, the workers and the writer */
+
+typedef struct pipeline_t {
+	bool decompress;
+	int input_fd;
+	int output_fd;
+	size_t input_capacity;
+	size_t output_capacity;
+	pipeline_slot_t * slots;
+	size_t slot_count;
+	size_t blocks_read; /* The next block the reader fills goes in slot blocks_read % slot_count */
+	size_t blocks_taken;
+	size_t blocks_written;
+	size_t bytes_read;
+	size_t bytes_written;
+	bool end_of_input;
+	int error; /* Once set every thread stops */
+	pthread_mutex_t lock;
+	pthread_cond_t slot_freed; /* Writer to reader */
+	pthread_cond_t block_read; /* Reader to workers */
+	pthread_cond_t block_done; /* Workers to writer */
+} pipeline_t;
+
+/* Internal functions */
+
+static ssize_t read_fully(const int fd, uint8_t * buffer, const size_t length)
+{
+	size_t total = 0;
+
+	while(total < length) {
+		ssize_t result = read(fd, &buffer[total], length - total);
+
+		if(result == -1 && errno == EINTR)
+			continue;
+
+		if(result == -1)
+			return -1;
+
+		if(!result)
+			break;
+
+		total += result;
+	}
+
+	return total;
+}
+
+static int write_fully(const int fd, const uint8_t * buffer, const size_t length)
+{
+	size_t total = 0;
+
+	while(total < length) {
+		ssize_t result = write(fd, &buffer[total], length - total);
+
+		if(result == -1 && errno == EINTR)
+			continue;
+
+		if(result <= 0)
+			return WRITE_ERROR;
+
+		total += result;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+static void fail(pipeline_t * pipeline, const int error) /* Called with the lock held */
+{
+	if(!pipeline->error)
+		pipeline->error = error;
+
+	pthread_cond_broadcast(&pipeline->slot_freed);
+	pthread_cond_broadcast(&pipeline->block_read);
+	pthread_cond_broadcast(&pipeline->block_done);
+}
+
+static int read_block(pipeline_t * pipeline, pipeline_slot_t * slot, bool * end)
+{
+	uint8_t prefix[BLOCK_PREFIX_LENGTH];
+	uint32_t compressed_length;
+	ssize_t length;
+
+	if(!pipeline->decompress) {
+		if((length = read_fully(pipeline->input_fd, slot->input, pipeline->input_capacity)) == -1)
+			return INPUT_ERROR;
+
+		slot->input_length = length;
+		*end = !length;
+
+		return EXIT_SUCCESS;
+	}
+
+	/* A stream ends with a compressed size of zero, running out of input before that means it was cut short */
+
+	if(read_fully(pipeline->input_fd, prefix, BLOCK_PREFIX_LENGTH) != BLOCK_PREFIX_LENGTH)
+		return INPUT_ERROR;
+
+	memcpy(&compressed_length, prefix, sizeof(compressed_length));
+
+	if(compressed_length > pipeline->input_capacity)
+		return INPUT_ERROR;
+
+	if(read_fully(pipeline->input_fd, slot->input, compressed_length) != compressed_length)
+		return INPUT_ERROR;
+
+	slot->input_length = compressed_length;
+	*end = !compressed_length;
+
+	return EXIT_SUCCESS;
+}
+
+static int code_block(const pipeline_t * pipeline, pipeline_slot_t * slot)
+{
+	size_t length;
+	int error;
+
+	if(pipeline->decompress)
+		return huffman_decompress_to_existing_buffer(slot->input, slot->input_length, slot->output, pipeline->output_capacity, &slot->output_length);
+
+	if((error = huffman_compress_to_existing_buffer(slot->input, slot->input_length, &slot->output[BLOCK_PREFIX_LENGTH], pipeline->output_capacity - BLOCK_PREFIX_LENGTH, &length, NULL)) == EXIT_SUCCESS) {
+		uint32_t compressed_length = length;
+
+		memcpy(slot->output, &compressed_length, sizeof(compressed_length));
+		slot->output_length = BLOCK_PREFIX_LENGTH + length;
+	}
+
+	return error;
+}
+
+static void * reader(void * arg)
+{
+	pipeline_t * pipeline = arg;
+	bool end = false;
+
+	while(!end) {
+		pipeline_slot_t * slot;
+		int error;
+
+		pthread_mutex_lock(&pipeline->lock);
+		slot = &pipeline->slots[pipeline->blocks_read % pipeline->slot_count];
+
+		while(!pipeline->error && slot->state != SLOT_FREE)
+			pthread_cond_wait(&pipeline->slot_freed, &pipeline->lock);
+
+		error = pipeline->error;
+		pthread_mutex_unlock(&pipeline->lock);
+
+		if(error)
+			break;
+
+		error = read_block(pipeline, slot, &end); /* Outside the lock, so the workers and the writer carry on while this waits on the disk */
+
+		pthread_mutex_lock(&pipeline->lock);
+
+		if(error) {
+			fail(pipeline, error);
+			end = true;
+		} else if(end) {
+			pipeline->end_of_input = true;
+			pthread_cond_broadcast(&pipeline->block_read);
+			pthread_cond_broadcast(&pipeline->block_done);
+		} else {
+			slot->state = SLOT_READ;
+			pipeline->blocks_read++;
+			pipeline->bytes_read += slot->input_length;
+			pthread_cond_signal(&pipeline->block_read);
+		}
+
+		pthread_mutex_unlock(&pipeline->lock);
+	}
+
+	return NULL;
+}
+
+static void * worker(void * arg)
+{
+	pipeline_t * pipeline = arg;
+
+	for(;;) {
+		pipeline_slot_t * slot;
+		int error;
+
+		pthread_mutex_lock(&pipeline->lock);
+
+		while(!pipeline->error && pipeline->blocks_taken == pipeline->blocks_read && !pipeline->end_of_input)
+			pthread_cond_wait(&pipeline->block_read, &pipeline->lock);
+
+		if(pipeline->error || pipeline->blocks_taken == pipeline->blocks_read) { /* Stopped, or the input ended and every block has been taken */
+			pthread_mutex_unlock(&pipeline->lock);
+			break;
+		}
+
+		slot = &pipeline->slots[pipeline->blocks_taken++ % pipeline->slot_count];
+		slot->state = SLOT_CODING;
+		pthread_mutex_unlock(&pipeline->lock);
+
+		error = code_block(pipeline, slot);
+
+		pthread_mutex_lock(&pipeline->lock);
+
+		if(error) {
+			fail(pipeline, error);
+		} else {
+			slot->state = SLOT_DONE;
+			pthread_cond_signal(&pipeline->block_done);
+		}
+
+		pthread_mutex_unlock(&pipeline->lock);
+	}
+
+	return NULL;
+}
+
+static void run_writer(pipeline_t * pipeline)
+{
+	for(;;) {
+		pipeline_slot_t * slot;
+		int error;
+
+		pthread_mutex_lock(&pipeline->lock);
+		slot = &pipeline->slots[pipeline->blocks_written % pipeline->slot_count];
+
+		while(!pipeline->error && slot->state != SLOT_DONE && !(pipeline->end_of_input && pipeline->blocks_written == pipeline->blocks_read))
+			pthread_cond_wait(&pipeline->block_done, &pipeline->lock);
+
+		if(pipeline->error || slot->state != SLOT_DONE) {
+			pthread_mutex_unlock(&pipeline->lock);
+			break;
+		}
+
+		pthread_mutex_unlock(&pipeline->lock);
+
+		error = write_fully(pipeline->output_fd, slot->output, slot->output_length);
+
+		pthread_mutex_lock(&pipeline->lock);
+
+		if(error) {
+			fail(pipeline, error);
+		} else {
+			slot->state = SLOT_FREE;
+			pipeline->blocks_written++;
+			pipeline->bytes_written += slot->output_length;
+			pthread_cond_signal(&pipeline->slot_freed);
+		}
+
+		pthread_mutex_unlock(&pipeline->lock);
+	}
+}
+
+static int run_pipeline(pipeline_t * pipeline, unsigned worker_count)
+{
+	pthread_t reader_thread, worker_threads[MAX_WORKERS];
+	unsigned started = 0;
+	bool reader_started = false;
+	int error = EXIT_SUCCESS;
+
+	pipeline->slot_count = SLOTS_PER_WORKER * worker_count;
+
+	if(!(pipeline->slots = calloc(pipeline->slot_count, sizeof(pipeline_slot_t))))
+		return MEM_ERROR;
+
+	for(size_t i = 0; !error && i < pipeline->slot_count; i++) {
+		if(!(pipeline->slots[i].input = malloc(pipeline->input_capacity)) || !(pipeline->slots[i].output = malloc(pipeline->output_capacity)))
+			error = MEM_ERROR;
+	}
+
+	if(!error) {
+		pthread_mutex_init(&pipeline->lock, NULL);
+		pthread_cond_init(&pipeline->slot_freed, NULL);
+		pthread_cond_init(&pipeline->block_read, NULL);
+		pthread_cond_init(&pipeline->block_done, NULL);
+
+		while(started < worker_count && !pthread_create(&worker_threads[started], NULL, worker, pipeline)) /* Carry on with fewer workers if one can't be started */
+			started++;
+
+		if(started && !pthread_create(&reader_thread, NULL, reader, pipeline))
+			reader_started = true;
+
+		if(!reader_started) {
+			pthread_mutex_lock(&pipeline->lock);
+			fail(pipeline, MEM_ERROR);
+			pthread_mutex_unlock(&pipeline->lock);
+		}
+
+		run_writer(pipeline);
+
+		if(reader_started)
+			pthread_join(reader_thread, NULL);
+
+		while(started)
+			pthread_join(worker_threads[--started], NULL);
+
+		error = pipeline->error;
+
+		pthread_cond_destroy(&pipeline->block_done);
+		pthread_cond_destroy(&pipeline->block_read);
+		pthread_cond_destroy(&pipeline->slot_freed);
+		pthread_mutex_destroy(&pipeline->lock);
+	}
+
+	for(size_t i = 0; i < pipeline->slot_count; i++) {
+		free(pipeline->slots[i].input);
+		free(pipeline->slots[i].output);
+	}
+
+	free(pipeline->slots);
+
+	return error;
+}
+
+/* Interface functions */
+
+int pipeline_file(const char * input_filename, const char * output_filename, const bool decompress, const unsigned thread_count, size_t * input_length, size_t * output_length)
+{
+	pipeline_t pipeline = { .decompress = decompress };
+	uint32_t header[2] = { STREAM_MAGIC, PIPELINE_BLOCK_SIZE };
+	unsigned worker_count = thread_count;
+	ssize_t header_length = 0;
+	int error = EXIT_SUCCESS;
+
+	if(!worker_count) {
+		long processors = sysconf(_SC_NPROCESSORS_ONLN);
+
+		worker_count = processors < 1 ? 1 : processors;
+	}
+
+	if(worker_count > MAX_WORKERS)
+		worker_count = MAX_WORKERS;
+
+	if((pipeline.input_fd = open(input_filename, O_RDONLY)) == -1) {
+		fprintf(stderr, "Error: Could not open file \"%s\"!\n", input_filename);
+		perror("open()");
+		return -1;
+	}
+
+	posix_fadvise(pipeline.input_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	/* The block size comes from the stream header when decompressing, so it has to be read before any slot can be allocated */
+
+	if(decompress && !(header_length = read_fully(pipeline.input_fd, (uint8_t *)header, STREAM_HEADER_LENGTH))) {
+		fprintf(stderr, "Error: File \"%s\" is empty!\n", input_filename); /* The same as map_input(), so -d and -pd agree */
+		close(pipeline.input_fd);
+		return -1;
+	}
+
+	if(decompress && (header_length != STREAM_HEADER_LENGTH || header[0] != STREAM_MAGIC || !header[1] || header[1] > MAX_BLOCK_SIZE)) {
+		fprintf(stderr, "[-] Error: \"%s\" is not a Huffman block stream!\n", input_filename);
+		close(pipeline.input_fd);
+		return -1;
+	}
+
+	pipeline.input_capacity = decompress ? huffman_compress_bound(header[1]) : header[1];
+	pipeline.output_capacity = decompress ? header[1] : BLOCK_PREFIX_LENGTH + huffman_compress_bound(header[1]);
+
+	if((pipeline.output_fd = open(output_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1) {
+		fprintf(stderr, "Error: Could not open file \"%s\"!\n", output_filename);
+		perror("open()");
+		close(pipeline.input_fd);
+		return -1;
+	}
+
+	if(!decompress)
+		error = write_fully(pipeline.output_fd, (uint8_t *)header, STREAM_HEADER_LENGTH);
+
+	if(!error)
+		error = run_pipeline(&pipeline, worker_count);
+
+	if(!error && !decompress && !pipeline.bytes_read) { /* huffman_compress() has no encoding for nothing, so -c can't compress an empty file and neither does -pc */
+		fprintf(stderr, "Error: File \"%s\" is empty!\n", input_filename);
+		close(pipeline.output_fd);
+		close(pipeline.input_fd);
+		unlink(output_filename);
+		return -1;
+	}
+
+	if(!error && !decompress) { /* End of stream */
+		uint32_t end = 0;
+
+		error = write_fully(pipeline.output_fd, (uint8_t *)&end, sizeof(end));
+	}
+
+	if(close(pipeline.output_fd) == -1 && !error)
+		error = WRITE_ERROR;
+
+	close(pipeline.input_fd);
+
+	if(error) {
+		fprintf(stderr, "[-] Error: Failed to %s \"%s\" (%d)!\n", decompress ? "decompress" : "compress", input_filename, error);
+		unlink(output_filename); /* Like -c and -d, a failed run leaves no output that could be mistaken for the real thing */
+		return -1;
+	}
+
+	/* Count the stream header, block sizes and end of stream on the compressed side too */
+
+	*input_length = decompress ? STREAM_HEADER_LENGTH + pipeline.blocks_read * BLOCK_PREFIX_LENGTH + pipeline.bytes_read + BLOCK_PREFIX_LENGTH : pipeline.bytes_read;
+	*output_length = decompress ? pipeline.bytes_written : STREAM_HEADER_LENGTH + pipeline.bytes_written + BLOCK_PREFIX_LENGTH;
+
+	return 0;
+}
@@ -0,0 +1,281 @@
+/* 
+ *	Filename:	stream.c
+ *	Author:	 	Jess Ferguson
+ *	Date:		14/10/26
+ *	Licence:	GNU GPL V3
+ *
+ *	Encode and decode a byte stream of unknown length in fixed size blocks using Huffman coding
+ *
+ *	Internal Functions:
+ *		- emit()				- Pass data to the stream's write callback
+ *		- compress_block()		- Encode one block of input behind its size and emit both at once
+ *		- process_stage()		- Act on a complete stream header, block size or block while decompressing
+ *		- destroy_stream()		- Free a stream and everything it holds
+ *
+ *	Data structures:
+ *
+ *		Stream:
+ *			- Holds at most one block of input while compressing, or one compressed block while decompressing, so memory use is bounded by the block size
+ *			- Output is passed to the write callback as soon as each block is complete
+ *			- Keeps the table of the last block coded with one, so a block whose bytes are distributed much like the last can leave its own table out
+ *
+ *	Stream format:
+ *
+ *		- Stream header
+ *			- Magic number, "HUFs" (1x uint32_t)
+ *			- Block size, the most input bytes in any one block (1x uint32_t)
+ *		- Blocks
+ *			- Compressed size of the block (1x uint32_t)
+ *			- The block, exactly as produced by huffman_encoder_compress()
+ *		- End of stream, a compressed size of zero (1x uint32_t)
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "huffman.h"
+
+#define STREAM_MAGIC 0x73465548 /* "HUFs" when stored as a little endian uint32_t */
+#define STREAM_HEADER_LENGTH 8
+#define BLOCK_PREFIX_LENGTH 4
+
+#define DEFAULT_BLOCK_SIZE (1 << 17)
+#define MAX_BLOCK_SIZE (1 << 30)
+
+#define STAGE_STREAM_HEADER 0 /* Stages of decompression, each waits for `need` bytes of input before moving on */
+#define STAGE_BLOCK_PREFIX 1
+#define STAGE_BLOCK 2
+#define STAGE_END 3
+
+/* Stream state */
+
+struct huffman_stream_t {
+	int mode;
+	int error; /* Once set every later call fails with the same error */
+	huffman_options_t options;
+	huffman_write_t write;
+	void * context;
+	size_t block_size;
+	uint8_t * buffer; /* Input waiting to be compressed, or a compressed block waiting to be decompressed */
+	size_t buffer_length;
+	uint8_t * block; /* Decompressed block, or a compressed block behind its size */
+	huffman_encoder_t * encoder; /* Table of the last block, while compressing */
+	huffman_decoder_t * decoder; /* Decoding table of the last block, while decompressing */
+	uint8_t prefix[STREAM_HEADER_LENGTH]; /* Stream header or block size waiting to be read */
+	uint8_t stage;
+	size_t need;
+};
+
+/* Internal functions */
+
+static int emit(huffman_stream_t * stream, const uint8_t * data, const size_t length)
+{
+	if(stream->write(stream->context, data, length))
+		return WRITE_ERROR;
+
+	return EXIT_SUCCESS;
+}
+
+static int compress_block(huffman_stream_t * stream, const uint8_t * input, const size_t length)
+{
+	size_t compressed_length;
+	int error;
+
+	if((error = huffman_encoder_compress(stream->encoder, input, length, &stream->block[BLOCK_PREFIX_LENGTH], huffman_compress_bound(stream->block_size), &compressed_length, &stream->options)) != EXIT_SUCCESS)
+		return error;
+
+	uint32_t block_length = compressed_length;
+
+	memcpy(stream->block, &block_length, sizeof(block_length));
+
+	return emit(stream, stream->block, BLOCK_PREFIX_LENGTH + compressed_length);
+}
+
+static int process_stage(huffman_stream_t * stream)
+{
+	uint32_t value;
+	size_t decompressed_length;
+	int error;
+
+	switch(stream->stage) {
+		case STAGE_STREAM_HEADER:
+			memcpy(&value, stream->prefix, sizeof(value));
+
+			if(value != STREAM_MAGIC)
+				return INPUT_ERROR;
+
+			memcpy(&value, &stream->prefix[4], sizeof(value));
+
+			if(!value || value > MAX_BLOCK_SIZE)
+				return INPUT_ERROR;
+
+			stream->block_size = value;
+
+			if(!(stream->buffer = malloc(huffman_compress_bound(stream->block_size))) || !(stream->block = malloc(stream->block_size)))
+				return MEM_ERROR;
+
+			stream->stage = STAGE_BLOCK_PREFIX;
+			stream->need = BLOCK_PREFIX_LENGTH;
+			break;
+
+		case STAGE_BLOCK_PREFIX:
+			memcpy(&value, stream->prefix, sizeof(value));
+
+			if(value > huffman_compress_bound(stream->block_size))
+				return INPUT_ERROR;
+
+			stream->stage = value ? STAGE_BLOCK : STAGE_END;
+			stream->need = value;
+			break;
+
+		case STAGE_BLOCK:
+			if((error = huffman_decoder_decompress_block(&stream->decoder, 0, stream->buffer, stream->buffer_length, stream->block, stream->block_size, &decompressed_length)) != EXIT_SUCCESS)
+				return error;
+
+			if((error = emit(stream, stream->block, decompressed_length)) != EXIT_SUCCESS)
+				return error;
+
+			stream->stage = STAGE_BLOCK_PREFIX;
+			stream->need = BLOCK_PREFIX_LENGTH;
+			break;
+
+		default:
+			return INPUT_ERROR; /* Nothing can come after the end of the stream */
+	}
+
+	stream->buffer_length = 0;
+
+	return EXIT_SUCCESS;
+}
+
+static void destroy_stream(huffman_stream_t * stream)
+{
+	huffman_encoder_destroy(stream->encoder);
+	huffman_decoder_destroy(stream->decoder);
+	free(stream->buffer);
+	free(stream->block);
+	free(stream);
+}
+
+/* Interface functions */
+
+int huffman_stream_init(huffman_stream_t ** stream, const int mode, const size_t block_size, const huffman_options_t * options, huffman_write_t write, void * context)
+{
+	int error;
+
+	*stream = NULL; /* Every error leaves no stream behind, so there is nothing to finish */
+
+	if(block_size > MAX_BLOCK_SIZE || (mode != HUFFMAN_STREAM_COMPRESS && mode != HUFFMAN_STREAM_DECOMPRESS))
+		return INPUT_ERROR;
+
+	if(!(*stream = calloc(1, sizeof(huffman_stream_t))))
+		return MEM_ERROR;
+
+	(*stream)->mode = mode;
+	(*stream)->write = write;
+	(*stream)->context = context;
+
+	if(options)
+		(*stream)->options = *options;
+
+	if(mode == HUFFMAN_STREAM_DECOMPRESS) { /* The block size comes from the stream header */
+		(*stream)->stage = STAGE_STREAM_HEADER;
+		(*stream)->need = STREAM_HEADER_LENGTH;
+
+		return EXIT_SUCCESS;
+	}
+
+	(*stream)->block_size = block_size ? block_size : DEFAULT_BLOCK_SIZE;
+
+	if(!((*stream)->buffer = malloc((*stream)->block_size)) || !((*stream)->block = malloc(BLOCK_PREFIX_LENGTH + huffman_compress_bound((*stream)->block_size))) || huffman_encoder_create(&(*stream)->encoder) != EXIT_SUCCESS) {
+		free((*stream)->buffer);
+		free((*stream)->block);
+		free(*stream);
+		*stream = NULL;
+
+		return MEM_ERROR;
+	}
+
+	uint32_t header[2] = { STREAM_MAGIC, (*stream)->block_size };
+
+	if((error = emit(*stream, (const uint8_t *)header, sizeof(header))) != EXIT_SUCCESS) {
+		destroy_stream(*stream);
+		*stream = NULL;
+	}
+
+	return error;
+}
+
+int huffman_stream_update(huffman_stream_t * stream, const uint8_t * input, size_t length)
+{
+	if(stream->error)
+		return stream->error;
+
+	while(length) {
+		if(stream->mode == HUFFMAN_STREAM_COMPRESS) {
+			if(!stream->buffer_length && length >= stream->block_size) { /* Whole blocks are compressed straight from the caller's buffer */
+				if((stream->error = compress_block(stream, input, stream->block_size)) != EXIT_SUCCESS)
+					return stream->error;
+
+				input += stream->block_size;
+				length -= stream->block_size;
+				continue;
+			}
+
+			size_t copy = stream->block_size - stream->buffer_length < length ? stream->block_size - stream->buffer_length : length;
+
+			memcpy(&stream->buffer[stream->buffer_length], input, copy);
+			stream->buffer_length += copy;
+			input += copy;
+			length -= copy;
+
+			if(stream->buffer_length == stream->block_size) {
+				if((stream->error = compress_block(stream, stream->buffer, stream->buffer_length)) != EXIT_SUCCESS)
+					return stream->error;
+
+				stream->buffer_length = 0;
+			}
+		} else {
+			if(stream->stage == STAGE_END)
+				return stream->error = INPUT_ERROR;
+
+			uint8_t * target = stream->stage == STAGE_BLOCK ? stream->buffer : stream->prefix;
+			size_t copy = stream->need - stream->buffer_length < length ? stream->need - stream->buffer_length : length;
+
+			memcpy(&target[stream->buffer_length], input, copy);
+			stream->buffer_length += copy;
+			input += copy;
+			length -= copy;
+
+			if(stream->buffer_length == stream->need && (stream->error = process_stage(stream)) != EXIT_SUCCESS)
+				return stream->error;
+		}
+	}
+
+	return EXIT_SUCCESS;
+}
+
+int huffman_stream_finish(huffman_stream_t * stream)
+{
+	if(!stream)
+		return EXIT_SUCCESS;
+
+	int error = stream->error;
+
+	if(!error && stream->mode == HUFFMAN_STREAM_COMPRESS) {
+		const uint8_t end[BLOCK_PREFIX_LENGTH] = { 0 };
+
+		if(stream->buffer_length)
+			error = compress_block(stream, stream->buffer, stream->buffer_length);
+
+		if(!error)
+			error = emit(stream, end, sizeof(end));
+	} else if(!error && stream->stage != STAGE_END) {
+		error = INPUT_ERROR; /* The stream was cut short */
+	}
+
+	destroy_stream(stream);
+
+	return error;
+}